@@ -0,0 +1,201 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <ceres/ceres.h>
+#include <ba/LocalParamSe3.h>
+#include <sophus/se3.hpp>
+
+#include <Eigen/Core>
+#include "etc_common.h"
+#include "ceres_cost_terms.h"
+
+///
+/// \brief Bundle adjustment problem that lives across keyframes. Every
+/// update visits the poses and tracks that should be in the window: blocks
+/// that are already in the problem are kept, along with any observation whose
+/// measurement has not changed, and only new states and observations are
+/// added. Whatever was not visited is removed at the end of the update.
+/// Parameter values live in the poses and tracks, so each solve is warm
+/// started from the latest tracker estimates.
+///
+class CeresBaProblem {
+public:
+  CeresBaProblem() : local_param_(new LocalParamSe3) {
+    solver_options_.linear_solver_type = ceres::SPARSE_SCHUR;
+    solver_options_.function_tolerance = 1e-3;
+    solver_options_.trust_region_strategy_type = ceres::DOGLEG;
+    solver_options_.minimizer_progress_to_stdout = true;
+    Reset();
+  }
+
+  /// Drops all state. Must be called whenever the poses are cleared.
+  void Reset() {
+    ceres::Problem::Options problem_options;
+    problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    problem_options.local_parameterization_ownership =
+        ceres::DO_NOT_TAKE_OWNERSHIP;
+    problem_options.enable_fast_removal = true;
+    problem_.reset(new ceres::Problem(problem_options));
+    poses_.clear();
+    tracks_.clear();
+    has_prior_ = false;
+  }
+
+  /// Starts an update. The prior is removed first, since it may reference
+  /// poses that are about to leave the window.
+  void BeginUpdate() {
+    generation_++;
+    if (has_prior_) {
+      problem_->RemoveResidualBlock(prior_id_);
+      has_prior_ = false;
+    }
+  }
+
+  void AddPose(uint32_t pose_id, Sophus::SE3d& t_wp, bool is_constant) {
+    auto it = poses_.find(pose_id);
+    if (it == poses_.end()) {
+      problem_->AddParameterBlock(t_wp.data(), 7, local_param_.get());
+      it = poses_.insert(std::make_pair(pose_id, PoseEntry())).first;
+      it->second.t_wp = t_wp.data();
+    }
+    it->second.generation = generation_;
+    if (is_constant) {
+      problem_->SetParameterBlockConstant(t_wp.data());
+    } else {
+      problem_->SetParameterBlockVariable(t_wp.data());
+    }
+  }
+
+  ///
+  /// \brief Adds the track and its observations, or brings them up to date.
+  /// All poses the track is observed in must have been added.
+  /// \param residual_ids The track's residual blocks are appended to this.
+  ///
+  void AddTrack(std::shared_ptr<sdtrack::DenseTrack>& track,
+                uint32_t ref_pose_id,
+                std::vector<std::shared_ptr<sdtrack::TrackerPose>>& poses,
+                calibu::Rig<Scalar>& rig,
+                ceres::LossFunctionWrapper* loss_function,
+                std::vector<ceres::ResidualBlockId>& residual_ids) {
+    auto it = tracks_.find(track.get());
+    if (it == tracks_.end()) {
+      problem_->AddParameterBlock(&track->ref_keypoint.rho, 1, NULL);
+      it = tracks_.insert(std::make_pair(track.get(), TrackEntry())).first;
+      it->second.track = track;
+      it->second.ray = track->ref_keypoint.ray;
+    }
+    TrackEntry& entry = it->second;
+    entry.generation = generation_;
+
+    // The ray is baked into the cost functions, so a re-backprojected track
+    // needs all of its observations rebuilt.
+    if (entry.ray != track->ref_keypoint.ray) {
+      for (auto& obs : entry.observations) {
+        problem_->RemoveResidualBlock(obs.second.residual_id);
+      }
+      entry.observations.clear();
+      entry.ray = track->ref_keypoint.ray;
+    }
+
+    const uint32_t num_cameras = rig.cameras_.size();
+    for (uint32_t cam_id = 0; cam_id < num_cameras; ++cam_id) {
+      for (size_t jj = 0; jj < track->keypoints.size(); ++jj) {
+        if (!track->keypoints[jj][cam_id].tracked ||
+            (jj == 0 && cam_id == track->ref_cam_id)) {
+          continue;
+        }
+        const Eigen::Vector2d& z = track->keypoints[jj][cam_id].kp;
+        const uint32_t key = jj * num_cameras + cam_id;
+        auto obs = entry.observations.find(key);
+        if (obs != entry.observations.end() && obs->second.z != z) {
+          problem_->RemoveResidualBlock(obs->second.residual_id);
+          entry.observations.erase(obs);
+          obs = entry.observations.end();
+        }
+        if (obs == entry.observations.end()) {
+          Observation new_obs;
+          new_obs.z = z;
+          new_obs.residual_id = AddProjectionResidualToCeres(
+                *problem_, track, poses[ref_pose_id]->t_wp,
+                poses[ref_pose_id + jj]->t_wp, z, cam_id, rig, false, false,
+                loss_function);
+          obs = entry.observations.insert(std::make_pair(key, new_obs)).first;
+        }
+        obs->second.generation = generation_;
+        residual_ids.push_back(obs->second.residual_id);
+      }
+    }
+
+    // Drop observations that are no longer tracked.
+    for (auto obs = entry.observations.begin();
+         obs != entry.observations.end();) {
+      if (obs->second.generation != generation_) {
+        problem_->RemoveResidualBlock(obs->second.residual_id);
+        obs = entry.observations.erase(obs);
+      } else {
+        ++obs;
+      }
+    }
+  }
+
+  /// Removes every track and pose that was not visited in this update.
+  void EndUpdate() {
+    for (auto it = tracks_.begin(); it != tracks_.end();) {
+      if (it->second.generation != generation_) {
+        // Also removes the track's residual blocks.
+        problem_->RemoveParameterBlock(&it->second.track->ref_keypoint.rho);
+        it = tracks_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    for (auto it = poses_.begin(); it != poses_.end();) {
+      if (it->second.generation != generation_) {
+        problem_->RemoveParameterBlock(it->second.t_wp);
+        it = poses_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  /// Tracks the prior residual block, so it can be replaced next update.
+  void set_prior(ceres::ResidualBlockId prior_id) {
+    prior_id_ = prior_id;
+    has_prior_ = true;
+  }
+
+  ceres::Problem& problem() { return *problem_; }
+  ceres::Solver::Options& solver_options() { return solver_options_; }
+
+private:
+  struct PoseEntry {
+    double* t_wp = nullptr;
+    uint32_t generation = 0;
+  };
+
+  struct Observation {
+    Eigen::Matrix<double, 2, 1, Eigen::DontAlign> z;
+    ceres::ResidualBlockId residual_id;
+    uint32_t generation = 0;
+  };
+
+  struct TrackEntry {
+    std::shared_ptr<sdtrack::DenseTrack> track;
+    Eigen::Vector3d ray;
+    // Keyed by keypoint index * num_cameras + cam_id.
+    std::map<uint32_t, Observation> observations;
+    uint32_t generation = 0;
+  };
+
+  std::unique_ptr<LocalParamSe3> local_param_;
+  std::unique_ptr<ceres::Problem> problem_;
+  ceres::Solver::Options solver_options_;
+  std::map<uint32_t, PoseEntry> poses_;
+  std::unordered_map<sdtrack::DenseTrack*, TrackEntry> tracks_;
+  ceres::ResidualBlockId prior_id_;
+  bool has_prior_ = false;
+  uint32_t generation_ = 0;
+};
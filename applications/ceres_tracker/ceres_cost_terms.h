@@ -46,7 +46,8 @@ struct InvepthCost {
                   const T* const _rho,
                   T* _r) const {
     Eigen::Map<Eigen::Matrix<T, 2, 1>> r(_r); // residual vector
-    const Eigen::Matrix<T, Eigen::Dynamic, 1> params_t = params_.cast<T>();
+    const Eigen::Matrix<T, CameraType::kParamSize, 1> params_t =
+        params_.template cast<T>();
 
     const Eigen::Map<const Sophus::SE3Group<T>> t_wv_r(_t_wv_r); // ref pose
     const Eigen::Map<const Sophus::SE3Group<T>> t_wv_m(_t_wv_m); // meas pose
@@ -69,8 +70,127 @@ struct InvepthCost {
   Sophus::SE3d t_cv_m_;
   Eigen::Vector3d l_c_r_;
   Eigen::Vector2d z_;
-  Eigen::VectorXd params_;
+  Eigen::Matrix<double, CameraType::kParamSize, 1> params_;
   bool posegraph_mode_;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+///
+/// \brief Derivative of R(q) * y with respect to the raw quaternion
+/// coefficients (x, y, z, w), where R(q) = I + 2w[v]x + 2(vv^T - v^Tv I).
+///
+inline Eigen::Matrix<double, 3, 4> dRotate_dq(const double* q,
+                                              const Eigen::Vector3d& y) {
+  const Eigen::Map<const Eigen::Vector3d> v(q);
+  const double w = q[3];
+  Eigen::Matrix<double, 3, 4> j;
+  j.leftCols<3>() = -2 * w * Sophus::SO3d::hat(y) +
+      2 * v.dot(y) * Eigen::Matrix3d::Identity() + 2 * v * y.transpose() -
+      4 * y * v.transpose();
+  j.col(3) = 2 * v.cross(y);
+  return j;
+}
+
+///
+/// \brief Derivative of R(q)^T * u with respect to the raw quaternion
+/// coefficients. R(q)^T is R evaluated at the conjugate quaternion.
+///
+inline Eigen::Matrix<double, 3, 4> dRotateInverse_dq(
+    const double* q, const Eigen::Vector3d& u) {
+  const Eigen::Map<const Eigen::Vector3d> v(q);
+  const double w = q[3];
+  Eigen::Matrix<double, 3, 4> j;
+  j.leftCols<3>() = 2 * w * Sophus::SO3d::hat(u) +
+      2 * v.dot(u) * Eigen::Matrix3d::Identity() + 2 * v * u.transpose() -
+      4 * u * v.transpose();
+  j.col(3) = -2 * v.cross(u);
+  return j;
+}
+
+///
+/// \brief Same residual as InvepthCost, with closed-form jacobians. The pose
+/// jacobians are with respect to the 7 raw SE3 coefficients, as autodiff
+/// would produce, so any local parameterization can be used on top.
+///
+template<typename CameraType>
+class InvDepthAnalyticCost : public ceres::SizedCostFunction<2, 7, 7, 1> {
+public:
+  InvDepthAnalyticCost(const Sophus::SE3d& t_vc_r,
+                       const Sophus::SE3d& t_vc_m,
+                       const Eigen::Vector3d& l_c_r,
+                       const Eigen::Vector2d& z,
+                       const Eigen::VectorXd& params,
+                       bool posegraph_mode)
+      : t_vc_r_(posegraph_mode ? Sophus::SE3d() : t_vc_r),
+        t_cv_m_(posegraph_mode ? Sophus::SE3d() : t_vc_m.inverse()),
+        r_cv_m_(t_cv_m_.rotationMatrix()), l_c_r_(l_c_r), z_(z),
+        params_(params)
+  {}
+
+  virtual bool Evaluate(double const* const* parameters, double* residuals,
+                        double** jacobians) const {
+    const Eigen::Map<const Sophus::SE3d> t_wv_r(parameters[0]);
+    const Eigen::Map<const Sophus::SE3d> t_wv_m(parameters[1]);
+    const double rho = parameters[2][0];
+    const Eigen::Matrix3d r_wv_r = t_wv_r.rotationMatrix();
+    const Eigen::Matrix3d r_wv_m = t_wv_m.rotationMatrix();
+
+    // The homogeneous point (l_c_r, rho) is taken through the reference
+    // extrinsics, the reference pose, the inverse measurement pose and the
+    // inverse measurement extrinsics.
+    const Eigen::Vector3d l_v_r =
+        t_vc_r_.so3() * l_c_r_ + rho * t_vc_r_.translation();
+    const Eigen::Vector3d l_w = r_wv_r * l_v_r + rho * t_wv_r.translation();
+    const Eigen::Vector3d l_w_m = l_w - rho * t_wv_m.translation();
+    const Eigen::Vector3d l_v_m = r_wv_m.transpose() * l_w_m;
+    const Eigen::Vector3d l_c_m = r_cv_m_ * l_v_m + rho * t_cv_m_.translation();
+
+    Eigen::Vector2d pix;
+    CameraType::template Project<double>(l_c_m.data(), params_.data(),
+                                         pix.data());
+    Eigen::Map<Eigen::Vector2d> r(residuals);
+    r = z_ - pix;
+
+    if (jacobians == NULL) {
+      return true;
+    }
+
+    Eigen::Matrix<double, 2, 3> dproj_dray;
+    CameraType::template dProject_dray<double>(l_c_m.data(), params_.data(),
+                                               dproj_dray.data());
+    const Eigen::Matrix<double, 2, 3> dr_dl_v_m = -dproj_dray * r_cv_m_;
+    const Eigen::Matrix<double, 2, 3> dr_dl_w = dr_dl_v_m * r_wv_m.transpose();
+
+    if (jacobians[0] != NULL) {
+      Eigen::Map<Eigen::Matrix<double, 2, 7, Eigen::RowMajor>> j(jacobians[0]);
+      j.leftCols<4>() = dr_dl_w * dRotate_dq(parameters[0], l_v_r);
+      j.rightCols<3>() = dr_dl_w * rho;
+    }
+    if (jacobians[1] != NULL) {
+      Eigen::Map<Eigen::Matrix<double, 2, 7, Eigen::RowMajor>> j(jacobians[1]);
+      j.leftCols<4>() = dr_dl_v_m * dRotateInverse_dq(parameters[1], l_w_m);
+      j.rightCols<3>() = -dr_dl_w * rho;
+    }
+    if (jacobians[2] != NULL) {
+      Eigen::Map<Eigen::Vector2d> j(jacobians[2]);
+      j = dr_dl_w * (r_wv_r * t_vc_r_.translation() + t_wv_r.translation() -
+                     t_wv_m.translation()) -
+          dproj_dray * t_cv_m_.translation();
+    }
+    return true;
+  }
+
+private:
+  Sophus::SE3d t_vc_r_;
+  Sophus::SE3d t_cv_m_;
+  Eigen::Matrix3d r_cv_m_;
+  Eigen::Vector3d l_c_r_;
+  Eigen::Vector2d z_;
+  Eigen::Matrix<double, CameraType::kParamSize, 1> params_;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
 ///
@@ -236,15 +356,13 @@ ceres::ResidualBlockId AddProjectionResidualBlockToCeres(
   } else {
     residual_id =
         problem.AddResidualBlock(
-          new ceres::AutoDiffCostFunction<
-          InvepthCost<CamType>, 2, 7, 7, 1>(
-            new InvepthCost<CamType>(
-              cam_rig.t_wc_[ref_cam_id],       // Ref. cam extrinsics.
-              cam_rig.t_wc_[meas_cam_id],  // Meas. cam extrinsics.
-              track->ref_keypoint.ray,
-              z,
-              cam_rig.cameras_[meas_cam_id]->GetParams(),
-              posegraph_mode)),
+          new InvDepthAnalyticCost<CamType>(
+            cam_rig.t_wc_[ref_cam_id],       // Ref. cam extrinsics.
+            cam_rig.t_wc_[meas_cam_id],  // Meas. cam extrinsics.
+            track->ref_keypoint.ray,
+            z,
+            cam_rig.cameras_[meas_cam_id]->GetParams(),
+            posegraph_mode),
           loss_function,
           ref_pose.data(),
           meas_pose.data(),
@@ -10,6 +10,8 @@ static int& ba_debug_level =
     CVarUtils::CreateCVar<>("debug.BaDebugLevel",-1, "");
 static uint32_t& num_ba_poses =
     CVarUtils::CreateCVar<>("sd.NumBAPoses",10u, "");
+static uint32_t& num_ba_landmarks =
+    CVarUtils::CreateCVar<>("sd.NumBALandmarks", 0u, "");
 static int& num_features =
     CVarUtils::CreateCVar<>("sd.NumFeatures",128, "");
 static int& feature_cells =
@@ -28,6 +30,8 @@ static bool& use_robust_norm_for_proj =
     CVarUtils::CreateCVar<>("sd.UseRobustNormForProj", true, "");
 static int& num_ba_iterations =
     CVarUtils::CreateCVar<>("sd.NumBAIterations", 200, "");
+static bool& use_marginalization =
+    CVarUtils::CreateCVar<>("sd.UseMarginalization", true, "");
 static int& num_ceres_threads =
     CVarUtils::CreateCVar<>("sd.NumCeresThreads", 1, "");
 static double& tracker_center_weight =
@@ -0,0 +1,228 @@
+#pragma once
+#include <algorithm>
+#include <set>
+#include <vector>
+#include <ceres/ceres.h>
+#include <sophus/se3.hpp>
+
+#include <Eigen/Core>
+#include <Eigen/Eigenvalues>
+#include <Eigen/StdVector>
+
+///
+/// \brief Dense Gaussian prior on a set of SE3 pose blocks, linearized at
+/// x0_. The residual is sqrt_info_ * log(x0^-1 * x) + r0_, so that its
+/// squared norm reproduces the quadratic cost of the marginalized states up
+/// to a constant. The tangent coordinates match the right-multiplied update
+/// of LocalParamSe3.
+///
+struct MarginalizationPriorCost {
+  MarginalizationPriorCost(
+      const std::vector<Sophus::SE3d>& x0,
+      const Eigen::MatrixXd& sqrt_info,
+      const Eigen::VectorXd& r0)
+      : x0_(x0), sqrt_info_(sqrt_info), r0_(r0)
+  {}
+
+  template<typename T>
+  bool operator()(T const* const* _t_wp, T* _r) const {
+    Eigen::Matrix<T, Eigen::Dynamic, 1> delta(x0_.size() * 6);
+    for (size_t ii = 0; ii < x0_.size(); ++ii) {
+      const Eigen::Map<const Sophus::SE3Group<T>> t_wp(_t_wp[ii]);
+      delta.template segment<6>(ii * 6) =
+          (x0_[ii].cast<T>().inverse() * t_wp).log();
+    }
+    Eigen::Map<Eigen::Matrix<T, Eigen::Dynamic, 1>> r(_r, r0_.rows());
+    r = sqrt_info_.cast<T>() * delta + r0_.cast<T>();
+    return true;
+  }
+
+  std::vector<Sophus::SE3d> x0_;
+  Eigen::MatrixXd sqrt_info_;
+  Eigen::VectorXd r0_;
+};
+
+///
+/// \brief Folds the oldest pose of a fixed-lag window, and the landmarks
+/// anchored on it, into a dense prior on the poses they were connected to.
+/// The prior replaces keeping old covisible poses around as constant blocks,
+/// so the problem is bounded by the active window rather than by the
+/// longest live track.
+///
+class Marginalizer {
+public:
+  /// Whether there is a prior for the window starting at start_pose_id. If a
+  /// bundle adjustment was skipped the prior no longer lines up with the
+  /// window and is dropped.
+  bool HasPrior(uint32_t start_pose_id) {
+    if (!blocks_.empty() && start_pose_id != marginalized_pose_id_ + 1) {
+      blocks_.clear();
+    }
+    return !blocks_.empty();
+  }
+
+  ///
+  /// \brief Adds the current prior to the problem. All of its pose blocks
+  /// must already be in the problem.
+  ///
+  ceres::ResidualBlockId AddPriorToCeres(ceres::Problem& problem) {
+    ceres::DynamicAutoDiffCostFunction<MarginalizationPriorCost>* cost =
+        new ceres::DynamicAutoDiffCostFunction<MarginalizationPriorCost>(
+          new MarginalizationPriorCost(x0_, sqrt_info_, r0_));
+    for (size_t ii = 0; ii < blocks_.size(); ++ii) {
+      cost->AddParameterBlock(7);
+    }
+    cost->SetNumResiduals(r0_.rows());
+    return problem.AddResidualBlock(cost, NULL, blocks_);
+  }
+
+  ///
+  /// \brief Marginalize
+  /// \param problem Solved problem containing the pose.
+  /// \param pose_id Index of the pose that leaves the window next.
+  /// \param t_wp Pose to marginalize.
+  /// \param is_constant Whether the pose was held constant. Its information
+  /// is then simply dropped, which anchors the remaining poses.
+  /// \param min_eigenvalue Directions with less information than this are
+  /// treated as unobserved.
+  /// \return false if nothing was connected to the pose.
+  ///
+  bool Marginalize(ceres::Problem& problem, uint32_t pose_id,
+                   Sophus::SE3d& t_wp, bool is_constant,
+                   double min_eigenvalue = 1e-8) {
+    double* marg_pose = t_wp.data();
+    std::vector<ceres::ResidualBlockId> residuals;
+    problem.GetResidualBlocksForParameterBlock(marg_pose, &residuals);
+
+    // Landmarks are anchored at their reference pose, so every inverse depth
+    // touched by the pose's residuals lives on the pose and goes with it.
+    std::set<ceres::ResidualBlockId> marg_residuals(residuals.begin(),
+                                                    residuals.end());
+    std::vector<double*> marg_blocks;
+    if (!is_constant) {
+      marg_blocks.push_back(marg_pose);
+    }
+    std::vector<double*> kept_blocks;
+    std::vector<double*> blocks;
+    for (ceres::ResidualBlockId residual : residuals) {
+      problem.GetParameterBlocksForResidualBlock(residual, &blocks);
+      for (double* block : blocks) {
+        if (block == marg_pose) {
+          continue;
+        } else if (problem.ParameterBlockSize(block) == 1) {
+          if (std::find(marg_blocks.begin(), marg_blocks.end(), block) ==
+              marg_blocks.end()) {
+            marg_blocks.push_back(block);
+            std::vector<ceres::ResidualBlockId> lm_residuals;
+            problem.GetResidualBlocksForParameterBlock(block, &lm_residuals);
+            marg_residuals.insert(lm_residuals.begin(), lm_residuals.end());
+          }
+        }
+      }
+    }
+    for (ceres::ResidualBlockId residual : marg_residuals) {
+      problem.GetParameterBlocksForResidualBlock(residual, &blocks);
+      for (double* block : blocks) {
+        if (block != marg_pose && problem.ParameterBlockSize(block) == 7 &&
+            std::find(kept_blocks.begin(), kept_blocks.end(), block) ==
+            kept_blocks.end()) {
+          kept_blocks.push_back(block);
+        }
+      }
+    }
+
+    blocks_.clear();
+    if (kept_blocks.empty()) {
+      return false;
+    }
+
+    // Linearize every residual touching the marginalized states at the
+    // current estimate. Blocks left out of the evaluation are held constant.
+    ceres::Problem::EvaluateOptions ev_options;
+    ev_options.residual_blocks.assign(marg_residuals.begin(),
+                                      marg_residuals.end());
+    ev_options.parameter_blocks = marg_blocks;
+    ev_options.parameter_blocks.insert(ev_options.parameter_blocks.end(),
+                                       kept_blocks.begin(), kept_blocks.end());
+    ev_options.apply_loss_function = true;
+    std::vector<double> residual_values;
+    ceres::CRSMatrix crs_jacobian;
+    problem.Evaluate(ev_options, NULL, &residual_values, NULL, &crs_jacobian);
+
+    Eigen::MatrixXd jacobian =
+        Eigen::MatrixXd::Zero(crs_jacobian.num_rows, crs_jacobian.num_cols);
+    for (int row = 0; row < crs_jacobian.num_rows; ++row) {
+      for (int idx = crs_jacobian.rows[row]; idx < crs_jacobian.rows[row + 1];
+           ++idx) {
+        jacobian(row, crs_jacobian.cols[idx]) = crs_jacobian.values[idx];
+      }
+    }
+    const Eigen::Map<Eigen::VectorXd> r(residual_values.data(),
+                                        residual_values.size());
+    const Eigen::MatrixXd h = jacobian.transpose() * jacobian;
+    const Eigen::VectorXd g = jacobian.transpose() * r;
+
+    // Schur complement onto the kept poses.
+    const int kept_dim = kept_blocks.size() * 6;
+    const int marg_dim = h.rows() - kept_dim;
+    const Eigen::MatrixXd h_mm_inv =
+        PseudoInverse(h.topLeftCorner(marg_dim, marg_dim), min_eigenvalue);
+    const Eigen::MatrixXd h_km_h_mm_inv =
+        h.bottomLeftCorner(kept_dim, marg_dim) * h_mm_inv;
+    const Eigen::MatrixXd h_prior = h.bottomRightCorner(kept_dim, kept_dim) -
+        h_km_h_mm_inv * h.topRightCorner(marg_dim, kept_dim);
+    const Eigen::VectorXd g_prior =
+        g.tail(kept_dim) - h_km_h_mm_inv * g.head(marg_dim);
+
+    // Factor the prior back into a residual: h = J^T J and g = J^T r0.
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(
+          0.5 * (h_prior + h_prior.transpose()));
+    const Eigen::VectorXd& values = eig.eigenvalues();
+    int first_observed = 0;
+    while (first_observed < values.rows() &&
+           values[first_observed] <= min_eigenvalue) {
+      first_observed++;
+    }
+    const int rank = values.rows() - first_observed;
+    if (rank == 0) {
+      return false;
+    }
+    const Eigen::VectorXd sqrt_values = values.tail(rank).cwiseSqrt();
+    const Eigen::MatrixXd basis = eig.eigenvectors().rightCols(rank);
+    sqrt_info_ = sqrt_values.asDiagonal() * basis.transpose();
+    r0_ = sqrt_values.cwiseInverse().asDiagonal() *
+        (basis.transpose() * g_prior);
+
+    x0_.clear();
+    for (double* block : kept_blocks) {
+      x0_.push_back(Eigen::Map<Sophus::SE3d>(block));
+    }
+    blocks_ = kept_blocks;
+    marginalized_pose_id_ = pose_id;
+    return true;
+  }
+
+  void Clear() { blocks_.clear(); }
+
+  uint32_t num_prior_poses() const { return blocks_.size(); }
+
+private:
+  static Eigen::MatrixXd PseudoInverse(const Eigen::MatrixXd& m,
+                                       double min_eigenvalue) {
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(m);
+    Eigen::VectorXd inv_values = eig.eigenvalues();
+    for (int ii = 0; ii < inv_values.rows(); ++ii) {
+      inv_values[ii] =
+          inv_values[ii] > min_eigenvalue ? 1.0 / inv_values[ii] : 0;
+    }
+    return eig.eigenvectors() * inv_values.asDiagonal() *
+        eig.eigenvectors().transpose();
+  }
+
+  // Pose blocks of the prior, in the order of x0_.
+  std::vector<double*> blocks_;
+  std::vector<Sophus::SE3d> x0_;
+  Eigen::MatrixXd sqrt_info_;
+  Eigen::VectorXd r0_;
+  uint32_t marginalized_pose_id_ = 0;
+};
@@ -20,13 +20,20 @@
 #include "etc_common.h"
 #include "ceres_tracker_cvars.h"
 #include "ceres_cost_terms.h"
+#include "marginalization.h"
+#include "ceres_ba_problem.h"
+#include "landmark_selector.h"
 #ifdef CHECK_NANS
 #include <xmmintrin.h>
 #endif
 
 #include <ceres/ceres.h>
 #include <ba/LocalParamSe3.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 #include <sdtrack/semi_dense_tracker.h>
+#include <sdtrack/trace.h>
+#include <sdtrack/diagnostics.h>
 
 uint32_t keyframe_tracks = UINT_MAX;
 uint32_t frame_count = 0;
@@ -61,6 +68,9 @@ std::shared_ptr<pb::Image> camera_img;
 std::vector<std::shared_ptr<sdtrack::TrackerPose>> poses;
 std::vector<std::unique_ptr<SceneGraph::GLAxis>> axes;
 ba::BundleAdjuster<double, 1, 6, 0> bundle_adjuster;
+Marginalizer marginalizer;
+CeresBaProblem ba_problem;
+sdtrack::LandmarkSelector landmark_selector;
 
 ceres::LossFunctionWrapper loss_function(new ceres::SoftLOneLoss(1),
                                          ceres::DO_NOT_TAKE_OWNERSHIP);
@@ -69,6 +79,7 @@ ceres::LossFunctionWrapper loss_function(new ceres::SoftLOneLoss(1),
 std::vector<cv::KeyPoint> keypoints;
 
 void DoBundleAdjustmentCeres(uint32_t num_active_poses, uint32_t id) {
+  SDTRACK_TRACE_SCOPE("DoBundleAdjustmentCeres");
   if (reset_outliers) {
     for (std::shared_ptr<sdtrack::TrackerPose> pose : poses) {
       for (std::shared_ptr<sdtrack::DenseTrack> track : pose->tracks) {
@@ -78,10 +89,7 @@ void DoBundleAdjustmentCeres(uint32_t num_active_poses, uint32_t id) {
     reset_outliers = false;
   }
 
-  LocalParamSe3* local_param = new LocalParamSe3();
-  ceres::Problem::Options problem_options;
-  problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
-  ceres::Problem problem(problem_options);
+  ceres::Problem& problem = ba_problem.problem();
 
   uint32_t num_outliers = 0;
   Sophus::SE3d t_ba;
@@ -89,6 +97,11 @@ void DoBundleAdjustmentCeres(uint32_t num_active_poses, uint32_t id) {
   double build_time = sdtrack::Tic();
 
   GetBaPoseRange(poses, num_active_poses, start_pose, start_active_pose);
+  if (use_marginalization) {
+    // Older covisible poses are represented by the marginalization prior
+    // instead of being added as constant blocks.
+    start_pose = start_active_pose;
+  }
 
   if (start_pose == poses.size()) {
     return;
@@ -100,71 +113,67 @@ void DoBundleAdjustmentCeres(uint32_t num_active_poses, uint32_t id) {
   if (current_tracks && poses.size() > 1) {
     std::shared_ptr<sdtrack::TrackerPose> last_pose = poses.back();
 
-    // First add all the poses and landmarks to ba.
+    // Bring the problem up to date with the window. Poses, landmarks and
+    // observations that are already in it are kept as they are.
+    ba_problem.BeginUpdate();
     for (uint32_t ii = start_pose; ii < poses.size(); ++ii) {
-      std::shared_ptr<sdtrack::TrackerPose> pose = poses[ii];
-      problem.AddParameterBlock(pose->t_wp.data(), 7, local_param);
       // Deactivate the start pose if all poses are active. Otherwise make
       // mark the inactive set as constant in Ceres.
-      if (ii < start_active_pose || (all_poses_active && ii == 0)) {
-        problem.SetParameterBlockConstant(pose->t_wp.data());
-      }
-      //      pose->opt_id[id] = bundle_adjuster.AddPose(
-      //            pose->t_wp, ii >= start_active_pose );
-      for (std::shared_ptr<sdtrack::DenseTrack> track : pose->tracks) {
-        const bool constrains_active =
-            track->keypoints.size() + ii > start_active_pose;
-        if (track->num_good_tracked_frames == 1 || track->is_outlier ||
-            !constrains_active) {
-          track->external_id[id] = UINT_MAX;
-          continue;
-        } else {
-          problem.AddParameterBlock(&track->ref_keypoint.rho, 1, NULL);
-          track->external_id[id] = 0;
-        }
-      }
+      ba_problem.AddPose(ii, poses[ii]->t_wp, ii < start_active_pose ||
+                         (all_poses_active && ii == 0));
     }
 
-    std::map<uint32_t, std::vector<ceres::ResidualBlockId>> lm_residuals;
+    // Residual blocks of all landmarks, stored contiguously per track so
+    // they can be evaluated in a single call after the solve.
+    std::vector<std::shared_ptr<sdtrack::DenseTrack>> ba_tracks;
+    std::vector<uint32_t> track_residual_offsets;
+    std::vector<ceres::ResidualBlockId> residual_blocks;
+
+    // Pick the landmarks that go into the problem.
+    landmark_selector.Select(
+          poses, start_pose, poses.size() - 1, rig, num_ba_landmarks,
+          [&](uint32_t pose_id, const sdtrack::DenseTrack& track) {
+      const bool constrains_active =
+          track.keypoints.size() + pose_id > start_active_pose;
+      return track.num_good_tracked_frames == 1 || track.is_outlier ||
+          !constrains_active ? sdtrack::LandmarkSelector::kExcluded :
+                               sdtrack::LandmarkSelector::kCandidate;
+    });
 
-    // Now add all reprojections to ba)
     for (uint32_t ii = start_pose; ii < poses.size(); ++ii) {
       std::shared_ptr<sdtrack::TrackerPose> ref_pose = poses[ii];
       for (std::shared_ptr<sdtrack::DenseTrack> track : ref_pose->tracks) {
-        if (track->external_id[id] == UINT_MAX) {
+        if (!landmark_selector.IsSelected(*track)) {
+          track->external_id[id] = UINT_MAX;
           continue;
         }
-        for (uint32_t cam_id = 0; cam_id < rig.cameras_.size(); ++cam_id) {
-          for (size_t jj = 0; jj < track->keypoints.size(); ++jj) {
-            if (track->keypoints[jj][cam_id].tracked &&
-                !(jj == 0 && cam_id == track->ref_cam_id)) {
-              lm_residuals[track->id].push_back(AddProjectionResidualToCeres(
-                  problem, track, poses[ii]->t_wp, poses[ii + jj]->t_wp,
-                  track->keypoints[jj][cam_id].kp, cam_id, rig, false, false,
-                  &loss_function));
-            }
-          }
-        }
+        track->external_id[id] = 0;
+        ba_tracks.push_back(track);
+        track_residual_offsets.push_back(residual_blocks.size());
+        ba_problem.AddTrack(track, ii, poses, rig, &loss_function,
+                            residual_blocks);
       }
     }
+    ba_problem.EndUpdate();
 
+    if (use_marginalization && marginalizer.HasPrior(start_pose)) {
+      ba_problem.set_prior(marginalizer.AddPriorToCeres(problem));
+    }
+
+    track_residual_offsets.push_back(residual_blocks.size());
     build_time = sdtrack::Toc(build_time);
 
     double solve_time = sdtrack::Tic();
     ceres::Solver::Summary summary;
-    ceres::Solver::Options options;
+    ceres::Solver::Options& options = ba_problem.solver_options();
     options.num_threads = num_ceres_threads;
     options.num_linear_solver_threads = num_ceres_threads;
-    options.linear_solver_type = ceres::SPARSE_SCHUR;
-    options.function_tolerance = 1e-3;
-    options.trust_region_strategy_type = ceres::DOGLEG;
-    options.minimizer_progress_to_stdout = true;
     ceres::Solve(options, &problem, &summary);
     solve_time = sdtrack::Toc(solve_time);
 
     double write_time = sdtrack::Tic();
 
-    // Read out the pose and landmark values.
+    // Read out the pose values.
     for (uint32_t ii = start_pose; ii < poses.size(); ++ii) {
       std::shared_ptr<sdtrack::TrackerPose> pose = poses[ii];
 
@@ -172,48 +181,73 @@ void DoBundleAdjustmentCeres(uint32_t num_active_poses, uint32_t id) {
       last_t_ba = t_ba;
       t_ba = last_pose->t_wp.inverse() * pose->t_wp;
       for (std::shared_ptr<sdtrack::DenseTrack> track : pose->tracks) {
-        if (track->external_id[id] == UINT_MAX) {
-          continue;
-        }
-        track->t_ba = t_ba;
-
-        std::vector<double> residuals;
-        uint32_t num_outliers_meas = 0;
-
-        ceres::Problem::EvaluateOptions ev_options;
-        ev_options.residual_blocks = lm_residuals[track->id];
-        ev_options.num_threads = num_ceres_threads;
-        ev_options.apply_loss_function = false;
-        problem.Evaluate(ev_options, NULL, &residuals, NULL, NULL);
-
-        for (uint32_t ii = 0; ii < residuals.size(); ii += 2) {
-          double cost = sqrt(residuals[ii] * residuals[ii] +
-                             residuals[ii + 1] * residuals[ii + 1]);
-          if (cost > outlier_threshold) {
-            num_outliers_meas++;
-          }
+        // Landmarks left out by the budget still follow the poses.
+        if (landmark_selector.IsCandidate(*track)) {
+          track->t_ba = t_ba;
         }
+      }
+    }
+
+    // Evaluate the residuals of all landmarks in one go. Every projection
+    // residual block is 2d, so block kk starts at residual 2 * kk. An empty
+    // block list would make Ceres evaluate the whole problem instead.
+    std::vector<double> residuals;
+    if (!residual_blocks.empty()) {
+      ceres::Problem::EvaluateOptions ev_options;
+      ev_options.residual_blocks = residual_blocks;
+      ev_options.num_threads = num_ceres_threads;
+      ev_options.apply_loss_function = false;
+      problem.Evaluate(ev_options, NULL, &residuals, NULL, NULL);
+    }
 
-        const double outlier_ratio =
-            (double)num_outliers_meas / (double)ev_options.residual_blocks.size();
+    std::vector<uint8_t> is_rejected(ba_tracks.size(), 0);
+    if (do_outlier_rejection && !residual_blocks.empty()) {
+      tbb::parallel_for(
+            tbb::blocked_range<int>(0, ba_tracks.size()),
+            [&](const tbb::blocked_range<int>& range) {
+        for (int kk = range.begin(); kk != range.end(); ++kk) {
+          const std::shared_ptr<sdtrack::DenseTrack>& track = ba_tracks[kk];
+          const uint32_t start = track_residual_offsets[kk];
+          const uint32_t end = track_residual_offsets[kk + 1];
+          uint32_t num_outliers_meas = 0;
+          for (uint32_t jj = start; jj < end; ++jj) {
+            const double cost =
+                Eigen::Map<const Eigen::Vector2d>(&residuals[2 * jj]).norm();
+            if (cost > outlier_threshold) {
+              num_outliers_meas++;
+            }
+          }
 
-        if (do_outlier_rejection) {
+          const double outlier_ratio = end == start ? 0 :
+              (double)num_outliers_meas / (double)(end - start);
           if (outlier_ratio > 0.3 &&
               ((track->keypoints.size() == num_ba_poses - 1) ||
                track->tracked == false)) {
-            num_outliers++;
+            is_rejected[kk] = 1;
             track->is_outlier = true;
           } else {
             track->is_outlier = false;
           }
         }
-      }
+      });
     }
+    num_outliers = std::count(is_rejected.begin(), is_rejected.end(), 1);
     write_time = sdtrack::Toc(write_time);
+
+    // The oldest pose leaves the window with the next keyframe, so fold it
+    // and its landmarks into the prior while the problem is still around.
+    double marg_time = sdtrack::Tic();
+    if (use_marginalization && poses.size() >= num_active_poses) {
+      marginalizer.Marginalize(problem, start_pose, poses[start_pose]->t_wp,
+                               all_poses_active && start_pose == 0);
+    }
+    marg_time = sdtrack::Toc(marg_time);
+
     std::cerr << "Rejected " << num_outliers << " outliers."
               << "Threads: " << summary.num_threads_used
               << " build: " << build_time << " solve: " << solve_time
-              << " write: " << write_time << std::endl;
+              << " write: " << write_time << " marg: " << marg_time
+              << std::endl;
   }
 }
 
@@ -231,8 +265,8 @@ void UpdateCurrentPose() {
     max_track_length = std::max(track->keypoints.size(), max_track_length);
   }
   new_pose->longest_track = max_track_length;
-  std::cerr << "Setting longest track for pose " << poses.size() << " to "
-            << new_pose->longest_track << std::endl;
+  SDTRACK_LOG(FRAME) << "Setting longest track for pose " << poses.size() << " to "
+      << new_pose->longest_track;
 }
 
 void BaAndStartNewLandmarks() {
@@ -258,7 +292,8 @@ void BaAndStartNewLandmarks() {
   }
 }
 
-void ProcessImage(std::vector<cv::Mat>& images) {
+void ProcessImage(
+    std::vector<std::shared_ptr<sdtrack::FrameBuffer>>& images) {
 #ifdef CHECK_NANS
   _MM_SET_EXCEPTION_MASK(
       _MM_GET_EXCEPTION_MASK() &
@@ -317,8 +352,8 @@ void ProcessImage(std::vector<cv::Mat>& images) {
     bool keyframe_condition =
         track_ratio < 0.8 || total_trans > 0.2 || total_rot > 0.1;
 
-    std::cerr << "\tRatio: " << track_ratio << " trans: " << total_trans
-              << " rot: " << total_rot << std::endl;
+    SDTRACK_LOG(FRAME) << "\tRatio: " << track_ratio << " trans: " << total_trans
+        << " rot: " << total_rot;
 
     if (keyframe_tracks != 0) {
       if (keyframe_condition) {
@@ -339,19 +374,19 @@ void ProcessImage(std::vector<cv::Mat>& images) {
     tracker.AddKeyframe();
   }
 
-  std::cerr << "Num successful : " << tracker.num_successful_tracks()
-            << " keyframe tracks: " << keyframe_tracks << std::endl;
+  SDTRACK_LOG(FRAME) << "Num successful : " << tracker.num_successful_tracks()
+      << " keyframe tracks: " << keyframe_tracks;
 
   if (!is_manual_mode) {
     BaAndStartNewLandmarks();
   }
 
   if (is_keyframe) {
-    std::cerr << "KEYFRAME." << std::endl;
+    SDTRACK_LOG(INFO) << "KEYFRAME.";
     keyframe_tracks = tracker.GetCurrentTracks().size();
-    std::cerr << "New keyframe tracks: " << keyframe_tracks << std::endl;
+    SDTRACK_LOG(INFO) << "New keyframe tracks: " << keyframe_tracks;
   } else {
-    std::cerr << "NOT KEYFRAME." << std::endl;
+    SDTRACK_LOG(FRAME) << "NOT KEYFRAME.";
   }
 
   current_tracks = &tracker.GetCurrentTracks();
@@ -362,8 +397,7 @@ void ProcessImage(std::vector<cv::Mat>& images) {
       (_MM_MASK_INVALID | _MM_MASK_OVERFLOW | _MM_MASK_DIV_ZERO));
 #endif
 
-  std::cerr << "FRAME : " << frame_count << " KEYFRAME: " << poses.size()
-            << std::endl;
+  SDTRACK_LOG(FRAME) << "FRAME : " << frame_count << " KEYFRAME: " << poses.size();
 }
 
 void DrawImageData(uint32_t cam_id) {
@@ -451,11 +485,9 @@ void Run() {
       gui_vars.handler->image_height = image_height;
       gui_vars.handler->image_width = image_width;
 
-      std::vector<cv::Mat> cvmat_images;
-      for (int ii = 0; ii < images->Size(); ++ii) {
-        cvmat_images.push_back(images->at(ii)->Mat());
-      }
-      ProcessImage(cvmat_images);
+      std::vector<std::shared_ptr<sdtrack::FrameBuffer>> frames =
+          BorrowFrames(images);
+      ProcessImage(frames);
     }
 
     if (camera_img && camera_img->data()) {
@@ -531,6 +563,8 @@ void InitGui() {
     is_prev_keyframe = true;
     is_running = false;
     InitTracker();
+    ba_problem.Reset();
+    marginalizer.Clear();
     poses.clear();
     gui_vars.scene_graph.Clear();
     gui_vars.scene_graph.AddChild(&gui_vars.grid);
@@ -638,7 +672,14 @@ int main(int argc, char** argv) {
 
   ba::debug_level_threshold = -1;
 
+  const std::string trace_file = cl->follow("", "-trace");
+  sdtrack::TraceRecorder::Instance().set_enabled(!trace_file.empty());
+
   Run();
 
+  if (!trace_file.empty()) {
+    sdtrack::TraceRecorder::Instance().WriteChromeTrace(trace_file);
+  }
+
   return 0;
 }
@@ -16,10 +16,14 @@
 #include <SceneGraph/GLDynamicGrid.h>
 #include <pangolin/pangolin.h>
 #include <ba/BundleAdjuster.h>
-#include <ba/InterpolationBuffer.h>
 #include <sdtrack/utils.h>
 #include "math_types.h"
 #include "gui_common.h"
+#include "ba_window.h"
+#include "imu_history.h"
+#include "imu_preintegration.h"
+#include "ba_scheduler.h"
+#include "spsc_ring.h"
 #include "etc_common.h"
 #include "CVars/CVar.h"
 #include "chi2inv.h"
@@ -31,6 +35,8 @@
 
 #define POSES_TO_INIT 30
 #include <sdtrack/semi_dense_tracker.h>
+#include <sdtrack/trace.h>
+#include <sdtrack/diagnostics.h>
 
 #include <ceres/ceres.h>
 #include <ba/LocalParamSe3.h>
@@ -56,7 +62,7 @@ bool do_bundle_adjustment = true;
 bool do_start_new_landmarks = true;
 int image_width;
 int image_height;
-std::shared_ptr<std::thread> aac_thread;
+sdtrack::BaScheduler ba_scheduler;
 std::mutex aac_mutex;
 
 calibu::CameraRigT<Scalar> old_rig;
@@ -85,12 +91,17 @@ SceneGraph::AxisAlignedBoundingBox aabb;
 ba::BundleAdjuster<double, 1, 6, 0> bundle_adjuster;
 ba::BundleAdjuster<double, 1, 15, 0> vi_bundle_adjuster;
 ba::BundleAdjuster<double, 1, 15, 0> aac_bundle_adjuster;
-ba::InterpolationBufferT<ba::ImuMeasurementT<Scalar>, Scalar> imu_buffer;
+// Filled by the IMU driver thread and drained by the tracking thread.
+sdtrack::SpscRing<ba::ImuMeasurementT<Scalar>> imu_ring(4096);
+sdtrack::ImuHistory<ba::ImuMeasurementT<Scalar>> imu_buffer;
+sdtrack::ImuPreintegrationCache<ba::ImuMeasurementT<Scalar>> imu_preintegration;
 std::vector<uint32_t> ba_imu_residual_ids, aac_imu_residual_ids;
 int orig_num_aac_poses = num_aac_poses;
 double prev_cond_error;
 int imu_cond_start_pose_id = -1;
 int imu_cond_residual_id = -1;
+// Window state of each adjuster, indexed like TrackerPose::opt_id.
+sdtrack::BaWindow<ba::ImuMeasurementT<Scalar>> ba_windows[3];
 
 TrackerHandler *handler;
 pangolin::OpenGlRenderState render_state;
@@ -106,16 +117,24 @@ void ImuCallback(const pb::ImuMsg& ref) {
   Eigen::VectorXd a, w;
   pb::ReadVector(ref.accel(), &a);
   pb::ReadVector(ref.gyro(), &w);
-  imu_buffer.AddElement(ba::ImuMeasurementT<Scalar>(w, a, ref.device_time()));
+  imu_ring.Push(ba::ImuMeasurementT<Scalar>(w, a, ref.device_time()));
   // std::cerr << "Added accel: " << a.transpose() << " and gyro " <<
   //              w.transpose() << " at time " << ref.device_time() << std::endl;
 }
 
+// Moves the measurements received by ImuCallback into imu_buffer.
+void DrainImu() {
+  imu_ring.Drain([](const ba::ImuMeasurementT<Scalar>& meas) {
+    imu_buffer.AddElement(meas);
+  });
+}
+
 template <typename BaType>
 void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
                         bool initialize_lm, bool do_adaptive_conditioning,
                         uint32_t id, std::vector<uint32_t>& imu_residual_ids)
 {
+  SDTRACK_TRACE_SCOPE("DoBundleAdjustment");
   if (initialize_lm) {
     use_imu = false;
   }
@@ -172,8 +191,9 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
       if (use_imu) {
         ba.SetGravity(gravity_vector);
       }
-      ba.Init(options, end_pose_id + 1,
-              current_tracks->size() * (end_pose_id + 1));
+      sdtrack::BaWindow<ba::ImuMeasurementT<Scalar>>& window = ba_windows[id];
+      window.Slide(poses, start_pose_id, end_pose_id);
+      ba.Init(options, window.num_poses(), window.num_tracks());
       ba.AddCamera(rig.cameras_[0], rig.t_wc_[0]);
       // First add all the poses and landmarks to ba.
       for (uint32_t ii = start_pose_id ; ii <= end_pose_id ; ++ii) {
@@ -188,8 +208,8 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
                 pose->t_wp, is_active, pose->time + imu_time_offset);
         }
         if (use_imu && ii >= start_active_pose && ii > 0) {
-          std::vector<ba::ImuMeasurementT<Scalar>> meas =
-              imu_buffer.GetRange(poses[ii - 1]->time, pose->time);
+          const std::vector<ba::ImuMeasurementT<Scalar>>& meas =
+              window.ImuMeasurements(poses, ii, imu_buffer);
           /*std::cerr << "Adding imu residual between poses " << ii - 1 << " with "
                      " time " << poses[ii - 1]->time <<  " and " << ii <<
                      " with time " << pose->time << " with " << meas.size() <<
@@ -389,12 +409,17 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
       prev_cond_error = DBL_MAX;
     }
 
-    const Scalar cond_chi2_dist = chi2inv(adaptive_threshold, cond_dims);
-    const Scalar cond_v_chi2_dist =
-        chi2inv(adaptive_threshold, summary.num_cond_proj_residuals * 2);
+    // Called from the foreground and the conditioning threads, so each has
+    // its own table.
+    static thread_local Chi2InvTable chi2inv_table;
+    const Scalar cond_chi2_dist =
+        chi2inv_table(adaptive_threshold, cond_dims);
+    const Scalar cond_v_chi2_dist = chi2inv_table(
+          adaptive_threshold, summary.num_cond_proj_residuals * 2);
     const Scalar cond_i_chi2_dist =
-        chi2inv(adaptive_threshold, BaType::kPoseDim);
-    const Scalar active_chi2_dist = chi2inv(adaptive_threshold, active_dims);
+        chi2inv_table(adaptive_threshold, BaType::kPoseDim);
+    const Scalar active_chi2_dist =
+        chi2inv_table(adaptive_threshold, active_dims);
     plot_logs[0].Log(cond_i_chi2_dist, cond_inertial_error);
     plot_logs[2].Log(cond_v_chi2_dist, summary.cond_proj_error);
     // plot_logs[2].Log(cond_chi2_dist, cond_error);
@@ -476,40 +501,44 @@ void UpdateCurrentPose()
     max_track_length = std::max(track->keypoints.size(), max_track_length);
   }
   new_pose->longest_track = max_track_length;
-  std::cerr << "Setting longest track for pose " << poses.size() << " to " <<
-               new_pose->longest_track << std::endl;
+  SDTRACK_LOG(FRAME) << "Setting longest track for pose " << poses.size() << " to " <<
+      new_pose->longest_track;
 }
 
 
-void DoAAC()
+void DoAAC(const sdtrack::BaScheduler::Job& job)
 {
+  if (poses.size() <= 10 || !do_async_ba) {
+    return;
+  }
+//  DoBundleAdjustment(bundle_adjuster, false, num_aac_poses, true, false,
+//                      1, aac_imu_residual_ids);
+  orig_num_aac_poses = num_aac_poses;
   while (true) {
-    if (poses.size() > 10 && do_async_ba) {
-//      DoBundleAdjustment(bundle_adjuster, false, num_aac_poses, true, false,
-//                          1, aac_imu_residual_ids);
-      uint32_t num_poses = poses.size();
-      orig_num_aac_poses = num_aac_poses;
-      while (true) {
-        if (poses.size() > min_poses_for_imu && use_imu_measurements) {
-          DoBundleAdjustment(aac_bundle_adjuster, true, num_aac_poses,
-                             false, do_adaptive, 1, aac_imu_residual_ids);
-        }
+    if (poses.size() > min_poses_for_imu && use_imu_measurements) {
+      DoBundleAdjustment(aac_bundle_adjuster, true, num_aac_poses,
+                         false, do_adaptive, 1, aac_imu_residual_ids);
+    }
 
-        if (num_aac_poses == orig_num_aac_poses || !do_adaptive) {
-          break;
-        }
-      }
+    if (num_aac_poses == orig_num_aac_poses || !do_adaptive) {
+      break;
+    }
 
-      // std::cerr << "Resetting conditioning edge. " << std::endl;
-      imu_cond_start_pose_id = -1;
-      prev_cond_error = -1;
+    // A newer keyframe supersedes this window.
+    if (job.IsCancelled()) {
+      num_aac_poses = orig_num_aac_poses;
+      break;
     }
-    usleep(1000);
   }
+
+  // std::cerr << "Resetting conditioning edge. " << std::endl;
+  imu_cond_start_pose_id = -1;
+  prev_cond_error = -1;
 }
 
 void DoBA()
 {
+  sdtrack::BaScheduler::Foreground foreground(ba_scheduler);
 //  DoBundleAdjustment(bundle_adjuster, false, num_ba_poses, true, false,
 //                     0, ba_imu_residual_ids);
   if (poses.size() > min_poses_for_imu && use_imu_measurements) {
@@ -544,11 +573,18 @@ void BaAndStartNewLandmarks()
   if (!do_bundle_adjustment) {
     tracker.TransformTrackTabs(tracker.t_ba());
   }
+
+  if (do_async_ba) {
+    ba_scheduler.Post(sdtrack::BaScheduler::kAdaptiveConditioning,
+                      poses.size());
+  }
 }
 
-void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
+void ProcessImage(
+    std::vector<std::shared_ptr<sdtrack::FrameBuffer>>& images, double timestamp)
 {
-  std::cerr << "Processing image with timestamp " << timestamp << std::endl;
+  SDTRACK_LOG(FRAME) << "Processing image with timestamp " << timestamp;
+  DrainImu();
 #ifdef CHECK_NANS
   _MM_SET_EXCEPTION_MASK(_MM_GET_EXCEPTION_MASK() &
                          ~(_MM_MASK_INVALID | _MM_MASK_OVERFLOW |
@@ -578,8 +614,8 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
       new_pose->v_w = poses.back()->v_w;
       new_pose->b = poses.back()->b;
     } else {
-      if (imu_buffer.elements.size() > 0) {
-        Eigen::Vector3t down = -imu_buffer.elements.front().a.normalized();
+      if (!imu_buffer.empty()) {
+        Eigen::Vector3t down = -imu_buffer.front().a.normalized();
 
         // compute path transformation
         Eigen::Vector3t forward(1.0,0.0,0.0);
@@ -612,7 +648,7 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
 
     }
     {
-      std::unique_lock<std::mutex>(aac_mutex);
+      std::lock_guard<std::mutex> lock(aac_mutex);
       poses.push_back(new_pose);
     }
     axes_.push_back(std::unique_ptr<SceneGraph::GLAxis>(
@@ -635,28 +671,24 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
       use_imu_for_guess && poses.size() >= min_poses_for_imu) {
     std::shared_ptr<sdtrack::TrackerPose> pose1 = poses[poses.size() - 2];
     std::shared_ptr<sdtrack::TrackerPose> pose2 = poses.back();
-    std::vector<ba::ImuPoseT<Scalar>> imu_poses;
-    ba::PoseT<Scalar> start_pose;
-    start_pose.t_wp = pose1->t_wp;
-    start_pose.b = pose1->b;
-    start_pose.v_w = pose1->v_w;
-    start_pose.time = pose1->time;
-    // Integrate the measurements since the last frame.
-    std::vector<ba::ImuMeasurementT<Scalar> > meas =
-        imu_buffer.GetRange(pose1->time, pose2->time);
-    decltype(vi_bundle_adjuster)::ImuResidual::IntegrateResidual(
-          start_pose, meas, start_pose.b.head<3>(), start_pose.b.tail<3>(),
-          vi_bundle_adjuster.GetImuCalibration().g_vec, imu_poses);
-
-    if (imu_poses.size() > 1) {
+    // Integrate the measurements since the last frame, on top of those
+    // already integrated since the keyframe.
+    imu_preintegration.SetNoise(gyro_sigma, accel_sigma);
+    imu_preintegration.EraseBefore(pose1->time);
+    const sdtrack::ImuPreintegration preintegration =
+        imu_preintegration.Integrate(pose1->time, pose2->time, pose1->b,
+                                     imu_buffer);
+
+    if (preintegration.dt() > 0) {
+      Sophus::SE3t t_wp;
+      Eigen::Vector3t v_w;
+      preintegration.Predict(pose1->t_wp, pose1->v_w, pose1->b,
+                             vi_bundle_adjuster.GetImuCalibration().g_vec,
+                             t_wp, v_w);
       // std::cerr << "Prev guess t_ab is\n" << guess.matrix3x4() << std::endl;
-      ba::ImuPoseT<Scalar>& last_pose = imu_poses.back();
-      //      guess.so3() = last_pose.t_wp.so3().inverse() *
-      //          imu_poses.front().t_wp.so3();
-      guess = last_pose.t_wp.inverse() *
-          imu_poses.front().t_wp;
-      pose2->t_wp = last_pose.t_wp;
-      pose2->v_w = last_pose.v_w;
+      guess = t_wp.inverse() * pose1->t_wp;
+      pose2->t_wp = t_wp;
+      pose2->v_w = v_w;
       poses.back()->t_wp = pose2->t_wp;
       poses.back()->v_w = pose2->v_w;
       poses.back()->b = pose2->b;
@@ -691,8 +723,8 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
     bool keyframe_condition = track_ratio < 0.7 || total_trans > 1.0 ||
         total_rot > 0.1 /*|| tracker.num_successful_tracks() < 64*/;
 
-    std::cerr << "\tRatio: " << track_ratio << " trans: " << total_trans <<
-                 " rot: " << total_rot << std::endl;
+    SDTRACK_LOG(FRAME) << "\tRatio: " << track_ratio << " trans: " << total_trans <<
+        " rot: " << total_rot;
 
     {
       std::lock_guard<std::mutex> lock(aac_mutex);
@@ -718,19 +750,19 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
     tracker.AddKeyframe();
   }
 
-  std::cerr << "Num successful : " << tracker.num_successful_tracks() <<
-               " keyframe tracks: " << keyframe_tracks << std::endl;
+  SDTRACK_LOG(FRAME) << "Num successful : " << tracker.num_successful_tracks() <<
+      " keyframe tracks: " << keyframe_tracks;
 
   if (!is_manual_mode) {
     BaAndStartNewLandmarks();
   }
 
   if (is_keyframe) {
-    std::cerr << "KEYFRAME." << std::endl;
+    SDTRACK_LOG(INFO) << "KEYFRAME.";
     keyframe_tracks = tracker.GetCurrentTracks().size();
-    std::cerr << "New keyframe tracks: " << keyframe_tracks << std::endl;
+    SDTRACK_LOG(INFO) << "New keyframe tracks: " << keyframe_tracks;
   } else {
-    std::cerr << "NOT KEYFRAME." << std::endl;
+    SDTRACK_LOG(FRAME) << "NOT KEYFRAME.";
   }
 
   current_tracks = &tracker.GetCurrentTracks();
@@ -741,8 +773,7 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
                           _MM_MASK_DIV_ZERO));
 #endif
 
-  std::cerr << "FRAME : " << frame_count << " KEYFRAME: " << poses.size() <<
-               std::endl;
+  SDTRACK_LOG(FRAME) << "FRAME : " << frame_count << " KEYFRAME: " << poses.size();
 }
 
 void DrawImageData()
@@ -809,11 +840,9 @@ void Run()
                             camera_img->Format(), camera_img->Type(), 0);
       }
 
-      std::vector<cv::Mat> cvmat_images;
-      for (int ii = 0; ii < images->Size() ; ++ii) {
-        cvmat_images.push_back(images->at(ii)->Mat());
-      }
-      ProcessImage(cvmat_images, images->Timestamp());
+      std::vector<std::shared_ptr<sdtrack::FrameBuffer>> frames =
+          BorrowFrames(images);
+      ProcessImage(frames, images->Timestamp());
     }
     if (camera_img && camera_img->data()) {
       camera_view->ActivateAndScissor();
@@ -952,6 +981,7 @@ bool LoadCameras()
   // Capture an image so we have some IMU data.
   std::shared_ptr<pb::ImageArray> images = pb::ImageArray::Create();
   camera_device.Capture(*images);
+  DrainImu();
 
   return true;
 }
@@ -1023,6 +1053,7 @@ void InitGui()
     ba_imu_residual_ids.clear();
     aac_imu_residual_ids.clear();
     imu_buffer.Clear();
+    imu_preintegration.Clear();
     scene_graph.Clear();
     scene_graph.AddChild(&grid);
     axes_.clear();
@@ -1182,7 +1213,7 @@ int main(int argc, char** argv) {
   LoadCameras();
 
   // Set the initial gravity from the first bit of IMU data.
-  if (imu_buffer.elements.size() == 0) {
+  if (imu_buffer.empty()) {
     LOG(ERROR) << "No initial IMU measurements were found.";
   }
 
@@ -1190,9 +1221,18 @@ int main(int argc, char** argv) {
 
   InitGui();
 
-  aac_thread = std::shared_ptr<std::thread>(new std::thread(&DoAAC));
+  ba_scheduler.SetTask(sdtrack::BaScheduler::kAdaptiveConditioning, &DoAAC);
+  ba_scheduler.Start();
+
+  const std::string trace_file = cl->follow("", "-trace");
+  sdtrack::TraceRecorder::Instance().set_enabled(!trace_file.empty());
 
   Run();
+  ba_scheduler.Stop();
+
+  if (!trace_file.empty()) {
+    sdtrack::TraceRecorder::Instance().WriteChromeTrace(trace_file);
+  }
 
   return 0;
 }
@@ -0,0 +1,162 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <gtest/gtest.h>
+#include <glog/logging.h>
+#include <sdtrack/semi_dense_tracker.h>
+#include "ceres_cost_terms.h"
+
+namespace {
+// Both costs evaluate the same expressions, so only rounding separates them.
+const double kTolerance = 1e-9;
+const int kNumSamples = 20;
+
+typedef Eigen::Matrix<double, 2, 7, Eigen::RowMajor> PoseJacobian;
+typedef std::vector<Eigen::Quaterniond,
+                    Eigen::aligned_allocator<Eigen::Quaterniond>> Rotations;
+
+struct Evaluation {
+  Eigen::Vector2d residual;
+  PoseJacobian dr_dref_pose;
+  PoseJacobian dr_dmeas_pose;
+  Eigen::Vector2d dr_drho;
+};
+
+Evaluation Evaluate(const ceres::CostFunction& cost,
+                    const Sophus::SE3d& t_wv_r, const Sophus::SE3d& t_wv_m,
+                    double rho) {
+  Evaluation eval;
+  const double* parameters[3] = {t_wv_r.data(), t_wv_m.data(), &rho};
+  double* jacobians[3] = {eval.dr_dref_pose.data(),
+                          eval.dr_dmeas_pose.data(), eval.dr_drho.data()};
+  EXPECT_TRUE(cost.Evaluate(parameters, eval.residual.data(), jacobians));
+  return eval;
+}
+
+// Sophus renormalizes the quaternion of a product, so autodiff drops the
+// part of the quaternion jacobian along q, which does not move the rotation.
+// Only the part that the local parameterization sees is compared.
+PoseJacobian TangentPart(const PoseJacobian& jacobian,
+                         const Sophus::SE3d& t_wv) {
+  const Eigen::Vector4d q = t_wv.so3().unit_quaternion().coeffs();
+  PoseJacobian tangent = jacobian;
+  tangent.leftCols<4>() = jacobian.leftCols<4>() *
+      (Eigen::Matrix4d::Identity() - q * q.transpose());
+  return tangent;
+}
+
+void ExpectNear(const Eigen::MatrixXd& analytic,
+                const Eigen::MatrixXd& autodiff, const char* name) {
+  const double tolerance = kTolerance * std::max(1.0, autodiff.norm());
+  for (int row = 0; row < autodiff.rows(); ++row) {
+    for (int col = 0; col < autodiff.cols(); ++col) {
+      EXPECT_NEAR(analytic(row, col), autodiff(row, col), tolerance) <<
+          name << "(" << row << ", " << col << ")";
+    }
+  }
+}
+
+// Rotations of the reference pose, with the ones where the quaternion
+// jacobians are easiest to get wrong: identity, w = 0 and w < 0.
+Rotations TestRotations(std::mt19937& rng) {
+  std::normal_distribution<double> normal;
+  const Eigen::Vector3d axis =
+      Eigen::Vector3d(normal(rng), normal(rng), normal(rng)).normalized();
+  Rotations rotations = {
+    Eigen::Quaterniond::Identity(),
+    Eigen::Quaterniond(1, 1e-9, -2e-9, 1e-9).normalized(),
+    Eigen::Quaterniond(0, 1, 0, 0),
+    Eigen::Quaterniond(0, axis[0], axis[1], axis[2]),
+    Eigen::Quaterniond(1e-9, axis[0], axis[1], axis[2]).normalized(),
+    Eigen::Quaterniond(-0.5, axis[0], axis[1], axis[2]).normalized()
+  };
+  for (int ii = 0; ii < 4; ++ii) {
+    rotations.push_back(Eigen::Quaterniond(Eigen::Vector4d(
+        normal(rng), normal(rng), normal(rng), normal(rng))).normalized());
+  }
+  return rotations;
+}
+
+template <typename CameraType>
+void CheckAgainstAutodiff(const Eigen::VectorXd& params,
+                          const Eigen::Quaterniond& q_wv_r,
+                          bool posegraph_mode, std::mt19937& rng) {
+  std::uniform_real_distribution<double> uniform(-1, 1);
+  auto random_vector = [&](double scale) -> Eigen::Matrix<double, 6, 1> {
+    Eigen::Matrix<double, 6, 1> x;
+    for (int ii = 0; ii < 6; ++ii) {
+      x[ii] = scale * uniform(rng);
+    }
+    return x;
+  };
+
+  for (int sample = 0; sample < kNumSamples; ++sample) {
+    const Sophus::SE3d t_wv_r(Sophus::SO3d(q_wv_r),
+                              random_vector(5).head<3>());
+    // Every other sample keeps the rotation, so that the measurement pose is
+    // at the same quaternion.
+    Eigen::Matrix<double, 6, 1> motion = random_vector(0.1);
+    if (sample % 2 == 0) {
+      motion.tail<3>().setZero();
+    }
+    const Sophus::SE3d t_wv_m = t_wv_r * Sophus::SE3d::exp(motion);
+    const Sophus::SE3d t_vc_r = Sophus::SE3d::exp(random_vector(0.05));
+    const Sophus::SE3d t_vc_m = sample % 3 == 0 ? t_vc_r :
+        Sophus::SE3d::exp(random_vector(0.05));
+    const Eigen::Vector3d l_c_r(0.5 * uniform(rng), 0.5 * uniform(rng), 1);
+    const double rho = 1.05 + 0.95 * uniform(rng);
+
+    const Sophus::SE3d t_mr = posegraph_mode ?
+        t_wv_m.inverse() * t_wv_r :
+        t_vc_m.inverse() * t_wv_m.inverse() * t_wv_r * t_vc_r;
+    const Eigen::Vector3d l_c_m =
+        t_mr.so3() * l_c_r + rho * t_mr.translation();
+    ASSERT_GT(l_c_m[2], 0);
+    Eigen::Vector2d z;
+    CameraType::template Project<double>(l_c_m.data(), params.data(),
+                                         z.data());
+    z += Eigen::Vector2d(uniform(rng), uniform(rng));
+
+    const ceres::AutoDiffCostFunction<InvepthCost<CameraType>, 2, 7, 7, 1>
+        autodiff(new InvepthCost<CameraType>(t_vc_r, t_vc_m, l_c_r, z,
+                                             params, posegraph_mode));
+    const InvDepthAnalyticCost<CameraType> analytic(
+          t_vc_r, t_vc_m, l_c_r, z, params, posegraph_mode);
+    const Evaluation expected = Evaluate(autodiff, t_wv_r, t_wv_m, rho);
+    const Evaluation actual = Evaluate(analytic, t_wv_r, t_wv_m, rho);
+
+    ExpectNear(actual.residual, expected.residual, "residual");
+    ExpectNear(TangentPart(actual.dr_dref_pose, t_wv_r),
+               TangentPart(expected.dr_dref_pose, t_wv_r), "dr_dref_pose");
+    ExpectNear(TangentPart(actual.dr_dmeas_pose, t_wv_m),
+               TangentPart(expected.dr_dmeas_pose, t_wv_m),
+               "dr_dmeas_pose");
+    ExpectNear(actual.dr_drho, expected.dr_drho, "dr_drho");
+  }
+}
+
+template <typename CameraType>
+void CheckAllRotations(const Eigen::VectorXd& params) {
+  std::mt19937 rng(CameraType::kParamSize);
+  for (const Eigen::Quaterniond& q_wv_r : TestRotations(rng)) {
+    for (bool posegraph_mode : {false, true}) {
+      SCOPED_TRACE(testing::Message() << "q_wv_r " <<
+                   q_wv_r.coeffs().transpose() << " posegraph_mode " <<
+                   posegraph_mode);
+      CheckAgainstAutodiff<CameraType>(params, q_wv_r, posegraph_mode, rng);
+    }
+  }
+}
+}
+
+TEST(InvDepthAnalyticCost, MatchesAutodiffLinearCamera) {
+  Eigen::VectorXd params(4);
+  params << 300, 310, 320, 240;
+  CheckAllRotations<calibu::LinearCamera<double>>(params);
+}
+
+TEST(InvDepthAnalyticCost, MatchesAutodiffFovCamera) {
+  Eigen::VectorXd params(5);
+  params << 300, 310, 320, 240, 0.9;
+  CheckAllRotations<calibu::FovCamera<double>>(params);
+}
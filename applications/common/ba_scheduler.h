@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdint.h>
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace sdtrack {
+///
+/// \brief Runs background bundle adjustment on a worker thread that sleeps
+/// until there is work. Foreground work, i.e. the windowed BA of the tracking
+/// thread, always comes first: no job starts while it runs. Background jobs
+/// then run in the order of their priority. A job that has not started yet
+/// is replaced by a newer request of the same priority, and a running job is
+/// told it is cancelled as soon as a newer request supersedes it.
+///
+class BaScheduler {
+public:
+  enum Priority {
+    kAdaptiveConditioning = 0,
+    kCalibrationBatch,
+    kCalibrationWindow,
+    kNumPriorities
+  };
+
+  class Job {
+  public:
+    /// The id passed to Post, i.e. the keyframe that triggered the job.
+    uint32_t id() const { return id_; }
+
+    /// Whether a request of the same or a higher priority is waiting. Long
+    /// jobs should check this between solves and return.
+    bool IsCancelled() const {
+      return scheduler_->IsCancelled(priority_);
+    }
+
+  private:
+    friend class BaScheduler;
+    Job(BaScheduler* scheduler, Priority priority, uint32_t id)
+      : scheduler_(scheduler), priority_(priority), id_(id) {}
+
+    BaScheduler* scheduler_;
+    Priority priority_;
+    uint32_t id_;
+  };
+
+  typedef std::function<void(const Job&)> Task;
+
+  ///
+  /// \brief Holds background jobs off while foreground work runs on the
+  /// calling thread. A job that is already running is not interrupted.
+  ///
+  class Foreground {
+  public:
+    explicit Foreground(BaScheduler& scheduler) : scheduler_(scheduler) {
+      std::lock_guard<std::mutex> lock(scheduler_.mutex_);
+      scheduler_.num_foreground_++;
+    }
+
+    ~Foreground() {
+      {
+        std::lock_guard<std::mutex> lock(scheduler_.mutex_);
+        scheduler_.num_foreground_--;
+      }
+      scheduler_.cond_.notify_one();
+    }
+
+  private:
+    BaScheduler& scheduler_;
+  };
+
+  ~BaScheduler() { Stop(); }
+
+  void SetTask(Priority priority, const Task& task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_[priority] = task;
+  }
+
+  void Start() {
+    quit_ = false;
+    thread_ = std::thread(&BaScheduler::Run, this);
+  }
+
+  /// Cancels the running job and waits for it to return.
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      quit_ = true;
+    }
+    cond_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+  /// Requests a run of the task with the given priority.
+  void Post(Priority priority, uint32_t id) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requests_[priority].is_pending = true;
+      requests_[priority].id = id;
+    }
+    cond_.notify_one();
+  }
+
+private:
+  struct Request {
+    bool is_pending = false;
+    uint32_t id = 0;
+  };
+
+  bool IsCancelled(Priority priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (quit_) {
+      return true;
+    }
+    for (int ii = 0; ii <= priority; ++ii) {
+      if (requests_[ii].is_pending) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Highest priority with a pending request, or kNumPriorities.
+  int NextPriority() const {
+    int priority = 0;
+    while (priority < kNumPriorities && !requests_[priority].is_pending) {
+      priority++;
+    }
+    return priority;
+  }
+
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cond_.wait(lock, [this]() {
+        return quit_ ||
+            (num_foreground_ == 0 && NextPriority() != kNumPriorities);
+      });
+      if (quit_) {
+        return;
+      }
+
+      const Priority priority = static_cast<Priority>(NextPriority());
+      requests_[priority].is_pending = false;
+      const Job job(this, priority, requests_[priority].id);
+      const Task task = tasks_[priority];
+      lock.unlock();
+      if (task) {
+        task(job);
+      }
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::array<Task, kNumPriorities> tasks_;
+  std::array<Request, kNumPriorities> requests_;
+  uint32_t num_foreground_ = 0;
+  bool quit_ = false;
+  std::thread thread_;
+};
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <vector>
+#include "etc_common.h"
+
+namespace sdtrack {
+///
+/// \brief Sliding-window bundle adjustment state kept between keyframes.
+/// Each keyframe moves the window instead of rebuilding it: poses that fall
+/// off the front are dropped together with their cached IMU measurements,
+/// and only poses appended at the back touch the IMU buffer. Indices handed
+/// to the adjuster are window-local, so the problem is sized by the window
+/// and not by the number of poses since the start of the run.
+///
+template <typename ImuMeasurement>
+class BaWindow {
+public:
+  typedef std::vector<ImuMeasurement> ImuMeasurementVector;
+
+  ///
+  /// \brief Slide
+  /// \param poses All poses of the run.
+  /// \param start_pose_id Index of the first pose in the new window.
+  /// \param end_pose_id Index of the last pose in the new window.
+  ///
+  void Slide(const std::vector<std::shared_ptr<TrackerPose>>& poses,
+             uint32_t start_pose_id, uint32_t end_pose_id) {
+    // Start over if the windows do not overlap or the poses were reset. Poses
+    // are matched by time, since the window may be given copies of them.
+    if (entries_.empty() || start_pose_id > this->end_pose_id() ||
+        end_pose_id < start_pose_id_ || this->end_pose_id() >= poses.size() ||
+        entries_.front().pose->time != poses[start_pose_id_]->time) {
+      entries_.clear();
+      start_pose_id_ = start_pose_id;
+    }
+
+    while (!entries_.empty() && start_pose_id_ < start_pose_id) {
+      entries_.pop_front();
+      start_pose_id_++;
+    }
+    // The window can also grow backwards, i.e. if the adaptive conditioning
+    // asked for more poses.
+    while (start_pose_id_ > start_pose_id) {
+      entries_.push_front(Entry(poses[--start_pose_id_]));
+    }
+    while (!entries_.empty() && this->end_pose_id() > end_pose_id) {
+      entries_.pop_back();
+    }
+    while (start_pose_id_ + entries_.size() <= end_pose_id) {
+      entries_.push_back(Entry(poses[start_pose_id_ + entries_.size()]));
+    }
+  }
+
+  /// Window-local index of a pose.
+  uint32_t ToLocal(uint32_t pose_id) const {
+    return pose_id - start_pose_id_;
+  }
+
+  ///
+  /// \brief Returns the IMU measurements between pose_id - 1 and pose_id.
+  /// They are only read from the buffer the first time the pose is asked
+  /// for once the buffer covers it, and reused until it leaves the window.
+  ///
+  template <typename ImuBuffer>
+  const ImuMeasurementVector& ImuMeasurements(
+      const std::vector<std::shared_ptr<TrackerPose>>& poses,
+      uint32_t pose_id, ImuBuffer& imu_buffer) {
+    Entry& entry = entries_[ToLocal(pose_id)];
+    if (!entry.has_imu_measurements) {
+      const double end_time = entry.pose->time;
+      entry.imu_measurements =
+          imu_buffer.GetRange(poses[pose_id - 1]->time, end_time);
+      entry.has_imu_measurements = imu_buffer.end_time() >= end_time;
+    }
+    return entry.imu_measurements;
+  }
+
+  /// Upper bound on the number of landmarks in the window, used to size the
+  /// adjuster.
+  uint32_t num_tracks() const {
+    uint32_t num_tracks = 0;
+    for (const Entry& entry : entries_) {
+      num_tracks += entry.pose->tracks.size();
+    }
+    return num_tracks;
+  }
+
+  void Clear() {
+    entries_.clear();
+    start_pose_id_ = 0;
+  }
+
+  uint32_t num_poses() const { return entries_.size(); }
+  uint32_t start_pose_id() const { return start_pose_id_; }
+  uint32_t end_pose_id() const {
+    return start_pose_id_ + entries_.size() - 1;
+  }
+
+private:
+  struct Entry {
+    explicit Entry(const std::shared_ptr<TrackerPose>& p) : pose(p) {}
+    std::shared_ptr<TrackerPose> pose;
+    bool has_imu_measurements = false;
+    ImuMeasurementVector imu_measurements;
+  };
+
+  std::deque<Entry> entries_;
+  uint32_t start_pose_id_ = 0;
+};
+}
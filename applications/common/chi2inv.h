@@ -1,6 +1,11 @@
+#pragma once
+#include <assert.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <glog/logging.h>
 
-
-double  normalCDF(double u)
+inline double normalCDF(double u)
 {
   static const double a[5] =
   {
@@ -76,7 +81,7 @@ double  normalCDF(double u)
 }
 
 
-double  normalQuantile(double p)
+inline double normalQuantile(double p)
 {
   double q, t, u;
 
@@ -136,12 +141,57 @@ double  normalQuantile(double p)
   return (p > 0.5 ? -u : u);
 }
 
-double chi2inv(double P, unsigned int dim)
+/* Wilson-Hilferty approximation, from the normal quantile of P. */
+inline double chi2invFromNormal(double normal_quantile, unsigned int dim)
+{
+  return dim * pow(1.0 - 2.0 / (9 * dim) +
+                   sqrt(2.0 / (9 * dim))*normal_quantile, 3);
+}
+
+inline double chi2inv(double P, unsigned int dim)
 {
   assert(P >= 0 && P < 1);
   if (P == 0) {
     return 0;
   }
-  else return dim * pow(1.0 - 2.0 / (9 * dim) +
-                        sqrt(2.0 / (9 * dim))*normalQuantile(P), 3);
+  else return chi2invFromNormal(normalQuantile(P), dim);
 }
+
+/* chi2inv for every dimension below max_dim, generated again whenever it is
+   asked for another P. The outlier thresholds use the same P for every
+   solve, so the normal quantile is computed once and the dimensions below
+   max_dim are a lookup. Values are the same as chi2inv's. */
+class Chi2InvTable
+{
+public:
+  explicit Chi2InvTable(unsigned int max_dim = 4096) : max_dim_(max_dim) {}
+
+  double operator()(double P, unsigned int dim)
+  {
+    if (table_.empty() || P != P_) {
+      Build(P);
+    }
+    if (P == 0) {
+      return 0;
+    }
+    return dim < table_.size() ? table_[dim] :
+        chi2invFromNormal(normal_quantile_, dim);
+  }
+
+private:
+  void Build(double P)
+  {
+    assert(P >= 0 && P < 1);
+    P_ = P;
+    normal_quantile_ = P == 0 ? 0 : normalQuantile(P);
+    table_.resize(max_dim_);
+    for (unsigned int dim = 0; dim < max_dim_; ++dim) {
+      table_[dim] = chi2invFromNormal(normal_quantile_, dim);
+    }
+  }
+
+  unsigned int max_dim_;
+  double P_ = 0;
+  double normal_quantile_ = 0;
+  std::vector<double> table_;
+};
@@ -96,6 +96,22 @@ struct TrackerGuiVars {
   TimerView timer_view;
 };
 
+// Wraps the captured images as borrowed frame buffers for the tracker. Each
+// buffer holds a reference on its image until the tracker releases it, so the
+// pixels never need to be cloned.
+template <typename ImageArrayT>
+inline std::vector<std::shared_ptr<sdtrack::FrameBuffer>> BorrowFrames(
+    const std::shared_ptr<ImageArrayT>& images) {
+  std::vector<std::shared_ptr<sdtrack::FrameBuffer>> frames;
+  frames.reserve(images->Size());
+  for (int ii = 0; ii < images->Size(); ++ii) {
+    auto image = images->at(ii);
+    frames.push_back(sdtrack::FrameBuffer::Borrow(
+        image->Mat(), [image](unsigned char*) {}));
+  }
+  return frames;
+}
+
 inline Eigen::Vector2d ImageToWindowCoords(int image_width, int image_height,
                                            double x, double y) {
   Eigen::Vector2d p_win((((x / image_width) - 0.5)) * 2,
@@ -325,20 +341,10 @@ void InitTrackerGui(TrackerGuiVars& vars, uint32_t window_width,
   vars.timer_view.InitReset();
 }
 
-bool LoadCameraAndRig(GetPot& cl, hal::Camera& camera_device,
-                      calibu::Rig<Scalar>& rig,
-                      bool transform_to_robotics_coords = true) {
-  std::string cam_string = cl.follow("", "-cam");
-  try {
-    camera_device = hal::Camera(hal::Uri(cam_string));
-  }
-  catch (hal::DeviceException& e) {
-    LOG(ERROR) << "Error loading camera device: " << e.what();
-    return false;
-  }
-
-  std::string def_dir("");
-  def_dir = camera_device.GetDeviceProperty(hal::DeviceDirectory);
+// Loads the camera models from -cmod, relative to -sdir (or def_dir if no
+// source directory was given).
+bool LoadRig(GetPot& cl, const std::string& def_dir, calibu::Rig<Scalar>& rig,
+             bool transform_to_robotics_coords = true) {
   std::string src_dir = cl.follow(def_dir.c_str(), "-sdir");
 
   LOG(INFO) << "Loading camera models...";
@@ -381,6 +387,23 @@ bool LoadCameraAndRig(GetPot& cl, hal::Camera& camera_device,
   return true;
 }
 
+bool LoadCameraAndRig(GetPot& cl, hal::Camera& camera_device,
+                      calibu::Rig<Scalar>& rig,
+                      bool transform_to_robotics_coords = true) {
+  std::string cam_string = cl.follow("", "-cam");
+  try {
+    camera_device = hal::Camera(hal::Uri(cam_string));
+  }
+  catch (hal::DeviceException& e) {
+    LOG(ERROR) << "Error loading camera device: " << e.what();
+    return false;
+  }
+
+  std::string def_dir("");
+  def_dir = camera_device.GetDeviceProperty(hal::DeviceDirectory);
+  return LoadRig(cl, def_dir, rig, transform_to_robotics_coords);
+}
+
 inline pangolin::OpenGlMatrix LookAtModelViewMatrix(
     const Eigen::Vector4t& target,
     const Eigen::Vector4t& near_source,
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace sdtrack {
+///
+/// \brief Time-ordered history of IMU measurements with one writer and any
+/// number of lock-free readers. It replaces ba::InterpolationBufferT, which
+/// needs a lock around every access and searches it linearly.
+///
+/// Measurements are stored in fixed-size chunks that are never moved. A
+/// chunk's size is published after its elements are written, and the list
+/// of chunks is swapped as a whole when a chunk is added or dropped, so a
+/// reader sees a consistent prefix of the history without waiting. Range
+/// queries are binary searches by time.
+///
+template <typename ImuMeasurement>
+class ImuHistory {
+public:
+  typedef std::vector<ImuMeasurement> ImuMeasurementVector;
+
+  ///
+  /// \param max_elements Older measurements are dropped, a chunk at a time,
+  /// beyond this.
+  ///
+  explicit ImuHistory(size_t max_elements = 1 << 17)
+    : max_chunks_((max_elements + kChunkSize - 1) / kChunkSize + 1),
+      index_(new Index) {}
+
+  ///
+  /// \brief Appends a measurement. Writer only. Measurements that are not
+  /// newer than the last one are ignored.
+  ///
+  void AddElement(const ImuMeasurement& meas) {
+    std::shared_ptr<const Index> index = std::atomic_load(&index_);
+    if (!index->chunks.empty()) {
+      const Chunk& last = *index->chunks.back();
+      const size_t size = last.size.load(std::memory_order_relaxed);
+      if (meas.time <= last.elements[size - 1].time) {
+        return;
+      }
+      if (size < kChunkSize) {
+        index->chunks.back()->elements[size] = meas;
+        index->chunks.back()->size.store(size + 1, std::memory_order_release);
+        return;
+      }
+    }
+
+    std::shared_ptr<Chunk> chunk(new Chunk);
+    chunk->elements[0] = meas;
+    chunk->size.store(1, std::memory_order_relaxed);
+    std::shared_ptr<Index> new_index(new Index);
+    const size_t first_chunk =
+        index->chunks.size() + 1 > max_chunks_ ? 1 : 0;
+    new_index->chunks.assign(index->chunks.begin() + first_chunk,
+                             index->chunks.end());
+    new_index->chunks.push_back(chunk);
+    std::atomic_store(&index_, std::shared_ptr<const Index>(new_index));
+  }
+
+  /// Drops all measurements. Writer only.
+  void Clear() {
+    std::atomic_store(&index_, std::shared_ptr<const Index>(new Index));
+  }
+
+  ///
+  /// \brief Returns the measurements between start_time and end_time. The
+  /// first and last ones are interpolated at the two times, the last one only
+  /// if end_time has been reached. Empty if start_time is not covered.
+  ///
+  ImuMeasurementVector GetRange(double start_time, double end_time) const {
+    ImuMeasurementVector range;
+    const View view(std::atomic_load(&index_));
+    if (view.size == 0 || start_time < view[0].time ||
+        start_time > view[view.size - 1].time) {
+      return range;
+    }
+
+    size_t ii = view.LowerBound(start_time);
+    range.push_back(view.Interpolate(ii, start_time));
+    if (view[ii].time == start_time) {
+      ii++;
+    }
+    for (; ii < view.size && view[ii].time < end_time; ++ii) {
+      range.push_back(view[ii]);
+    }
+    if (ii < view.size) {
+      range.push_back(view.Interpolate(ii, end_time));
+    }
+    return range;
+  }
+
+  /// Time of the oldest measurement, or 0 if there is none.
+  double start_time() const {
+    const View view(std::atomic_load(&index_));
+    return view.size ? view[0].time : 0;
+  }
+
+  /// Time of the newest measurement, or 0 if there is none.
+  double end_time() const {
+    const View view(std::atomic_load(&index_));
+    return view.size ? view[view.size - 1].time : 0;
+  }
+
+  size_t size() const { return View(std::atomic_load(&index_)).size; }
+  bool empty() const { return size() == 0; }
+
+  ImuMeasurement front() const {
+    return View(std::atomic_load(&index_))[0];
+  }
+
+  ImuMeasurement back() const {
+    const View view(std::atomic_load(&index_));
+    return view[view.size - 1];
+  }
+
+private:
+  static const size_t kChunkSize = 1024;
+
+  struct Chunk {
+    Chunk() : elements(kChunkSize) {}
+    // Allocated up front, so that writing an element does not touch the
+    // ones readers may be looking at.
+    std::vector<ImuMeasurement> elements;
+    std::atomic<size_t> size{0};
+  };
+
+  struct Index {
+    // Every chunk but the last one is full.
+    std::vector<std::shared_ptr<Chunk>> chunks;
+  };
+
+  // The measurements visible to a reader at the time it was created.
+  struct View {
+    explicit View(const std::shared_ptr<const Index>& i) : index(i) {
+      size = index->chunks.empty() ? 0 :
+          (index->chunks.size() - 1) * kChunkSize +
+          index->chunks.back()->size.load(std::memory_order_acquire);
+    }
+
+    const ImuMeasurement& operator[](size_t ii) const {
+      return index->chunks[ii / kChunkSize]->elements[ii % kChunkSize];
+    }
+
+    // Index of the first measurement not older than time.
+    size_t LowerBound(double time) const {
+      size_t first = 0;
+      size_t count = size;
+      while (count > 0) {
+        const size_t step = count / 2;
+        if ((*this)[first + step].time < time) {
+          first += step + 1;
+          count -= step + 1;
+        } else {
+          count = step;
+        }
+      }
+      return first;
+    }
+
+    // Measurement at time, which lies between measurements ii - 1 and ii.
+    ImuMeasurement Interpolate(size_t ii, double time) const {
+      const ImuMeasurement& next = (*this)[ii];
+      if (ii == 0 || next.time == time) {
+        return ImuMeasurement(next.w, next.a, time);
+      }
+      const ImuMeasurement& prev = (*this)[ii - 1];
+      const double alpha = (time - prev.time) / (next.time - prev.time);
+      return ImuMeasurement(prev.w * (1 - alpha) + next.w * alpha,
+                            prev.a * (1 - alpha) + next.a * alpha, time);
+    }
+
+    std::shared_ptr<const Index> index;
+    size_t size;
+  };
+
+  size_t max_chunks_;
+  std::shared_ptr<const Index> index_;
+};
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <cmath>
+#include <map>
+#include <vector>
+#include <Eigen/Core>
+#include <sophus/se3.hpp>
+
+namespace sdtrack {
+///
+/// \brief IMU measurements between two poses integrated into a relative
+/// rotation, velocity and position change in the frame of the first pose.
+/// The deltas do not depend on the start state or on gravity, and are
+/// linearized around the bias they were integrated with: along with their
+/// Jacobians w.r.t. the gyro and accelerometer biases, this lets a bias
+/// update be applied to first order instead of integrating again.
+///
+class ImuPreintegration {
+public:
+  typedef Eigen::Matrix<double, 9, 9> Matrix9d;
+  typedef Eigen::Matrix<double, 6, 1> Vector6d;
+
+  ImuPreintegration() { Reset(Vector6d::Zero()); }
+
+  ///
+  /// \brief Reset
+  /// \param b Bias to integrate with, gyro bias first, as in TrackerPose::b.
+  ///
+  void Reset(const Vector6d& b) {
+    b_ = b;
+    dt_ = 0;
+    delta_r_ = Sophus::SO3d();
+    delta_v_.setZero();
+    delta_p_.setZero();
+    dr_dbg_.setZero();
+    dv_dbg_.setZero();
+    dv_dba_.setZero();
+    dp_dbg_.setZero();
+    dp_dba_.setZero();
+    cov_.setZero();
+  }
+
+  ///
+  /// \brief Integrates the interval between two consecutive measurements,
+  /// using their average.
+  /// \param gyro_sigma Gyro noise density, for the covariance.
+  /// \param accel_sigma Accelerometer noise density, for the covariance.
+  ///
+  template <typename ImuMeasurement>
+  void Integrate(const ImuMeasurement& meas0, const ImuMeasurement& meas1,
+                 double gyro_sigma, double accel_sigma) {
+    const double dt = meas1.time - meas0.time;
+    if (dt <= 0) {
+      return;
+    }
+    const Eigen::Vector3d w = 0.5 * (meas0.w + meas1.w) - b_.head<3>();
+    const Eigen::Vector3d a = 0.5 * (meas0.a + meas1.a) - b_.tail<3>();
+    const Eigen::Matrix3d r = delta_r_.matrix();
+    const Eigen::Matrix3d r_a_hat = r * Sophus::SO3d::hat(a);
+    const Sophus::SO3d inc_r = Sophus::SO3d::exp(w * dt);
+    const Eigen::Matrix3d inc_r_t = inc_r.matrix().transpose();
+    const Eigen::Matrix3d jr = RightJacobian(w * dt);
+    const double dt2 = dt * dt;
+
+    // Propagate the covariance of [rotation, velocity, position].
+    Matrix9d a_mat = Matrix9d::Identity();
+    a_mat.block<3, 3>(0, 0) = inc_r_t;
+    a_mat.block<3, 3>(3, 0) = -r_a_hat * dt;
+    a_mat.block<3, 3>(6, 0) = -0.5 * r_a_hat * dt2;
+    a_mat.block<3, 3>(6, 3) = Eigen::Matrix3d::Identity() * dt;
+    Eigen::Matrix<double, 9, 6> b_mat = Eigen::Matrix<double, 9, 6>::Zero();
+    b_mat.block<3, 3>(0, 0) = jr * dt;
+    b_mat.block<3, 3>(3, 3) = r * dt;
+    b_mat.block<3, 3>(6, 3) = 0.5 * r * dt2;
+    Vector6d noise;
+    noise.head<3>().setConstant(gyro_sigma * gyro_sigma / dt);
+    noise.tail<3>().setConstant(accel_sigma * accel_sigma / dt);
+    cov_ = a_mat * cov_ * a_mat.transpose() +
+        b_mat * noise.asDiagonal() * b_mat.transpose();
+
+    // Bias Jacobians, which depend on the rotation before this interval.
+    dp_dba_ += dv_dba_ * dt - 0.5 * r * dt2;
+    dp_dbg_ += dv_dbg_ * dt - 0.5 * r_a_hat * dr_dbg_ * dt2;
+    dv_dba_ -= r * dt;
+    dv_dbg_ -= r_a_hat * dr_dbg_ * dt;
+    dr_dbg_ = inc_r_t * dr_dbg_ - jr * dt;
+
+    delta_p_ += delta_v_ * dt + 0.5 * r * a * dt2;
+    delta_v_ += r * a * dt;
+    delta_r_ = delta_r_ * inc_r;
+    dt_ += dt;
+  }
+
+  ///
+  /// \brief Predicts the state at the end of the interval.
+  /// \param b Current bias estimate. Its difference to the bias the
+  /// measurements were integrated with is corrected for to first order.
+  /// \param g Gravity in the world frame, as in the adjuster's g_vec.
+  ///
+  void Predict(const Sophus::SE3d& t_wp, const Eigen::Vector3d& v_w,
+               const Vector6d& b, const Eigen::Vector3d& g,
+               Sophus::SE3d& t_wp_end, Eigen::Vector3d& v_w_end) const {
+    const Eigen::Vector3d dbg = b.head<3>() - b_.head<3>();
+    const Eigen::Vector3d dba = b.tail<3>() - b_.tail<3>();
+    const Sophus::SO3d delta_r = delta_r_ * Sophus::SO3d::exp(dr_dbg_ * dbg);
+    const Eigen::Vector3d delta_v = delta_v_ + dv_dbg_ * dbg + dv_dba_ * dba;
+    const Eigen::Vector3d delta_p = delta_p_ + dp_dbg_ * dbg + dp_dba_ * dba;
+
+    t_wp_end.so3() = t_wp.so3() * delta_r;
+    t_wp_end.translation() = t_wp.translation() + v_w * dt_ +
+        0.5 * g * dt_ * dt_ + t_wp.so3() * delta_p;
+    v_w_end = v_w + g * dt_ + t_wp.so3() * delta_v;
+  }
+
+  /// Bias the measurements were integrated with.
+  const Vector6d& b() const { return b_; }
+  double dt() const { return dt_; }
+  const Sophus::SO3d& delta_r() const { return delta_r_; }
+  const Eigen::Vector3d& delta_v() const { return delta_v_; }
+  const Eigen::Vector3d& delta_p() const { return delta_p_; }
+  const Eigen::Matrix3d& dr_dbg() const { return dr_dbg_; }
+  const Eigen::Matrix3d& dv_dbg() const { return dv_dbg_; }
+  const Eigen::Matrix3d& dv_dba() const { return dv_dba_; }
+  const Eigen::Matrix3d& dp_dbg() const { return dp_dbg_; }
+  const Eigen::Matrix3d& dp_dba() const { return dp_dba_; }
+  /// Covariance of the rotation, velocity and position deltas, in that order.
+  const Matrix9d& cov() const { return cov_; }
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+private:
+  static Eigen::Matrix3d RightJacobian(const Eigen::Vector3d& phi) {
+    const double theta = phi.norm();
+    const Eigen::Matrix3d phi_hat = Sophus::SO3d::hat(phi);
+    if (theta < 1e-8) {
+      return Eigen::Matrix3d::Identity() - 0.5 * phi_hat;
+    }
+    const double theta2 = theta * theta;
+    return Eigen::Matrix3d::Identity() -
+        (1 - std::cos(theta)) / theta2 * phi_hat +
+        (theta - std::sin(theta)) / (theta2 * theta) * phi_hat * phi_hat;
+  }
+
+  Vector6d b_;
+  double dt_;
+  Sophus::SO3d delta_r_;
+  Eigen::Vector3d delta_v_;
+  Eigen::Vector3d delta_p_;
+  Eigen::Matrix3d dr_dbg_;
+  Eigen::Matrix3d dv_dbg_;
+  Eigen::Matrix3d dv_dba_;
+  Eigen::Matrix3d dp_dbg_;
+  Eigen::Matrix3d dp_dba_;
+  Matrix9d cov_;
+};
+
+///
+/// \brief Preintegrations keyed by the time of the keyframe they start at.
+/// As the current frame moves away from the keyframe, only the measurements
+/// that arrived since the last query are integrated. The interval up to the
+/// end time is interpolated, so it is integrated on a copy and redone once
+/// the next measurement is in.
+///
+template <typename ImuMeasurement>
+class ImuPreintegrationCache {
+public:
+  typedef ImuPreintegration::Vector6d Vector6d;
+
+  ///
+  /// \param max_bias_change Bias change, in any component, up to which the
+  /// first-order correction is used. Beyond it the measurements are
+  /// integrated again with the new bias.
+  ///
+  explicit ImuPreintegrationCache(double max_bias_change = 0.05)
+    : max_bias_change_(max_bias_change) {}
+
+  ///
+  /// \brief Integrate
+  /// \param start_time Time of the keyframe the interval starts at.
+  /// \param end_time Time of the current frame.
+  /// \param b Bias of the keyframe.
+  /// \param imu_buffer Buffer to read the new measurements from.
+  /// \return Preintegration from start_time to end_time.
+  ///
+  template <typename ImuBuffer>
+  ImuPreintegration Integrate(double start_time, double end_time,
+                              const Vector6d& b, ImuBuffer& imu_buffer) {
+    Entry& entry = entries_[start_time];
+    if (!entry.is_initialized || end_time < entry.integrated_time ||
+        (b - entry.preintegration.b()).cwiseAbs().maxCoeff() >
+        max_bias_change_) {
+      entry.preintegration.Reset(b);
+      entry.integrated_time = start_time;
+      entry.is_initialized = true;
+    }
+
+    const std::vector<ImuMeasurement> meas =
+        imu_buffer.GetRange(entry.integrated_time, end_time);
+    if (meas.size() < 2) {
+      return entry.preintegration;
+    }
+    for (size_t ii = 1; ii + 1 < meas.size(); ++ii) {
+      entry.preintegration.Integrate(meas[ii - 1], meas[ii], gyro_sigma_,
+                                     accel_sigma_);
+      entry.integrated_time = meas[ii].time;
+    }
+    ImuPreintegration preintegration = entry.preintegration;
+    preintegration.Integrate(meas[meas.size() - 2], meas.back(), gyro_sigma_,
+                             accel_sigma_);
+    return preintegration;
+  }
+
+  void SetNoise(double gyro_sigma, double accel_sigma) {
+    gyro_sigma_ = gyro_sigma;
+    accel_sigma_ = accel_sigma;
+  }
+
+  /// Drops the preintegrations starting before time.
+  void EraseBefore(double time) {
+    entries_.erase(entries_.begin(), entries_.lower_bound(time));
+  }
+
+  void Clear() { entries_.clear(); }
+
+private:
+  struct Entry {
+    ImuPreintegration preintegration;
+    // Time of the last measurement integrated into preintegration.
+    double integrated_time = 0;
+    bool is_initialized = false;
+  };
+
+  double max_bias_change_;
+  double gyro_sigma_ = 0;
+  double accel_sigma_ = 0;
+  std::map<double, Entry, std::less<double>,
+           Eigen::aligned_allocator<std::pair<const double, Entry>>> entries_;
+};
+}
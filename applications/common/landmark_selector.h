@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <calibu/cam/camera_rig.h>
+#include "etc_common.h"
+
+namespace sdtrack {
+///
+/// \brief Picks a bounded subset of the landmarks in a bundle adjustment
+/// window, so that the size of the problem does not depend on how textured
+/// the scene is. Candidates are scored by the number of observations in the
+/// window and by their parallax, and are then taken in turns from a grid
+/// over the image of their latest observation, so that the selection covers
+/// the image instead of clustering in the most textured region.
+///
+class LandmarkSelector {
+public:
+  enum Candidacy {
+    kExcluded = 0,
+    kCandidate,
+    // Always selected, regardless of the budget, i.e. to fix the gauge.
+    kRequired
+  };
+
+  typedef std::function<Candidacy(uint32_t, const DenseTrack&)> CandidacyFn;
+
+  LandmarkSelector(uint32_t grid_cols = 8, uint32_t grid_rows = 6,
+                   double saturation_parallax = 0.05)
+    : grid_cols_(grid_cols), grid_rows_(grid_rows),
+      saturation_parallax_(saturation_parallax) {}
+
+  ///
+  /// \brief Select
+  /// \param poses All poses of the run.
+  /// \param start_pose_id Index of the first pose in the window.
+  /// \param end_pose_id Index of the last pose in the window.
+  /// \param rig The camera rig.
+  /// \param budget Maximum number of landmarks. 0 selects every candidate.
+  /// \param candidacy Called with the reference pose id of every track in
+  /// the window.
+  ///
+  void Select(const std::vector<std::shared_ptr<TrackerPose>>& poses,
+              uint32_t start_pose_id, uint32_t end_pose_id,
+              const calibu::Rig<Scalar>& rig, uint32_t budget,
+              const CandidacyFn& candidacy) {
+    states_.clear();
+    scores_.clear();
+    for (uint32_t ii = start_pose_id; ii <= end_pose_id; ++ii) {
+      for (const std::shared_ptr<DenseTrack>& track : poses[ii]->tracks) {
+        const Candidacy candidate = candidacy(ii, *track);
+        if (candidate == kExcluded) {
+          continue;
+        }
+        const bool is_selected = budget == 0 || candidate == kRequired;
+        states_[track.get()] = is_selected ? kSelected : kDropped;
+        if (!is_selected) {
+          scores_.push_back(Score(poses, ii, end_pose_id, rig, track.get()));
+        }
+      }
+    }
+
+    const uint32_t num_required = states_.size() - scores_.size();
+    if (budget == 0 || num_required >= budget) {
+      num_selected_ = budget == 0 ? states_.size() : num_required;
+      return;
+    }
+
+    // Rank the candidates within their cell, then take the best of every
+    // cell before the second best of any cell.
+    std::sort(scores_.begin(), scores_.end(),
+              [](const TrackScore& lhs, const TrackScore& rhs) {
+      return lhs.score > rhs.score;
+    });
+    cell_counts_.assign(grid_cols_ * grid_rows_, 0);
+    for (TrackScore& score : scores_) {
+      score.rank = cell_counts_[score.cell]++;
+    }
+    const uint32_t num_selected =
+        std::min<uint32_t>(budget - num_required, scores_.size());
+    std::partial_sort(scores_.begin(), scores_.begin() + num_selected,
+                      scores_.end(),
+                      [](const TrackScore& lhs, const TrackScore& rhs) {
+      return lhs.rank < rhs.rank ||
+          (lhs.rank == rhs.rank && lhs.score > rhs.score);
+    });
+    for (uint32_t ii = 0; ii < num_selected; ++ii) {
+      states_[scores_[ii].track] = kSelected;
+    }
+    num_selected_ = num_required + num_selected;
+  }
+
+  bool IsSelected(const DenseTrack& track) const {
+    auto it = states_.find(&track);
+    return it != states_.end() && it->second == kSelected;
+  }
+
+  /// Whether the track passed the candidacy test. Candidates that were not
+  /// selected should still follow the optimized poses.
+  bool IsCandidate(const DenseTrack& track) const {
+    return states_.find(&track) != states_.end();
+  }
+
+  uint32_t num_candidates() const { return states_.size(); }
+  uint32_t num_selected() const { return num_selected_; }
+
+private:
+  enum State {
+    kDropped = 0,
+    kSelected
+  };
+
+  struct TrackScore {
+    const DenseTrack* track;
+    double score;
+    uint32_t cell;
+    uint32_t rank;
+  };
+
+  TrackScore Score(const std::vector<std::shared_ptr<TrackerPose>>& poses,
+                   uint32_t ref_pose_id, uint32_t end_pose_id,
+                   const calibu::Rig<Scalar>& rig,
+                   const DenseTrack* track) const {
+    // Find the number of observations in the window and the latest one.
+    const uint32_t num_cameras = rig.cameras_.size();
+    const size_t num_frames = std::min<size_t>(
+          track->keypoints.size(), end_pose_id - ref_pose_id + 1);
+    uint32_t num_observations = 0;
+    int last_frame = -1;
+    uint32_t last_cam_id = 0;
+    for (size_t jj = 0; jj < num_frames; ++jj) {
+      for (uint32_t cam_id = 0; cam_id < num_cameras; ++cam_id) {
+        if (track->keypoints[jj][cam_id].tracked) {
+          num_observations++;
+          last_frame = jj;
+          last_cam_id = cam_id;
+        }
+      }
+    }
+
+    TrackScore score;
+    score.track = track;
+    score.rank = 0;
+    score.cell = 0;
+    if (last_frame < 0) {
+      score.score = 0;
+      return score;
+    }
+
+    // Parallax is the angle between the reference ray and the ray of the
+    // latest observation, both rotated into the world frame, so that pure
+    // rotation does not count.
+    const Eigen::Vector2d& kp = track->keypoints[last_frame][last_cam_id].kp;
+    const calibu::CameraInterface<Scalar>& cam = *rig.cameras_[last_cam_id];
+    const Eigen::Vector3t ray_w_ref =
+        poses[ref_pose_id]->t_wp.so3() *
+        (rig.cameras_[track->ref_cam_id]->Pose().so3() *
+         track->ref_keypoint.ray.normalized());
+    const Eigen::Vector3t ray_w =
+        poses[ref_pose_id + last_frame]->t_wp.so3() *
+        (cam.Pose().so3() * cam.Unproject(kp).normalized());
+    const double parallax =
+        std::acos(std::max(-1.0, std::min(1.0, ray_w_ref.dot(ray_w))));
+
+    // Landmarks without parallax still constrain the rotation, so they keep
+    // a fraction of the score.
+    score.score = num_observations *
+        (0.1 + std::min(parallax / saturation_parallax_, 1.0));
+
+    const uint32_t col = std::min<uint32_t>(
+          grid_cols_ - 1, std::max(0.0, kp[0]) * grid_cols_ / cam.Width());
+    const uint32_t row = std::min<uint32_t>(
+          grid_rows_ - 1, std::max(0.0, kp[1]) * grid_rows_ / cam.Height());
+    score.cell = row * grid_cols_ + col;
+    return score;
+  }
+
+  uint32_t grid_cols_;
+  uint32_t grid_rows_;
+  double saturation_parallax_;
+  uint32_t num_selected_ = 0;
+  std::unordered_map<const DenseTrack*, State> states_;
+  std::vector<TrackScore> scores_;
+  std::vector<uint32_t> cell_counts_;
+};
+}
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "etc_common.h"
+
+namespace sdtrack {
+typedef std::vector<std::shared_ptr<TrackerPose>> PoseVector;
+
+///
+/// \brief Copy of the pose graph handed to background bundle adjustment.
+/// It is never modified once published, so it can be read without locks
+/// while the tracker keeps going.
+///
+struct PoseGraphSnapshot {
+  uint64_t version = 0;
+  uint32_t epoch = 0;
+  uint32_t longest_track_id = UINT_MAX;
+  PoseVector poses;
+};
+
+///
+/// \brief Poses optimized against a snapshot, waiting to be applied to the
+/// live graph.
+///
+struct PoseGraphResult {
+  uint64_t version = 0;
+  uint32_t epoch = 0;
+  uint32_t start_pose_id = 0;
+  uint32_t end_pose_id = 0;
+  // Poses start_pose_id to end_pose_id.
+  PoseVector poses;
+};
+
+///
+/// \brief Versioned store between the tracking thread, which owns the live
+/// poses, and the background bundle adjuster. The tracking thread publishes
+/// snapshots and applies results; the adjuster solves against the latest
+/// snapshot and publishes its result. Both hand-offs swap a shared_ptr, so
+/// neither side waits for the other.
+///
+class PoseGraph {
+public:
+  ///
+  /// \brief Publishes a snapshot of the live poses. Poses older than the
+  /// oldest one marked dirty since the last snapshot are shared with it, so
+  /// the cost follows the part of the graph that changed.
+  ///
+  void PublishSnapshot(const PoseVector& poses, uint32_t longest_track_id) {
+    std::shared_ptr<PoseGraphSnapshot> snapshot(new PoseGraphSnapshot);
+    snapshot->version = ++version_;
+    snapshot->epoch = epoch_;
+    snapshot->longest_track_id = longest_track_id;
+    snapshot->poses = shared_poses_;
+    // The newest pose always changes, it is the one being tracked.
+    const uint32_t first_dirty = std::min<uint32_t>(
+          std::min<uint32_t>(dirty_from_, shared_poses_.size()),
+          poses.empty() ? 0 : poses.size() - 1);
+    snapshot->poses.resize(poses.size());
+    for (uint32_t ii = first_dirty; ii < poses.size(); ++ii) {
+      snapshot->poses[ii] = CopyPose(*poses[ii]);
+    }
+    shared_poses_ = snapshot->poses;
+    dirty_from_ = UINT_MAX;
+    std::atomic_store(&snapshot_,
+                      std::shared_ptr<const PoseGraphSnapshot>(snapshot));
+  }
+
+  std::shared_ptr<const PoseGraphSnapshot> snapshot() const {
+    return std::atomic_load(&snapshot_);
+  }
+
+  /// Marks pose_id and every later pose as changed since the last snapshot.
+  void MarkDirty(uint32_t pose_id) {
+    dirty_from_ = std::min(dirty_from_, pose_id);
+  }
+
+  /// Called by the adjuster. Replaces a result that was not applied yet.
+  void PublishResult(const std::shared_ptr<PoseGraphResult>& result) {
+    std::atomic_store(&result_, result);
+  }
+
+  /// Called by the tracking thread. Returns the pending result, if any.
+  std::shared_ptr<PoseGraphResult> TakeResult() {
+    return std::atomic_exchange(&result_, std::shared_ptr<PoseGraphResult>());
+  }
+
+  ///
+  /// \brief Writes a result back into the live poses. Pose states are
+  /// copied for the whole range, landmark states only for the tracks that
+  /// were in the adjustment with the given id.
+  /// \return false if the poses were reset since the snapshot was taken.
+  ///
+  bool Apply(const PoseGraphResult& result, uint32_t ba_id,
+             PoseVector& poses) {
+    if (result.epoch != epoch_ || result.end_pose_id >= poses.size()) {
+      return false;
+    }
+
+    std::unordered_map<uint32_t, const DenseTrack*> result_tracks;
+    for (uint32_t ii = result.start_pose_id; ii <= result.end_pose_id; ++ii) {
+      const TrackerPose& result_pose =
+          *result.poses[ii - result.start_pose_id];
+      TrackerPose& pose = *poses[ii];
+      pose.t_wp = result_pose.t_wp;
+      pose.v_w = result_pose.v_w;
+      pose.b = result_pose.b;
+
+      result_tracks.clear();
+      for (const std::shared_ptr<DenseTrack>& track : result_pose.tracks) {
+        if (track->external_id[ba_id] != UINT_MAX) {
+          result_tracks[track->id] = track.get();
+        }
+      }
+      for (std::shared_ptr<DenseTrack>& track : pose.tracks) {
+        auto it = result_tracks.find(track->id);
+        if (it != result_tracks.end()) {
+          track->is_outlier = it->second->is_outlier;
+          track->ref_keypoint.rho = it->second->ref_keypoint.rho;
+        }
+      }
+    }
+    MarkDirty(result.start_pose_id);
+    return true;
+  }
+
+  ///
+  /// \brief Private copy of a pose, i.e. for the adjuster to write its
+  /// results into. Tracks only carry the state used by bundle adjustment,
+  /// not their patches.
+  ///
+  static std::shared_ptr<TrackerPose> CopyPose(const TrackerPose& pose) {
+    std::shared_ptr<TrackerPose> copy(new TrackerPose);
+    copy->t_wp = pose.t_wp;
+    copy->v_w = pose.v_w;
+    copy->b = pose.b;
+    copy->opt_id = pose.opt_id;
+    copy->cam_params = pose.cam_params;
+    copy->time = pose.time;
+    copy->longest_track = pose.longest_track;
+    static const std::vector<uint32_t> kPatchDims(1, 1);
+    for (const std::shared_ptr<DenseTrack>& track : pose.tracks) {
+      std::shared_ptr<DenseTrack> track_copy(
+            new DenseTrack(1, kPatchDims, track->offset_2d.size()));
+      track_copy->id = track->id;
+      track_copy->ref_cam_id = track->ref_cam_id;
+      track_copy->ref_keypoint.ray = track->ref_keypoint.ray;
+      track_copy->ref_keypoint.rho = track->ref_keypoint.rho;
+      track_copy->ref_keypoint.center_px = track->ref_keypoint.center_px;
+      track_copy->keypoints = track->keypoints;
+      track_copy->num_good_tracked_frames = track->num_good_tracked_frames;
+      track_copy->external_id = track->external_id;
+      track_copy->tracked = track->tracked;
+      track_copy->is_outlier = track->is_outlier;
+      track_copy->t_ba = track->t_ba;
+      copy->tracks.push_back(track_copy);
+    }
+    return copy;
+  }
+
+  /// Drops all snapshots and invalidates results in flight.
+  void Reset() {
+    epoch_++;
+    shared_poses_.clear();
+    dirty_from_ = UINT_MAX;
+    std::atomic_store(&snapshot_, std::shared_ptr<const PoseGraphSnapshot>());
+    TakeResult();
+  }
+
+private:
+  // Only touched by the tracking thread.
+  PoseVector shared_poses_;
+  uint32_t dirty_from_ = UINT_MAX;
+  uint64_t version_ = 0;
+  uint32_t epoch_ = 0;
+
+  std::shared_ptr<const PoseGraphSnapshot> snapshot_;
+  std::shared_ptr<PoseGraphResult> result_;
+};
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+namespace sdtrack {
+///
+/// \brief Bounded lock-free queue between exactly one producer thread, i.e.
+/// a sensor driver callback, and one consumer thread. The producer never
+/// blocks: if the consumer falls behind by more than the capacity, new
+/// elements are dropped and counted.
+///
+template <typename T>
+class SpscRing {
+public:
+  /// The capacity is rounded up to a power of two.
+  explicit SpscRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    buffer_.resize(size);
+    mask_ = size - 1;
+  }
+
+  /// Called by the producer. Returns false if the ring is full.
+  bool Push(const T& value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == buffer_.size()) {
+      num_dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    buffer_[head & mask_] = value;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  ///
+  /// \brief Called by the consumer. Hands every element pushed so far to fn,
+  /// in order, and frees their slots at once.
+  /// \return The number of elements drained.
+  ///
+  template <typename Fn>
+  size_t Drain(Fn fn) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    const size_t head = head_.load(std::memory_order_acquire);
+    for (size_t ii = tail; ii != head; ++ii) {
+      fn(buffer_[ii & mask_]);
+    }
+    tail_.store(head, std::memory_order_release);
+    return head - tail;
+  }
+
+  size_t capacity() const { return buffer_.size(); }
+
+  size_t num_dropped() const {
+    return num_dropped_.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::vector<T> buffer_;
+  size_t mask_;
+  // Kept on separate cache lines, as each is written by a different thread.
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  std::atomic<size_t> num_dropped_{0};
+};
+}
@@ -3,146 +3,152 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <iomanip>
+#include <iostream>
+#include <sstream>
 #include <string>
-#include <deque>
-#include <stack>
-#include <map>
+#include <vector>
 #include <HAL/Utils/TicToc.h>
 
-class Timer {
+// Timed sections of the tracker, registered at compile time. To time a new
+// section add an id before kNumTimers and an entry to kTimerInfo.
+enum TimerId {
+  kTimerTotal = 0,
+  kTimerTrack,
+  kTimerEvaluate,
+  kTimerBa,
+  kTimerBaPre,
+  kTimerBaSolve,
+  kTimerBaPost,
+  kTimerSnl,
+  kNumTimers
+};
 
-public:
+struct TimerInfo {
+  const char* name;
+  int         parent;   // -1 for the root.
+};
 
-  struct TFunction
-  {
-    TFunction():
-      level(-1),
-      init_time(0.0),
-      children_time(0.0),
-      is_active(false),
-      parent_name("")
-    {}
+static const TimerInfo kTimerInfo[kNumTimers] = {
+  {"Total",    -1},
+  {"track",    kTimerTotal},
+  {"evaluate", kTimerTrack},
+  {"ba",       kTimerTotal},
+  {"ba_pre",   kTimerBa},
+  {"ba_solve", kTimerBa},
+  {"ba_post",  kTimerBa},
+  {"snl",      kTimerTotal}
+};
 
-    int                 level;
-    double              init_time;
-    double              children_time;   // Time used by internal functions
-    bool                is_active;
-    std::string         parent_name;     // Name of the parent function
-    std::deque<double>  process_time;    // Overall function time
-    std::deque<double>  additional_time; // Time not accounted by dChildrenTime
-  };
+struct TimerSummary {
+  double   last = 0;   // Most recent sample (ms).
+  double   p50  = 0;
+  double   p95  = 0;
+  double   p99  = 0;
+  uint32_t num_samples = 0;
+};
+
+///
+/// \brief Always-on section timer. Every thread records into its own slot,
+/// which holds a fixed-size rolling window of samples per timer id, so Tic
+/// and Toc never allocate or lock and can be called from the BA thread as
+/// well as the tracking thread. The summaries merge all threads.
+///
+class Timer {
+
+public:
+  static const int kMaxThreads = 8;
+  static const int kWindowSize = 64;
 
   //////////////////////////////////////////////////////////////////////////////
-  Timer():
-    max_name_length_(0),
-    window_size_(40)
+  Timer()
   {
+    for (int id = 0; id < kNumTimers; ++id) {
+      int level = 0;
+      for (int parent = kTimerInfo[id].parent; parent >= 0;
+           parent = kTimerInfo[parent].parent) {
+        level++;
+      }
+      levels_[id] = level;
+    }
     Reset();
   }
 
   //////////////////////////////////////////////////////////////////////////////
   void Reset()
   {
-    tracked_functions_.clear();
-    display_order_.clear();
-    while (!function_stack_.empty()){
-      function_stack_.pop();
+    for (ThreadSlot& slot : slots_) {
+      for (Window& window : slot.windows) {
+        window.count.store(0, std::memory_order_relaxed);
+        window.last_end.store(0, std::memory_order_relaxed);
+      }
     }
   }
 
   //////////////////////////////////////////////////////////////////////////////
-  void set_window_size(int window_size)
+  int window_size() const
   {
-    window_size_ = window_size;
+    return kWindowSize;
   }
 
   //////////////////////////////////////////////////////////////////////////////
-  int window_size() const
+  void Tic(TimerId id = kTimerTotal)
   {
-    return window_size_;
+    ThreadSlot* slot = GetThreadSlot();
+    if (slot) {
+      slot->windows[id].start = hal::Tic();
+    }
   }
 
   //////////////////////////////////////////////////////////////////////////////
-  void Tic(std::string func_name = std::string())
+  void Toc(TimerId id = kTimerTotal)
   {
-
-    // check if is main program
-    if (func_name.empty()) {
-      // reset all values
-      func_name = "Total";
-    }
-
-    // Look if this function is already registered
-    std::map< std::string, TFunction >::iterator it;
-    it = tracked_functions_.find(func_name);
-
-    if (it==tracked_functions_.end()) {
-      TFunction f;
-      f.level  = (int)function_stack_.size();
-      f.parent_name = (f.level == 0)?"root":function_stack_.top();
-      f.is_active = false;
-      tracked_functions_.insert( std::pair<std::string,TFunction>(func_name,f));
-      display_order_.insert( std::pair<int,std::string>(
-                               (int)display_order_.size(),func_name));
-      if(func_name.length() > max_name_length_) {
-        max_name_length_ = func_name.length();
-      }
-    } else if (it->second.is_active){
-      std::cerr << "WARNING -- Timer::Tic() called with the name " <<
-                   func_name << "twice" << std::endl;
+    ThreadSlot* slot = GetThreadSlot();
+    if (!slot) {
       return;
     }
-
-    // Save current time
-    tracked_functions_[func_name].is_active = true;
-    tracked_functions_[func_name].init_time = hal::Tic(); // from HAL
-    tracked_functions_[func_name].children_time = 0.0;
-
-    // Add function to stack
-    function_stack_.push(func_name);
+    Window& window = slot->windows[id];
+    const double end = hal::Tic();
+    const uint32_t count = window.count.load(std::memory_order_relaxed);
+    window.samples[count % kWindowSize].store(
+        (end - window.start) * 1e3, std::memory_order_relaxed);
+    window.last_end.store(end, std::memory_order_relaxed);
+    window.count.store(count + 1, std::memory_order_release);
   }
 
   //////////////////////////////////////////////////////////////////////////////
-  void Toc(std::string func_name = std::string())
+  // Percentiles over the rolling windows of all threads.
+  TimerSummary GetSummary(TimerId id)
   {
-    // check if is main program
-    if (func_name.empty()) {
-      func_name = "Total";
-    }
-
-    // check if there is a function in the stack
-    if (function_stack_.empty()) {
-      std::cerr << "ERROR: [Toc] Inbalance of Tic-Toc calls" <<
-                   " for [" << func_name << "]" << std::endl;
-      return;
-    }
-
-    // Pop last function in the stack
-    function_stack_.pop();
-
-    // Register time -- smoothed a bit (smooth_factor=0 := no smoothing)
-    double smooth_factor = 0.0;
-    double cur  = hal::TocMS(tracked_functions_[func_name].init_time);
-    double prev = tracked_functions_[func_name].process_time.empty() ?
-          cur : tracked_functions_[func_name].process_time.back();
-    double process_time = (1-smooth_factor)*cur + smooth_factor*prev;
-    double children_time = tracked_functions_[func_name].children_time;
-    double additional_time = process_time - children_time;
-    std::string parent_name  = tracked_functions_[func_name].parent_name;
-
-    tracked_functions_[func_name].process_time.push_back(process_time);
-    tracked_functions_[func_name].additional_time.push_back(additional_time);
-    tracked_functions_[func_name].is_active = false;
-    if (parent_name.compare("root")) {
-      tracked_functions_[parent_name].children_time += process_time;
+    TimerSummary summary;
+    uint32_t num_samples = 0;
+    double last_end = 0;
+    for (ThreadSlot& slot : slots_) {
+      const Window& window = slot.windows[id];
+      const uint32_t count = window.count.load(std::memory_order_acquire);
+      const uint32_t num = std::min<uint32_t>(count, kWindowSize);
+      for (uint32_t ii = count - num; ii < count; ++ii) {
+        scratch_[num_samples++] =
+            window.samples[ii % kWindowSize].load(std::memory_order_relaxed);
+      }
+      const double end = window.last_end.load(std::memory_order_relaxed);
+      if (num > 0 && end > last_end) {
+        last_end = end;
+        summary.last = window.samples[(count - 1) % kWindowSize].load(
+            std::memory_order_relaxed);
+      }
     }
 
-    // Delete oldest time from the vector if we have more than needed
-    if ((int)tracked_functions_[func_name].process_time.size() > window_size_) {
-      tracked_functions_[func_name].process_time.pop_front();
-      tracked_functions_[func_name].additional_time.pop_front();
+    summary.num_samples = num_samples;
+    if (num_samples > 0) {
+      summary.p50 = Percentile(num_samples, 0.50);
+      summary.p95 = Percentile(num_samples, 0.95);
+      summary.p99 = Percentile(num_samples, 0.99);
     }
+    return summary;
   }
 
   //////////////////////////////////////////////////////////////////////////////
@@ -150,37 +156,30 @@ public:
   int GetNumFunctions(int level)
   {
     int num_func = 0;
-    std::map< std::string, TFunction >::iterator it;
-
-    for (it=tracked_functions_.begin(); it!=tracked_functions_.end(); ++it) {
-      if ((*it).second.level <= level) {
+    for (int id = 0; id < kNumTimers; ++id) {
+      if (levels_[id] <= level) {
         num_func++;
       }
     }
-
     return num_func;
   }
 
   //////////////////////////////////////////////////////////////////////////////
   void PrintToTerminal(int levels=0)
   {
-    std::map< int, std::string >::iterator it;
-
     std::cout << "-----------------------------------------------" << std::endl;
-    for (it = display_order_.begin(); it != display_order_.end(); ++it) {
-      std::string func_name = (*it).second;
-      int level    = tracked_functions_[func_name].level;
-      if (level <= levels) {
-        double process_time = tracked_functions_[func_name].process_time.back();
-        if (level > 1) {
-          std::cout << std::setw(5*(tracked_functions_[func_name].level-1))
-                    << "";
-        }
-        std::cout << std::setw(max_name_length_+5) << std::left
-                  << (*it).second;
-        std::cout << std::setw(10) << std::setprecision(3) <<
-                     std::fixed << std::right;
-        std::cout << process_time << std::endl;
+    std::cout << std::setw(20) << std::left << "" << std::right
+              << std::setw(10) << "p50" << std::setw(10) << "p95"
+              << std::setw(10) << "p99" << std::endl;
+    for (int id = 0; id < kNumTimers; ++id) {
+      if (levels_[id] <= levels) {
+        const TimerSummary summary = GetSummary(static_cast<TimerId>(id));
+        std::cout << std::setw(20) << std::left
+                  << (std::string(2 * levels_[id], ' ') + kTimerInfo[id].name)
+                  << std::right << std::setprecision(3) << std::fixed
+                  << std::setw(10) << summary.p50
+                  << std::setw(10) << summary.p95
+                  << std::setw(10) << summary.p99 << std::endl;
       }
     }
   }
@@ -188,89 +187,120 @@ public:
   //////////////////////////////////////////////////////////////////////////////
   std::vector<std::string>& GetNames(const int levels)
   {
-    vec_names_.resize(GetNumFunctions(levels));
-    std::map<int, std::string>::iterator it;
-
-    int kk = 0;
-    for(it=display_order_.begin(); it!=display_order_.end(); ++it ) {
-
-      std::string func_name = (*it).second;
+    vec_names_.clear();
+    for (int id = 0; id < kNumTimers; ++id) {
+      const int level = levels_[id];
+      if (level > levels) {
+        continue;
+      }
       std::string level_mark = "";
-      int level = tracked_functions_[func_name].level;
-
       for (int ii=1; ii < level; ++ii)  level_mark += "  ";
-
       if (level > 0) level_mark += "|-";
 
-      if (level <= levels) {
-        if ((level < levels) &&
-            (tracked_functions_[func_name].children_time > 0.0)) {
-          // This is a parent function with children in the last level
-          vec_names_[kk] = level_mark + func_name + " [T]";
-        } else {
-          // This is either a function in the last requested level or a parent function
-          // with no children
-          vec_names_[kk] = level_mark + func_name;
-        }
-        kk++;
+      if (level < levels && HasChildren(id, levels)) {
+        // This is a parent function with children in the last level
+        vec_names_.push_back(level_mark + kTimerInfo[id].name + " [T]");
+      } else {
+        vec_names_.push_back(level_mark + kTimerInfo[id].name);
       }
     }
     return vec_names_;
   }
 
-
   //////////////////////////////////////////////////////////////////////////////
+  // Latest total and exclusive (not accounted for by children) times.
   std::vector<std::pair<double,double>>& GetTimes(const int levels)
   {
-    vec_times_.resize(GetNumFunctions(levels));
-
-    double process_time;
-    double additional_time;
-    std::map< int, std::string>::iterator it;
-
-    int kk=0;
-    for (it=display_order_.begin(); it!=display_order_.end(); ++it) {
-
-      std::string func_name = (*it).second;
+    std::array<TimerSummary, kNumTimers> summaries;
+    for (int id = 0; id < kNumTimers; ++id) {
+      summaries[id] = GetSummary(static_cast<TimerId>(id));
+    }
 
-      std::map< std::string, TFunction >::iterator searchit;
-      searchit = tracked_functions_.find(func_name);
-      if (searchit==tracked_functions_.end()) {
+    vec_times_.clear();
+    for (int id = 0; id < kNumTimers; ++id) {
+      if (levels_[id] > levels) {
         continue;
       }
+      double additional_time = summaries[id].last;
+      if (levels_[id] < levels) {
+        for (int child = 0; child < kNumTimers; ++child) {
+          if (kTimerInfo[child].parent == id) {
+            additional_time -= summaries[child].last;
+          }
+        }
+      }
+      vec_times_.push_back(std::pair<double,double>(
+          summaries[id].last, std::max(additional_time, 0.0)));
+    }
+    return vec_times_;
+  }
 
-      if (tracked_functions_[func_name].process_time.empty() ||
-          tracked_functions_[func_name].additional_time.empty() ) {
-          continue;
+  //////////////////////////////////////////////////////////////////////////////
+  // "p50/p95/p99" strings in the same order as GetNames.
+  std::vector<std::string>& GetPercentileLabels(const int levels)
+  {
+    vec_labels_.clear();
+    for (int id = 0; id < kNumTimers; ++id) {
+      if (levels_[id] <= levels) {
+        const TimerSummary summary = GetSummary(static_cast<TimerId>(id));
+        std::stringstream ss;
+        ss << std::setprecision(2) << summary.p50 << "/" << summary.p95
+           << "/" << summary.p99;
+        vec_labels_.push_back(ss.str());
       }
+    }
+    return vec_labels_;
+  }
 
-      int level = tracked_functions_[func_name].level;
-      if (level <= levels) {
-        process_time    = tracked_functions_[func_name].process_time.back();
-        additional_time = tracked_functions_[func_name].additional_time.back();
+private:
+  struct Window {
+    double                                start = 0;
+    std::atomic<uint32_t>                 count;
+    std::atomic<double>                   last_end;
+    std::array<std::atomic<double>, kWindowSize> samples;
+  };
 
-        if ((level < levels) &&
-            (tracked_functions_[func_name].children_time > 0.0)) {
-          // This is a parent function with children in the last level
-          vec_times_[kk] = std::pair<double,double>(process_time,additional_time);
-        } else {
-          // This is either a function in the last requested level or a parent function
-          // with no children
-          vec_times_[kk] = std::pair<double,double>(process_time,process_time);
-        }
-        kk++;
+  struct ThreadSlot {
+    std::array<Window, kNumTimers> windows;
+  };
+
+  //////////////////////////////////////////////////////////////////////////////
+  ThreadSlot* GetThreadSlot()
+  {
+    static std::atomic<int> next_thread(0);
+    static thread_local int thread_index = next_thread.fetch_add(1);
+    if (thread_index >= kMaxThreads) {
+      // More threads than slots. Their timings are dropped.
+      return nullptr;
+    }
+    return &slots_[thread_index];
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+  bool HasChildren(int id, int levels) const
+  {
+    for (int child = 0; child < kNumTimers; ++child) {
+      if (kTimerInfo[child].parent == id && levels_[child] <= levels) {
+        return true;
       }
     }
-    return vec_times_;
+    return false;
   }
 
-private:
+  //////////////////////////////////////////////////////////////////////////////
+  double Percentile(uint32_t num_samples, double percentile)
+  {
+    const uint32_t nth = std::min<uint32_t>(
+        num_samples - 1, (uint32_t)(percentile * num_samples));
+    std::nth_element(scratch_.begin(), scratch_.begin() + nth,
+                     scratch_.begin() + num_samples);
+    return scratch_[nth];
+  }
 
-  unsigned int                          max_name_length_;
-  int                                   window_size_;
-  std::stack< std::string >             function_stack_;
-  std::map<std::string, TFunction>      tracked_functions_;
-  std::map<int, std::string>            display_order_;
-  std::vector<std::string>              vec_names_;
-  std::vector<std::pair<double,double>> vec_times_;
+  std::array<int, kNumTimers>                      levels_;
+  std::array<ThreadSlot, kMaxThreads>              slots_;
+  std::array<double, kMaxThreads * kWindowSize>    scratch_;
+  std::vector<std::string>                         vec_names_;
+  std::vector<std::pair<double,double>>            vec_times_;
+  std::vector<std::string>                         vec_labels_;
 };
@@ -46,9 +46,11 @@ class TimerView : public pangolin::View
     history_.clear();
   }
 
+  // If given, vsLabels replaces the printed process time of each function.
   void Update(int nTimeWindowSize,
               std::vector< std::string >&  vsNames,
-              std::vector< std::pair<double,double> >& vTimes) {
+              std::vector< std::pair<double,double> >& vTimes,
+              const std::vector< std::string >* vsLabels = nullptr) {
 
     std::unique_lock<std::mutex> lock(mutex_);
 
@@ -69,9 +71,13 @@ class TimerView : public pangolin::View
     // init accTimes and string vector
     for(int ii=0; ii <(int)vTimes.size(); ++ii) {
       vdAccTimes.push_back(vTimes[ii].second);
-      std::stringstream ss;
-      ss << std::setprecision(2) << vTimes[ii].first;
-      times_[ii] = ss.str();
+      if (vsLabels && ii < (int)vsLabels->size()) {
+        times_[ii] = (*vsLabels)[ii];
+      } else {
+        std::stringstream ss;
+        ss << std::setprecision(2) << vTimes[ii].first;
+        times_[ii] = ss.str();
+      }
     }
 
     //compute accumulated processing time
@@ -0,0 +1,178 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/Cholesky>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseCholesky>
+
+namespace sdtrack {
+///
+/// \brief Marginal covariance of the camera parameters of a visual
+/// calibration window, recovered without forming the dense system.
+///
+/// Landmarks only have an inverse depth, so each one is eliminated with a
+/// scalar Schur complement as it is added. What remains is the pose system,
+/// which is sparse as poses only couple through shared landmarks, plus the
+/// few dense camera parameter columns. The pose system is factored with a
+/// sparse Cholesky and solved against those columns only, which gives the
+/// camera parameter block of the inverse without inverting anything else.
+///
+/// The gauge has to be fixed by the caller, the same way the window is set
+/// up for the adjuster: the first pose is not a variable, and one landmark
+/// is added without its inverse depth to fix the scale.
+///
+class CalibrationMarginals {
+public:
+  typedef Eigen::Matrix<double, 2, 6> PoseJacobian;
+
+  ///
+  /// \param num_poses Number of pose variables, i.e. without the fixed one.
+  /// \param num_params Number of camera parameters.
+  ///
+  CalibrationMarginals(uint32_t num_poses, uint32_t num_params)
+    : num_poses_(num_poses), num_params_(num_params),
+      s_pk_(Eigen::MatrixXd::Zero(6 * num_poses, num_params)),
+      s_kk_(Eigen::MatrixXd::Zero(num_params, num_params)),
+      is_pose_observed_(num_poses, false) {}
+
+  ///
+  /// \brief Starts a landmark.
+  /// \param ref_pose Pose variable the landmark is anchored in, -1 if fixed.
+  /// \param has_inverse_depth false for the landmark that fixes the scale.
+  ///
+  void BeginLandmark(int ref_pose, bool has_inverse_depth) {
+    ref_pose_ = ref_pose;
+    has_inverse_depth_ = has_inverse_depth;
+    obs_poses_.clear();
+    obs_jacobians_.clear();
+  }
+
+  ///
+  /// \brief Adds an observation of the current landmark from another pose.
+  /// \param pose Observing pose variable, -1 if fixed.
+  ///
+  void AddObservation(int pose, const PoseJacobian& dz_dref_pose,
+                      const PoseJacobian& dz_dpose,
+                      const Eigen::Vector2d& dz_drho,
+                      const Eigen::MatrixXd& dz_dparams) {
+    obs_poses_.push_back(pose);
+    Eigen::MatrixXd jacobian(2, 12 + num_params_ + 1);
+    jacobian << dz_dref_pose, dz_dpose, dz_dparams, dz_drho;
+    obs_jacobians_.push_back(jacobian);
+  }
+
+  /// Eliminates the current landmark and adds it to the reduced system.
+  void EndLandmark() {
+    const uint32_t num_obs = obs_poses_.size();
+    if (num_obs == 0) {
+      return;
+    }
+
+    // Local Jacobian over [ref pose, observing poses, params, inverse depth].
+    const uint32_t num_pose_cols = 6 * (num_obs + 1);
+    const uint32_t num_cols = num_pose_cols + num_params_;
+    Eigen::MatrixXd jacobian =
+        Eigen::MatrixXd::Zero(2 * num_obs, num_cols + 1);
+    for (uint32_t ii = 0; ii < num_obs; ++ii) {
+      const Eigen::MatrixXd& obs = obs_jacobians_[ii];
+      jacobian.block(2 * ii, 0, 2, 6) = obs.leftCols<6>();
+      jacobian.block(2 * ii, 6 * (ii + 1), 2, 6) = obs.block(0, 6, 2, 6);
+      jacobian.block(2 * ii, num_pose_cols, 2, num_params_ + 1) =
+          obs.rightCols(num_params_ + 1);
+    }
+
+    const Eigen::MatrixXd h = jacobian.transpose() * jacobian;
+    Eigen::MatrixXd h_reduced = h.topLeftCorner(num_cols, num_cols);
+    const double h_ll = h(num_cols, num_cols);
+    if (has_inverse_depth_ && h_ll > 0) {
+      h_reduced -= h.topRightCorner(num_cols, 1) *
+          h.bottomLeftCorner(1, num_cols) / h_ll;
+    }
+
+    // Scatter into the pose and parameter blocks.
+    for (uint32_t ii = 0; ii <= num_obs; ++ii) {
+      const int pose_ii = ii == 0 ? ref_pose_ : obs_poses_[ii - 1];
+      if (pose_ii < 0) {
+        continue;
+      }
+      is_pose_observed_[pose_ii] = true;
+      s_pk_.block(6 * pose_ii, 0, 6, num_params_) +=
+          h_reduced.block(6 * ii, num_pose_cols, 6, num_params_);
+      for (uint32_t jj = 0; jj <= num_obs; ++jj) {
+        const int pose_jj = jj == 0 ? ref_pose_ : obs_poses_[jj - 1];
+        if (pose_jj < 0) {
+          continue;
+        }
+        for (int row = 0; row < 6; ++row) {
+          for (int col = 0; col < 6; ++col) {
+            s_pp_.push_back(Eigen::Triplet<double>(
+                6 * pose_ii + row, 6 * pose_jj + col,
+                h_reduced(6 * ii + row, 6 * jj + col)));
+          }
+        }
+      }
+    }
+    s_kk_ += h_reduced.bottomRightCorner(num_params_, num_params_);
+  }
+
+  ///
+  /// \brief Computes the marginal covariance of the camera parameters.
+  /// \return false if the poses or the parameters are not fully constrained.
+  ///
+  bool Compute(Eigen::MatrixXd& covariance) {
+    Eigen::MatrixXd schur = s_kk_;
+    if (num_poses_ > 0) {
+      // Poses that see no landmark do not couple to anything, so an identity
+      // block leaves the result unchanged.
+      std::vector<Eigen::Triplet<double>> triplets = s_pp_;
+      for (uint32_t ii = 0; ii < num_poses_; ++ii) {
+        if (!is_pose_observed_[ii]) {
+          for (int jj = 0; jj < 6; ++jj) {
+            triplets.push_back(
+                Eigen::Triplet<double>(6 * ii + jj, 6 * ii + jj, 1));
+          }
+        }
+      }
+      Eigen::SparseMatrix<double> s_pp(6 * num_poses_, 6 * num_poses_);
+      s_pp.setFromTriplets(triplets.begin(), triplets.end());
+
+      const Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> ldlt(s_pp);
+      if (ldlt.info() != Eigen::Success || !IsPositive(ldlt.vectorD())) {
+        return false;
+      }
+      schur -= s_pk_.transpose() * ldlt.solve(s_pk_);
+    }
+
+    const Eigen::LDLT<Eigen::MatrixXd> ldlt(schur);
+    if (ldlt.info() != Eigen::Success || !IsPositive(ldlt.vectorD())) {
+      return false;
+    }
+    covariance = ldlt.solve(
+          Eigen::MatrixXd::Identity(num_params_, num_params_));
+    return true;
+  }
+
+private:
+  // Whether the pivots of an LDLT are all clearly positive, i.e. the matrix
+  // has no nullspace left.
+  static bool IsPositive(const Eigen::VectorXd& d) {
+    return d.rows() == 0 ||
+        d.minCoeff() > 1e-12 * std::max(1.0, d.cwiseAbs().maxCoeff());
+  }
+
+  uint32_t num_poses_;
+  uint32_t num_params_;
+  std::vector<Eigen::Triplet<double>> s_pp_;
+  Eigen::MatrixXd s_pk_;
+  Eigen::MatrixXd s_kk_;
+  std::vector<bool> is_pose_observed_;
+
+  // Landmark being added.
+  int ref_pose_ = -1;
+  bool has_inverse_depth_ = true;
+  std::vector<int> obs_poses_;
+  std::vector<Eigen::MatrixXd> obs_jacobians_;
+};
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <stdint.h>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include "online_calibrator.h"
+
+namespace sdtrack {
+///
+/// \brief Calibration estimate kept between runs: the parameters of each
+/// camera and the windows of its priority queue, so that a run can start
+/// from them instead of from batch mode.
+///
+/// The file is binary, in the byte order of the machine that wrote it. Only
+/// what the windows need to be fused again is stored, i.e. the mean, the
+/// upper triangle of the covariance and the number of measurements.
+///
+struct CalibrationState {
+  struct Camera {
+    Eigen::VectorXd params;
+    std::vector<CalibrationWindow> windows;
+  };
+  std::vector<Camera> cameras;
+
+  ///
+  /// \brief Writes the state to a temporary file first, and renames it over
+  /// filename, so that a crash never leaves a truncated state behind.
+  ///
+  bool Save(const std::string& filename) const {
+    const std::string tmp_filename = filename + ".tmp";
+    {
+      std::ofstream out(tmp_filename, std::ios_base::binary);
+      Write(out, kMagic);
+      Write(out, kVersion);
+      Write<uint32_t>(out, cameras.size());
+      for (const Camera& camera : cameras) {
+        const uint32_t num_params = camera.params.rows();
+        Write(out, num_params);
+        WriteVector(out, camera.params);
+        uint32_t num_windows = 0;
+        for (const CalibrationWindow& window : camera.windows) {
+          num_windows += IsWindowValid(window, num_params);
+        }
+        Write(out, num_windows);
+        for (const CalibrationWindow& window : camera.windows) {
+          if (!IsWindowValid(window, num_params)) {
+            continue;
+          }
+          Write(out, window.num_measurements);
+          WriteVector(out, window.mean);
+          for (uint32_t ii = 0; ii < num_params; ++ii) {
+            WriteVector(out, window.covariance.row(ii).tail(num_params - ii));
+          }
+        }
+      }
+      if (!out) {
+        return false;
+      }
+    }
+    return std::rename(tmp_filename.c_str(), filename.c_str()) == 0;
+  }
+
+  ///
+  /// \brief Reads a state written by Save. Only the mean, covariance and
+  /// number of measurements of the windows are set.
+  /// \param num_params Number of parameters of each camera of the rig.
+  /// \return false if the file is missing, truncated, too long, of another
+  /// version or of another rig.
+  ///
+  bool Load(const std::string& filename,
+            const std::vector<uint32_t>& num_params) {
+    cameras.clear();
+    std::ifstream in(filename, std::ios_base::binary);
+    uint32_t magic = 0, version = 0, num_cameras = 0;
+    if (!Read(in, magic) || magic != kMagic || !Read(in, version) ||
+        version != kVersion || !Read(in, num_cameras) ||
+        num_cameras != num_params.size()) {
+      return false;
+    }
+
+    // Every size is checked against the rig before anything is allocated
+    // for it, so a corrupt file cannot ask for a huge covariance.
+    cameras.resize(num_cameras);
+    for (uint32_t cam_id = 0; cam_id < num_cameras; ++cam_id) {
+      Camera& camera = cameras[cam_id];
+      const uint32_t size = num_params[cam_id];
+      uint32_t file_size = 0, num_windows = 0;
+      if (!Read(in, file_size) || file_size != size ||
+          !ReadVector(in, size, camera.params) ||
+          !Read(in, num_windows) || num_windows > kMaxSize) {
+        return false;
+      }
+      for (uint32_t jj = 0; jj < num_windows; ++jj) {
+        camera.windows.emplace_back();
+        CalibrationWindow& window = camera.windows.back();
+        window.covariance.resize(size, size);
+        if (!Read(in, window.num_measurements) ||
+            !ReadVector(in, size, window.mean)) {
+          return false;
+        }
+        Eigen::VectorXd row;
+        for (uint32_t ii = 0; ii < size; ++ii) {
+          if (!ReadVector(in, size - ii, row)) {
+            return false;
+          }
+          window.covariance.row(ii).tail(size - ii) = row.transpose();
+          window.covariance.col(ii).tail(size - ii) = row;
+        }
+      }
+    }
+    // Bytes past the last camera mean the file is not one Save wrote.
+    return in.peek() == std::char_traits<char>::eof();
+  }
+
+private:
+  static const uint32_t kMagic = 0x53434453;  // "SDCS"
+  static const uint32_t kVersion = 1;
+  // Bound on the number of windows read from the file, against corrupt
+  // files.
+  static const uint32_t kMaxSize = 1 << 16;
+
+  static bool IsWindowValid(const CalibrationWindow& window,
+                            uint32_t num_params) {
+    return window.mean.rows() == num_params &&
+        window.covariance.rows() == num_params &&
+        window.covariance.cols() == num_params;
+  }
+
+  template <typename T>
+  static void Write(std::ostream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  template <typename Derived>
+  static void WriteVector(std::ostream& out,
+                          const Eigen::MatrixBase<Derived>& vector) {
+    for (int ii = 0; ii < vector.size(); ++ii) {
+      Write<double>(out, vector(ii));
+    }
+  }
+
+  template <typename T>
+  static bool Read(std::istream& in, T& value) {
+    return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(T));
+  }
+
+  static bool ReadVector(std::istream& in, uint32_t size,
+                         Eigen::VectorXd& vector) {
+    vector.resize(size);
+    return size == 0 || (bool)in.read(reinterpret_cast<char*>(vector.data()),
+                                      sizeof(double) * size);
+  }
+};
+}
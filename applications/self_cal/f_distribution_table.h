@@ -0,0 +1,139 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "ftest.h"
+
+namespace sdtrack {
+///
+/// \brief Upper tail Q(x|k) of the chi-square distribution with an integer
+/// number of degrees of freedom, in closed form.
+///
+inline double ChiSquareUpperTail(double x, uint32_t dof) {
+  if (x <= 0) {
+    return 1.0;
+  }
+  const double half_x = x / 2;
+  double sum = 0;
+  double term;
+  if (dof % 2 == 0) {
+    term = 1.0;
+    for (uint32_t jj = 0; jj < dof / 2; ++jj) {
+      sum += term;
+      term *= half_x / (jj + 1);
+    }
+    return std::exp(-half_x) * sum;
+  }
+  term = std::sqrt(half_x) * 2 / std::sqrt(M_PI);
+  for (uint32_t jj = 0; jj + 1 < (dof + 1) / 2; ++jj) {
+    sum += term;
+    term *= half_x / (jj + 1.5);
+  }
+  return std::erfc(std::sqrt(half_x)) + std::exp(-half_x) * sum;
+}
+
+///
+/// \brief Upper tail Q(F|nu1,nu2) of the F distribution for a fixed nu1, the
+/// number of camera parameters, tabulated when the calibrator starts. The
+/// comparisons of calibration windows only ever vary nu2 and F, and
+/// compute_p_score evaluates a continued fraction for each of them.
+///
+/// The table is over sqrt(nu1 * F), which tends to the square root of a
+/// chi-square variable, and 1 / nu2, so that the row at 1 / nu2 = 0 is the
+/// chi-square limit the large windows approach. It is interpolated with
+/// cubic splines along both, and stays within 1e-6 of compute_p_score.
+/// Values off the table, i.e. for nu2 below kMinNu2 or far in the tail, are
+/// computed with compute_p_score.
+///
+class FDistributionTable {
+public:
+  FDistributionTable() {}
+  explicit FDistributionTable(uint32_t nu1) { Init(nu1); }
+
+  void Init(uint32_t nu1) {
+    nu1_ = nu1;
+    values_.clear();
+    y_max_ = 0;
+    if (nu1_ == 0) {
+      return;
+    }
+    // The table ends where even the heaviest tail, at kMinNu2, is
+    // negligible.
+    y_max_ = 1.0;
+    while (compute_p_score(y_max_ * y_max_ / nu1_, nu1_, kMinNu2) > 1e-7) {
+      y_max_ *= 1.25;
+    }
+    y_step_ = y_max_ / (kNumY - 1);
+    t_step_ = 1.0 / kMinNu2 / (kNumT - 1);
+
+    values_.resize(kNumY * kNumT);
+    for (uint32_t tt = 0; tt < kNumT; ++tt) {
+      for (uint32_t yy = 0; yy < kNumY; ++yy) {
+        const double s = (yy * y_step_) * (yy * y_step_);
+        values_[tt * kNumY + yy] = tt == 0 ? ChiSquareUpperTail(s, nu1_) :
+            compute_p_score(s / nu1_, nu1_, 1.0 / (tt * t_step_));
+      }
+    }
+  }
+
+  uint32_t nu1() const { return nu1_; }
+  // Range the table covers. Outside it, UpperTail is compute_p_score.
+  double min_nu2() const { return kMinNu2; }
+  double max_f() const { return nu1_ == 0 ? 0 : y_max_ * y_max_ / nu1_; }
+
+  /// Q(f|nu1,nu2), the p-value of f.
+  double UpperTail(double f, double nu2) const {
+    const double y = std::sqrt(nu1_ * f);
+    if (!(nu2 >= kMinNu2) || !(y < y_max_)) {
+      return compute_p_score(f, nu1_, nu2);
+    }
+    return Interpolate(y / y_step_, 1.0 / nu2 / t_step_);
+  }
+
+private:
+  static const uint32_t kNumY = 512;
+  static const uint32_t kNumT = 64;
+  static constexpr double kMinNu2 = 30;
+
+  // Catmull-Rom spline through p0..p3, at alpha between p1 and p2.
+  static double CatmullRom(double p0, double p1, double p2, double p3,
+                           double alpha) {
+    return p1 + 0.5 * alpha * (p2 - p0 + alpha *
+        (2 * p0 - 5 * p1 + 4 * p2 - p3 + alpha *
+         (3 * (p1 - p2) + p3 - p0)));
+  }
+
+  // Spline along y of row tt, at yy + alpha.
+  double InterpolateRow(uint32_t tt, uint32_t yy, double alpha) const {
+    const double* row = &values_[tt * kNumY];
+    // Q - 1 goes as y^nu1 at the start, so the point before the first one
+    // mirrors the second about Q = 1 if nu1 is odd, and Q itself if even.
+    const double p0 = yy > 0 ? row[yy - 1] :
+        nu1_ % 2 ? 2 * row[0] - row[1] : row[1];
+    const double p3 = yy + 2 < kNumY ? row[yy + 2] :
+        2 * row[yy + 1] - row[yy];
+    return CatmullRom(p0, row[yy], row[yy + 1], p3, alpha);
+  }
+
+  double Interpolate(double y_index, double t_index) const {
+    const uint32_t yy = std::min<uint32_t>(y_index, kNumY - 2);
+    const uint32_t tt = std::min<uint32_t>(t_index, kNumT - 2);
+    const double alpha = y_index - yy;
+    const double q1 = InterpolateRow(tt, yy, alpha);
+    const double q2 = InterpolateRow(tt + 1, yy, alpha);
+    // Q is smooth in 1 / nu2 through the chi-square limit, so the rows past
+    // either end are extrapolated linearly.
+    const double q0 = tt > 0 ? InterpolateRow(tt - 1, yy, alpha) : 2 * q1 - q2;
+    const double q3 = tt + 2 < kNumT ?
+        InterpolateRow(tt + 2, yy, alpha) : 2 * q2 - q1;
+    return CatmullRom(q0, q1, q2, q3, t_index - tt);
+  }
+
+  uint32_t nu1_ = 0;
+  double y_max_ = 0;
+  double y_step_ = 0;
+  double t_step_ = 0;
+  std::vector<double> values_;
+};
+}
@@ -42,7 +42,7 @@
 
      Gamma(1-z) = pi/Gamma(z)/sin(pi*z) = pi*z/Gamma(1+z)/sin(pi*z)
 *********************************************************************/
-double gammln(double xx) {
+inline double gammln(double xx) {
   double cof[7], stp, half, one, fpf, x, tmp,
       ser;  // internal arithmetic in double precision
   int j;
@@ -67,12 +67,12 @@ double gammln(double xx) {
   return (tmp + log(stp * ser));
 }
 
-double betacf(double, double, double);
+inline double betacf(double, double, double);
 
 /**********************************************
   Returns the incomplete beta function Ix(a,b)
 **********************************************/
-double betai(double a, double b, double x) {
+inline double betai(double a, double b, double x) {
   double bt;
   if (x < 0 || x > 1) {
     printf(" Bad argument x in function BetaI.\n");
@@ -94,7 +94,7 @@ double betai(double a, double b, double x) {
 /*****************************************************************
   Continued fraction for incomplete beta function (used by BETAI)
 *****************************************************************/
-double betacf(double a, double b, double x) {
+inline double betacf(double a, double b, double x) {
   int m, m2;
   double aa, c, d, del, h, qab, qam, qap;
 
@@ -132,7 +132,7 @@ double betacf(double a, double b, double x) {
   return h;
 }
 
-double compute_p_score(double f, double nu1, double nu2) {
+inline double compute_p_score(double f, double nu1, double nu2) {
   double tmp = nu2 / (nu2 + nu1 * f);
 
   return betai(nu2 / 2, nu1 / 2, tmp);
@@ -159,3 +159,9 @@ double compute_p_score(double f, double nu1, double nu2) {
 //}
 
 // end of file fdistri.cpp
+
+// The header is included through online_calibrator.h, so the constants are
+// not left defined for what follows.
+#undef MAXIT
+#undef EPS
+#undef FPMIN
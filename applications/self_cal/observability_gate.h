@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+#include <deque>
+
+namespace sdtrack {
+///
+/// \brief How much a keyframe excites the camera parameters, from what the
+/// tracker already has at hand.
+///
+struct KeyframeExcitation {
+  // Rotation since the previous keyframe, in radians.
+  double rotation = 0;
+  // Mean angle, in radians, between the observations made at the keyframe
+  // and the rays of their reference keypoints, with the rotation between
+  // the two removed.
+  double parallax = 0;
+  // Fraction of the image cells that have tracked features.
+  double coverage = 0;
+};
+
+///
+/// \brief Predicts whether a candidate window can constrain the camera
+/// parameters, before any bundle adjustment is built for it. Without
+/// rotation the focal length trades off against depth, without parallax
+/// there is no depth to fix it, and features bunched in part of the image
+/// leave the distortion and principal point unconstrained. The rotation of
+/// the keyframes in the window is summed, their parallax and coverage are
+/// averaged.
+///
+class ObservabilityGate {
+public:
+  struct Options {
+    double min_rotation = 0;
+    double min_parallax = 0;
+    double min_coverage = 0;
+  };
+
+  explicit ObservabilityGate(uint32_t window_length = 10)
+    : window_length_(window_length) {}
+
+  /// Adds the newest keyframe, dropping the oldest one beyond the window.
+  void AddKeyframe(const KeyframeExcitation& excitation) {
+    keyframes_.push_back(excitation);
+    if (keyframes_.size() > window_length_) {
+      keyframes_.pop_front();
+    }
+  }
+
+  void Clear() { keyframes_.clear(); }
+
+  /// Total rotation, and mean parallax and coverage, of the window.
+  KeyframeExcitation GetWindowExcitation() const {
+    KeyframeExcitation window;
+    if (keyframes_.empty()) {
+      return window;
+    }
+    for (const KeyframeExcitation& keyframe : keyframes_) {
+      window.rotation += keyframe.rotation;
+      window.parallax += keyframe.parallax;
+      window.coverage += keyframe.coverage;
+    }
+    window.parallax /= keyframes_.size();
+    window.coverage /= keyframes_.size();
+    return window;
+  }
+
+  bool IsInformative(const Options& options) const {
+    const KeyframeExcitation window = GetWindowExcitation();
+    return window.rotation >= options.min_rotation &&
+        window.parallax >= options.min_parallax &&
+        window.coverage >= options.min_coverage;
+  }
+
+private:
+  uint32_t window_length_;
+  std::deque<KeyframeExcitation> keyframes_;
+};
+}
@@ -1,6 +1,7 @@
 #include <glog/logging.h>
 #include "online_calibrator.h"
 #include "ftest.h"
+#include "calibration_marginals.h"
 
 using namespace sdtrack;
 
@@ -15,9 +16,12 @@ void OnlineCalibrator::Init(std::mutex* ba_mutex,
                             uint32_t window_length,
                             Eigen::VectorXd covariance_weights,
                             double imu_time_offset_in,
-                            ba::InterpolationBufferT<
-                            ba::ImuMeasurementT<double>, double>* buffer)
+                            sdtrack::ImuHistory<
+                            ba::ImuMeasurementT<double>>* buffer,
+                            uint32_t cam_id)
 {
+  cam_id_ = cam_id;
+  ba_id_ = 2 + cam_id;
   ba_mutex_ = ba_mutex;
   imu_time_offset = imu_time_offset_in;
   imu_buffer = buffer;
@@ -25,17 +29,18 @@ void OnlineCalibrator::Init(std::mutex* ba_mutex,
   window_length_ = window_length;
   rig_ = rig;
   covariance_weights_ = covariance_weights;
+  f_table_.Init(covariance_weights.rows());
   // Take the square root as we must pre/post multiply by the values.
   for (int ii = 0; ii < covariance_weights_.rows(); ++ii) {
     covariance_weights_[ii] = sqrt(covariance_weights_[ii]);
   }
   total_window_.mean = Eigen::VectorXd(covariance_weights.rows());
   total_window_.mean.setZero();
-  total_window_.covariance = Eigen::MatrixXd(covariance_weights.rows(),
-                                             covariance_weights.rows());
-  total_window_.covariance.setIdentity();
   // Initial distribution: total uncertainty.
-  total_window_.covariance *= 1e6;
+  SetWindowCovariance(total_window_,
+                      Eigen::MatrixXd::Identity(covariance_weights.rows(),
+                                                covariance_weights.rows()) *
+                      1e6);
   windows_.clear();
   windows_.reserve(num_windows);
 
@@ -47,7 +52,8 @@ void OnlineCalibrator::TestJacobian(Eigen::Vector2t pix,
                                     Sophus::SE3t t_ba,
                                     Scalar rho)
 {
-  std::shared_ptr<calibu::CameraInterface<Scalar>> cam = rig_->cameras_[0];
+  std::shared_ptr<calibu::CameraInterface<Scalar>> cam =
+      rig_->cameras_[cam_id_];
   Eigen::VectorXd params = cam->GetParams();
   const double eps = 1e-6;
   Eigen::Matrix<Scalar, 2, Eigen::Dynamic> jacobian_fd(2, cam->NumParams());
@@ -81,7 +87,7 @@ void OnlineCalibrator::AnalyzePriorityQueue(
     CalibrationWindow &overal_window,
     uint32_t num_iterations, bool apply_results)
 {
-  Eigen::VectorXd cam_params_backup = rig_->cameras_[0]->GetParams();
+  Eigen::VectorXd cam_params_backup = rig_->cameras_[cam_id_]->GetParams();
   Proxy<UseImu> ba_proxy(this);
   auto& ba = ba_proxy.GetBa();
 
@@ -97,7 +103,7 @@ void OnlineCalibrator::AnalyzePriorityQueue(
 
   ba.Init(options, poses.size(),
                   current_tracks->size() * poses.size());
-  ba.AddCamera(rig_->cameras_[0]);
+  ba.AddCamera(rig_->cameras_[cam_id_]);
 
   // Add all the windows to ba.
   {
@@ -115,24 +121,85 @@ void OnlineCalibrator::AnalyzePriorityQueue(
 
   // Obtain the mean from the BA.
   overal_window.mean = ba.rig()->cameras_[0]->GetParams();
-  overal_window.covariance =
-      ba.GetSolutionSummary().calibration_marginals;
+  SetWindowCovariance(overal_window,
+                      ba.GetSolutionSummary().calibration_marginals);
 
   // At this point the BA rig t_wc_ does not update the external one, so we
   // have to manually do it.
   {
     std::lock_guard<std::mutex> lock(*ba_mutex_);
     if (apply_results) {
-      rig_->cameras_[0]->Pose().so3() = ba.rig()->cameras_[0]->Pose().so3();
-      std::cerr << "new PQ t_wc\n:" << rig_->cameras_[0]->Pose().matrix() << std::endl;
+      rig_->cameras_[cam_id_]->Pose().so3() = ba.rig()->cameras_[0]->Pose().so3();
+      std::cerr << "new PQ t_wc\n:" << rig_->cameras_[cam_id_]->Pose().matrix() << std::endl;
     } else {
-      rig_->cameras_[0]->SetParams(cam_params_backup);
+      rig_->cameras_[cam_id_]->SetParams(cam_params_backup);
     }
   }
 
   needs_update_ = false;
 }
 
+bool OnlineCalibrator::FusePriorityQueue(CalibrationWindow& overal_window,
+                                         bool apply_results)
+{
+  const int num_params = covariance_weights_.rows();
+  Eigen::MatrixXd information = Eigen::MatrixXd::Zero(num_params, num_params);
+  Eigen::VectorXd information_mean = Eigen::VectorXd::Zero(num_params);
+  uint32_t num_measurements = 0;
+  for (const CalibrationWindow& window : windows_) {
+    if (window.information.rows() != num_params) {
+      continue;
+    }
+    information += window.information;
+    information_mean += window.information * window.mean;
+    num_measurements += window.num_measurements;
+  }
+
+  const Eigen::LDLT<Eigen::MatrixXd> ldlt(information);
+  if (ldlt.info() != Eigen::Success || !ldlt.isPositive() ||
+      (ldlt.vectorD().array() <= 0).any()) {
+    return false;
+  }
+  overal_window.mean = ldlt.solve(information_mean);
+  SetWindowCovariance(
+        overal_window,
+        ldlt.solve(Eigen::MatrixXd::Identity(num_params, num_params)));
+  overal_window.information = information;
+  overal_window.num_measurements = num_measurements;
+
+  if (apply_results) {
+    std::lock_guard<std::mutex> lock(*ba_mutex_);
+    rig_->cameras_[cam_id_]->SetParams(overal_window.mean);
+  }
+
+  needs_update_ = false;
+  return true;
+}
+
+void OnlineCalibrator::RestoreQueue(
+    const std::vector<CalibrationWindow>& windows)
+{
+  windows_.clear();
+  for (const CalibrationWindow& window : windows) {
+    if (windows_.size() == queue_length_) {
+      break;
+    }
+    if (window.mean.rows() != covariance_weights_.rows()) {
+      continue;
+    }
+    CalibrationWindow restored;
+    restored.mean = window.mean;
+    restored.num_measurements = window.num_measurements;
+    SetWindowCovariance(restored, window.covariance);
+    restored.score = GetWindowScore(restored);
+    // As in AnalyzeCalibrationWindow, degenerate windows are not queued.
+    if (restored.score != 0) {
+      windows_.push_back(restored);
+    }
+  }
+  needs_update_ = !windows_.empty();
+}
+
 template<bool UseImu>
 void OnlineCalibrator::AddCalibrationWindowToBa(
     std::vector<std::shared_ptr<TrackerPose>>& poses,
@@ -145,15 +212,8 @@ void OnlineCalibrator::AddCalibrationWindowToBa(
 
   // First find the longest track id in the base frame. We will use this
   // pose to remove the scale nullspace.
-  uint32_t max_keypoints = 0;
-  std::shared_ptr<DenseTrack> longest_track = nullptr;
-  std::shared_ptr<TrackerPose> pose = poses[window.start_index];
-  for (std::shared_ptr<DenseTrack> track : pose->tracks) {
-    if (track->keypoints.size() > max_keypoints) {
-      max_keypoints = track->keypoints.size();
-      longest_track = track;
-    }
-  }
+  std::shared_ptr<DenseTrack> longest_track =
+      GetLongestTrack(*poses[window.start_index], cam_id_);
 
   // First add all the poses and landmarks to ba.
   for (uint32_t ii = window.start_index; ii < window.end_index ; ++ii) {
@@ -167,7 +227,12 @@ void OnlineCalibrator::AddCalibrationWindowToBa(
 
     /// ZZZZZZZZ: This is problematic. What if track size was zero but the pose
     /// had projection residuals? we don't want to regularize in this case
-    if (pose->tracks.size() == 0 && !UseImu) {
+    const bool has_camera_tracks = std::any_of(
+          pose->tracks.begin(), pose->tracks.end(),
+          [this](const std::shared_ptr<DenseTrack>& track) {
+            return track->ref_cam_id == cam_id_;
+          });
+    if (!has_camera_tracks && !UseImu) {
       ba.RegularizePose(pose->opt_id[ba_id_], true, false, false, true);
     }
 
@@ -197,7 +262,10 @@ void OnlineCalibrator::AddCalibrationWindowToBa(
     }
 
     for (std::shared_ptr<DenseTrack> track: pose->tracks) {
-      if (track->num_good_tracked_frames == 1 || track->is_outlier) {
+      // Only tracks started in this camera, as their rays depend on its
+      // parameters.
+      if (track->num_good_tracked_frames == 1 || track->is_outlier ||
+          track->ref_cam_id != cam_id_) {
         track->external_id[ba_id_] = UINT_MAX;
         continue;
       }
@@ -205,7 +273,8 @@ void OnlineCalibrator::AddCalibrationWindowToBa(
       Eigen::Vector4d ray;
       ray.head<3>() = track->ref_keypoint.ray;
       ray[3] = track->ref_keypoint.rho;
-      ray = sdtrack::MultHomogeneous(pose->t_wp  * rig_->cameras_[0]->Pose(), ray);
+      ray = sdtrack::MultHomogeneous(
+            pose->t_wp  * rig_->cameras_[cam_id_]->Pose(), ray);
       bool active = longest_track == nullptr ? true :
         (UseImu ? true : track->id != longest_track->id);
       track->external_id[ba_id_] =
@@ -227,8 +296,8 @@ void OnlineCalibrator::AddCalibrationWindowToBa(
       // could exceed the size of this calibration window.
       for (size_t jj = 0; jj < track->keypoints.size() &&
            jj < (window.end_index - ii) ; ++jj) {
-        if (track->keypoints[jj][0].tracked) {
-          const Eigen::Vector2d& z = track->keypoints[jj][0].kp;
+        if (track->keypoints[jj][cam_id_].tracked) {
+          const Eigen::Vector2d& z = track->keypoints[jj][cam_id_].kp;
           ba.AddProjectionResidual(
                 z, pose->opt_id[ba_id_] + jj, track->external_id[ba_id_], 0);
           window.num_measurements++;
@@ -316,7 +385,7 @@ bool OnlineCalibrator::AnalyzeCalibrationWindow(
     std::cerr << "Max score: " << max_score<< " margin: " << margin << std::endl;
 
     // Replace it if it beats a non-overlapping window.
-    if (max_id != UINT_MAX && margin > 0.05) {
+    if (max_id != UINT_MAX && margin > kMinReplaceMargin) {
       const CalibrationWindow& old_window = windows_[max_id];
       std::cerr << "Replaced window at idx " << max_id << " with score " <<
                    old_window.score << " start: " << old_window.start_index <<
@@ -411,7 +480,7 @@ double OnlineCalibrator::ComputeBhattacharyyaDistance(
       ((n0 - 1) * window0.covariance + (n1) * window1.covariance) /
       (n0 + n1 - 2);
   const Eigen::VectorXd mean_diff = window0.mean - window1.mean;
-  return 1.0 / 8.0 * mean_diff.transpose() * cov_pooled.inverse() * mean_diff;
+  return 1.0 / 8.0 * mean_diff.dot(cov_pooled.ldlt().solve(mean_diff));
 }
 
 ///
@@ -427,29 +496,11 @@ double OnlineCalibrator::ComputeYao1965(
   const double p = window0.covariance.rows();
   const double n0 = window0.num_measurements;
   const double n1 = window1.num_measurements;
-  const Eigen::MatrixXd& s0 = window0.covariance;
-  const Eigen::MatrixXd& s1 = window1.covariance;
 
   double p_score = 1.0;
-  double f = 0, t2 = 0;
-  //// ZZZ IMPLEMENT CONDITION NUMBER INSTEAD OF RANK HERE
-  if (n0 == 0 || n1 == 0 || p == 0 || s0.fullPivLu().rank() != p ||
-      s1.fullPivLu().rank() != p) {
-    p_score = 1.0;
-  } else {
-    const Eigen::MatrixXd s_inv = (s0 + s1).inverse();
-    const Eigen::VectorXd xd = window0.mean - window1.mean;
-    t2 = xd.transpose() * s_inv * xd;
-    const double v_denom = t2;
-    const double v = 1.0 /
-        ((1.0 / n0) *
-        powi((double)(xd.transpose() * s_inv * s0 * s_inv * xd) / v_denom, 2) +
-        (1.0 / n1) *
-        powi((double)(xd.transpose() * s_inv * s1 * s_inv * xd) / v_denom, 2));
-
-    f = t2 / ((v * p) / (v - p + 1));
-    p_score = compute_p_score(f, p, v - p + 1);
-
+  double f = 0, t2 = 0, nu2 = 0;
+  if (GetYao1965Statistic(window0, window1, f, nu2, t2)) {
+    p_score = GetPScore(f, p, nu2);
   }
   if (p_score < 0.5 || isnan(p_score) || isinf(p_score) || p_score == 1.0) {
     std::cerr << "computing p score for f " << f << " p: " << p << " n0 " <<
@@ -463,6 +514,37 @@ double OnlineCalibrator::ComputeYao1965(
   return p_score;
 }
 
+bool OnlineCalibrator::GetYao1965Statistic(
+    const CalibrationWindow& window0,
+    const CalibrationWindow& window1,
+    double& f, double& nu2, double& t2)
+{
+  const double p = window0.covariance.rows();
+  const double n0 = window0.num_measurements;
+  const double n1 = window1.num_measurements;
+  const Eigen::MatrixXd& s0 = window0.covariance;
+  const Eigen::MatrixXd& s1 = window1.covariance;
+
+  //// ZZZ IMPLEMENT CONDITION NUMBER INSTEAD OF RANK HERE
+  if (n0 == 0 || n1 == 0 || p == 0 || !window0.is_full_rank ||
+      !window1.is_full_rank) {
+    return false;
+  }
+
+  // s_inv * xd, which every term below is built from.
+  const Eigen::VectorXd xd = window0.mean - window1.mean;
+  const Eigen::VectorXd s_inv_xd = (s0 + s1).ldlt().solve(xd);
+  t2 = xd.dot(s_inv_xd);
+  const double v_denom = t2;
+  const double v = 1.0 /
+      ((1.0 / n0) * powi(s_inv_xd.dot(s0 * s_inv_xd) / v_denom, 2) +
+      (1.0 / n1) * powi(s_inv_xd.dot(s1 * s_inv_xd) / v_denom, 2));
+
+  f = t2 / ((v * p) / (v - p + 1));
+  nu2 = v - p + 1;
+  return true;
+}
+
 double OnlineCalibrator::ComputeNelVanDerMerwe1986(
     const CalibrationWindow& window0,
     const CalibrationWindow& window1)
@@ -476,13 +558,12 @@ double OnlineCalibrator::ComputeNelVanDerMerwe1986(
       window1.covariance;
 
   //// ZZZ IMPLEMENT CONDITION NUMBER INSTEAD OF RANK HERE
-  if (n0 == 0 || n1 == 0 || p == 0 || s0.fullPivLu().rank() != p ||
-      s1.fullPivLu().rank() != p) {
+  if (n0 == 0 || n1 == 0 || p == 0 || !window0.is_full_rank ||
+      !window1.is_full_rank) {
     return 1.0;
   }
 
   const Eigen::MatrixXd s = (s0 + s1);
-  const Eigen::MatrixXd s_inv = s.inverse();
   const Eigen::MatrixXd s_2 = s * s;
   const Eigen::MatrixXd s0_2 = s0 * s0;
   const Eigen::MatrixXd s1_2 = s1 * s1;
@@ -490,9 +571,9 @@ double OnlineCalibrator::ComputeNelVanDerMerwe1986(
   const double v = (s_2.trace() + powi(s.trace(), 2)) /
       ((1.0 / n0 * (s0_2.trace() + powi(s0.trace(), 2))) +
         (1.0 / n1 * (s1_2.trace() + powi(s1.trace(), 2))));
-  const double t2 = xd.transpose() * s_inv * xd;
+  const double t2 = xd.dot(s.ldlt().solve(xd));
   const double f = t2 / ((v * p) / (v - p + 1));
-  const double p_score = compute_p_score(f, p, v - p + 1);
+  const double p_score = GetPScore(f, p, v - p + 1);
 
   if (p_score < 0.1 || isnan(p_score) || isinf(p_score)) {
     std::cerr << "computing p score for f " << f << " p: " << p << " n0 " <<
@@ -506,61 +587,157 @@ double OnlineCalibrator::ComputeNelVanDerMerwe1986(
   return p_score;
 }
 
+std::shared_ptr<DenseTrack> OnlineCalibrator::GetLongestTrack(
+    const TrackerPose& pose, uint32_t cam_id)
+{
+  uint32_t max_keypoints = 0;
+  std::shared_ptr<DenseTrack> longest_track = nullptr;
+  for (std::shared_ptr<DenseTrack> track : pose.tracks) {
+    if (track->ref_cam_id == cam_id &&
+        track->keypoints.size() > max_keypoints) {
+      max_keypoints = track->keypoints.size();
+      longest_track = track;
+    }
+  }
+  return longest_track;
+}
+
+bool OnlineCalibrator::ComputeSparseMarginals(
+    const std::vector<std::shared_ptr<TrackerPose>>& poses,
+    const CalibrationWindow& window, Eigen::MatrixXd& covariance)
+{
+  const std::shared_ptr<calibu::CameraInterface<Scalar>> cam =
+      selfcal_ba.rig()->cameras_[0];
+  const Sophus::SE3d t_pc = cam->Pose();
+  // The first pose of the window is fixed, as in AddCalibrationWindowToBa.
+  CalibrationMarginals marginals(window.end_index - window.start_index - 1,
+                                 cam->NumParams());
+  const std::shared_ptr<DenseTrack> longest_track =
+      GetLongestTrack(*poses[window.start_index], cam_id_);
+
+  for (uint32_t ii = window.start_index; ii < window.end_index; ++ii) {
+    const TrackerPose& ref_pose = *poses[ii];
+    const Sophus::SE3d t_wc_a =
+        selfcal_ba.GetPose(ref_pose.opt_id[ba_id_]).t_wp * t_pc;
+    for (const std::shared_ptr<DenseTrack>& track : ref_pose.tracks) {
+      if (track->external_id[ba_id_] == UINT_MAX) {
+        continue;
+      }
+      marginals.BeginLandmark(
+            (int)ii - (int)window.start_index - 1,
+            longest_track == nullptr || track->id != longest_track->id);
+
+      // Parameterize the landmark as the tracker does, by the inverse depth
+      // along the ray of its reference pixel, so that the ray moves with the
+      // camera parameters.
+      const Eigen::Vector2d& ref_px = track->ref_keypoint.center_px;
+      const Eigen::Vector3d ray = cam->Unproject(ref_px);
+      const Eigen::Vector4d x_a = MultHomogeneous(
+            t_wc_a.inverse(),
+            selfcal_ba.GetLandmark(track->external_id[ba_id_]));
+      const double rho = x_a[3] * ray.norm() / x_a.head<3>().norm();
+      Eigen::Vector4d x_w;
+      x_w << ray, rho;
+      x_w = MultHomogeneous(t_wc_a, x_w);
+
+      // Derivative of x_w under a left perturbation of the reference pose.
+      Eigen::Matrix<double, 4, 6> dx_w_dpose =
+          Eigen::Matrix<double, 4, 6>::Zero();
+      dx_w_dpose.block<3, 3>(0, 0) =
+          x_w[3] * Eigen::Matrix3d::Identity();
+      dx_w_dpose.block<3, 3>(0, 3) = -Sophus::SO3d::hat(x_w.head<3>());
+
+      // The reference keypoint has no information, as it defines the ray.
+      for (size_t jj = 1; jj < track->keypoints.size() &&
+           jj < (window.end_index - ii) ; ++jj) {
+        if (!track->keypoints[jj][cam_id_].tracked) {
+          continue;
+        }
+        const Sophus::SE3d t_cw_b =
+            (selfcal_ba.GetPose(ref_pose.opt_id[ba_id_] + jj).t_wp *
+             t_pc).inverse();
+        const Sophus::SE3d t_ba = t_cw_b * t_wc_a;
+        const Eigen::Vector4d x_b = MultHomogeneous(t_cw_b, x_w);
+        const Eigen::Matrix<double, 2, 4> dz_dx_b =
+            cam->dTransfer3d_dray(Sophus::SE3d(), x_b.head<3>(), x_b[3]);
+        const CalibrationMarginals::PoseJacobian dz_dref_pose =
+            dz_dx_b * t_cw_b.matrix() * dx_w_dpose;
+        marginals.AddObservation(
+              (int)(ii + jj) - (int)window.start_index - 1, dz_dref_pose,
+              -dz_dref_pose, dz_dx_b * t_ba.matrix().col(3),
+              cam->dTransfer_dparams(t_ba, ref_px, rho));
+      }
+      marginals.EndLandmark();
+    }
+  }
+  return marginals.Compute(covariance);
+}
+
 void OnlineCalibrator::SetBaDebugLevel(int level)
 {
    selfcal_ba.debug_level_threshold = level;
    vi_selfcal_ba.debug_level_threshold = level;
 }
 
-double OnlineCalibrator::ComputeHotellingScore(
+bool OnlineCalibrator::GetHotellingStatistic(
     const CalibrationWindow& window0,
-    const CalibrationWindow& window1)
+    const CalibrationWindow& window1,
+    double& f, double& nu2)
 {
   const double p = window0.covariance.rows();
   const double n0 = window0.num_measurements;
   const double n1 = window1.num_measurements;
   if (n0 == 0 || n1 == 0 || p == 0) {
-    return 0;
+    return false;
   }
 
   const Eigen::MatrixXd cov_pooled =
       ((n0 - 1) * window0.covariance + (n1) * window1.covariance) /
       (n0 + n1 - 2);
   const Eigen::VectorXd mean_diff = window0.mean - window1.mean;
-  const double t_squared = mean_diff.transpose() *
-      (cov_pooled * (1.0 / n0 + 1.0 / n1)).inverse() * mean_diff;
-  const double f_val = (n0 + n1 - p - 1.0) / (p * (n0 + n1 - 2.0)) * t_squared;
-  const double p_score = compute_p_score(f_val, p, n0 + n1 - p - 1);
+  const double t_squared = mean_diff.dot(
+        (cov_pooled * (1.0 / n0 + 1.0 / n1)).ldlt().solve(mean_diff));
+  f = (n0 + n1 - p - 1.0) / (p * (n0 + n1 - 2.0)) * t_squared;
+  nu2 = n0 + n1 - p - 1;
+  return true;
+}
+
+double OnlineCalibrator::ComputeHotellingScore(
+    const CalibrationWindow& window0,
+    const CalibrationWindow& window1)
+{
+  double f_val, nu2;
+  if (!GetHotellingStatistic(window0, window1, f_val, nu2)) {
+    return 0;
+  }
+  const double p_score = GetPScore(f_val, window0.covariance.rows(), nu2);
   return p_score;
 }
 
+double OnlineCalibrator::GetPScore(double f, double p, double nu2) const
+{
+  return p == f_table_.nu1() ? f_table_.UpperTail(f, nu2) :
+      compute_p_score(f, p, nu2);
+}
+
 double OnlineCalibrator::ComputeKlDivergence(
     const CalibrationWindow& window0,
     const CalibrationWindow& window1)
 {
-  const Eigen::MatrixXd cov0 =  covariance_weights_.asDiagonal() *
-      window0.covariance * covariance_weights_.asDiagonal();
-  const Eigen::MatrixXd cov1 =  covariance_weights_.asDiagonal() *
-      window1.covariance * covariance_weights_.asDiagonal();
-  const Eigen::VectorXd mean0 =
-      covariance_weights_.array() * window0.mean.array();
-  const Eigen::VectorXd mean1 =
-      covariance_weights_.array() * window1.mean.array();
-  // std::cerr << "\tComputing KL divergence between\n " << cov0 <<
-  //              "\t \n and \n\t" << cov1 << std::endl;
-  const Eigen::VectorXd mean1_sub_mean0 = mean1 - mean0;
-  // std::cerr << "\tMean diff. is " << mean1_sub_mean0.transpose() << std::endl;
-  // std::cerr << "\tCov inverse is\n" << cov1.inverse() << std::endl;
-  const Eigen::MatrixXd cov1_inv = cov1.inverse();
-  return (cov1_inv * cov0).trace() + mean1_sub_mean0.transpose() *
-      cov1_inv * mean1_sub_mean0 - mean1_sub_mean0.rows() -
-      log(cov0.determinant() / cov1.determinant());
+  // The weights scale both distributions the same way, so they cancel in
+  // every term, the log-determinant ratio included. This leaves solves
+  // against the cached factorization of window1.
+  const Eigen::VectorXd mean1_sub_mean0 = window1.mean - window0.mean;
+  return window1.covariance_ldlt.solve(window0.covariance).trace() +
+      mean1_sub_mean0.dot(window1.covariance_ldlt.solve(mean1_sub_mean0)) -
+      mean1_sub_mean0.rows() -
+      (window0.weighted_log_det - window1.weighted_log_det);
 }
 
 void OnlineCalibrator::SetPriorityQueueDistribution(
     const Eigen::MatrixXd &covariance, const Eigen::VectorXd &mean)
 {
-  total_window_.covariance = covariance;
+  SetWindowCovariance(total_window_, covariance);
   total_window_.mean = mean;
 
   // Now calculate the KL divergence of all of the windows to the batch
@@ -575,13 +752,125 @@ void OnlineCalibrator::SetPriorityQueueDistribution(
   }*/
 }
 
+Eigen::MatrixXd OnlineCalibrator::GetWindowInformation(
+    const CalibrationWindow& window)
+{
+  if (window.is_full_rank) {
+    return window.covariance_ldlt.solve(
+          Eigen::MatrixXd::Identity(window.covariance.rows(),
+                                    window.covariance.cols()));
+  }
+  // Unobservable directions carry no information.
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(window.covariance);
+  if (eig.info() != Eigen::Success) {
+    return Eigen::MatrixXd();
+  }
+  Eigen::VectorXd inv_values = eig.eigenvalues();
+  const double min_value =
+      1e-12 * std::max(1.0, inv_values.cwiseAbs().maxCoeff());
+  for (int ii = 0; ii < inv_values.rows(); ++ii) {
+    inv_values[ii] = inv_values[ii] > min_value ? 1.0 / inv_values[ii] : 0;
+  }
+  return eig.eigenvectors() * inv_values.asDiagonal() *
+      eig.eigenvectors().transpose();
+}
+
+void OnlineCalibrator::SetWindowCovariance(CalibrationWindow& window,
+                                           const Eigen::MatrixXd& covariance)
+{
+  window.covariance = covariance;
+  window.is_full_rank = false;
+  window.weighted_log_det = 0;
+  if (covariance.rows() != 0) {
+    window.covariance_ldlt.compute(covariance);
+    // The same tolerance as the rank of a full pivoting LU.
+    const Eigen::VectorXd d = window.covariance_ldlt.vectorD();
+    window.is_full_rank = window.covariance_ldlt.info() == Eigen::Success &&
+        d.minCoeff() > Eigen::NumTraits<double>::epsilon() * d.rows() *
+        d.cwiseAbs().maxCoeff();
+  }
+  if (window.is_full_rank) {
+    // The weights scale the covariance on both sides.
+    window.weighted_log_det =
+        window.covariance_ldlt.vectorD().array().log().sum() +
+        2 * covariance_weights_.array().log().sum();
+  }
+  window.information = GetWindowInformation(window);
+}
+
+Eigen::MatrixXd OnlineCalibrator::GetFrameInformation(
+    const std::vector<std::shared_ptr<TrackerPose>>& poses,
+    uint32_t pose_id)
+{
+  const std::shared_ptr<calibu::CameraInterface<Scalar>> cam =
+      rig_->cameras_[cam_id_];
+  Eigen::MatrixXd information =
+      Eigen::MatrixXd::Zero(cam->NumParams(), cam->NumParams());
+  std::lock_guard<std::mutex> lock(*ba_mutex_);
+  const Sophus::SE3d t_pc = cam->Pose();
+  const Sophus::SE3d t_cw_b = (poses[pose_id]->t_wp * t_pc).inverse();
+  const uint32_t first_pose =
+      pose_id >= window_length_ ? pose_id - window_length_ + 1 : 0;
+  for (uint32_t ii = first_pose; ii < pose_id; ++ii) {
+    const Sophus::SE3d t_ba = t_cw_b * poses[ii]->t_wp * t_pc;
+    const uint32_t jj = pose_id - ii;
+    for (const std::shared_ptr<DenseTrack>& track : poses[ii]->tracks) {
+      if (track->ref_cam_id != cam_id_ || track->is_outlier ||
+          jj >= track->keypoints.size() ||
+          !track->keypoints[jj][cam_id_].tracked) {
+        continue;
+      }
+      // The tracker's inverse depth is along the normalized ray.
+      const Eigen::Vector2d& ref_px = track->ref_keypoint.center_px;
+      const double rho =
+          track->ref_keypoint.rho * cam->Unproject(ref_px).norm();
+      const Eigen::MatrixXd dz_dparams =
+          cam->dTransfer_dparams(t_ba, ref_px, rho);
+      information += dz_dparams.transpose() * dz_dparams;
+    }
+  }
+  return information;
+}
+
+double OnlineCalibrator::GetInformationScore(
+    const Eigen::MatrixXd& information)
+{
+  if (information.rows() != covariance_weights_.rows()) {
+    return 0;
+  }
+  const Eigen::LDLT<Eigen::MatrixXd> ldlt(information);
+  const Eigen::VectorXd d = ldlt.vectorD();
+  if (ldlt.info() != Eigen::Success || d.minCoeff() <=
+      Eigen::NumTraits<double>::epsilon() * d.rows() *
+      d.cwiseAbs().maxCoeff()) {
+    return 0;
+  }
+  // Determinant of the weighted covariance, as in GetWindowScore.
+  return std::exp(2 * covariance_weights_.array().log().sum() -
+                  d.array().log().sum());
+}
+
+bool OnlineCalibrator::CanEnterQueue(double score)
+{
+  if (score == 0) {
+    return false;
+  }
+  if (windows_.size() < queue_length_) {
+    return true;
+  }
+  double max_score = 0;
+  for (const CalibrationWindow& window : windows_) {
+    max_score = std::max(max_score, window.score);
+  }
+  return (max_score - score) / max_score > kMinReplaceMargin;
+}
+
 double OnlineCalibrator::GetWindowScore(const CalibrationWindow& window)
 {
-  if (window.covariance.fullPivLu().rank() == covariance_weights_.rows()) {
-    // First transform the covariance given the weights.
-    return
-        (covariance_weights_.asDiagonal() * window.covariance *
-         covariance_weights_.asDiagonal()).determinant();
+  if (window.is_full_rank &&
+      window.covariance.rows() == covariance_weights_.rows()) {
+    // Determinant of the weighted covariance.
+    return std::exp(window.weighted_log_det);
   } else {
     return 0;
   }
@@ -595,7 +884,7 @@ void OnlineCalibrator::AnalyzeCalibrationWindow(
     CalibrationWindow &window,
     uint32_t num_iterations, bool apply_results)
 {
-  Eigen::VectorXd cam_params_backup = rig_->cameras_[0]->GetParams();
+  Eigen::VectorXd cam_params_backup = rig_->cameras_[cam_id_]->GetParams();
   std::cerr << "Analyzing calibration window with imu = " << UseImu <<
                " from " << start_pose << " to " << end_pose << std::endl;
   Proxy<UseImu> ba_proxy(this);
@@ -604,15 +893,20 @@ void OnlineCalibrator::AnalyzeCalibrationWindow(
   window.start_index = start_pose;
   window.end_index = end_pose;
 
+  // Visual windows do not need the adjuster's dense marginals, so long ones
+  // can be solved with the sparse solver.
+  const bool sparse_marginals = use_sparse_marginals_ && !UseImu;
+
   ba::Options<double> options;
   options.write_reduced_camera_matrix = false;
   options.projection_outlier_threshold = 1.0;
   options.trust_region_size = 10;
   options.use_dogleg = true;
-  options.use_sparse_solver = false;//(end_pose - start_pose) > window_length_ * 10;
+  options.use_sparse_solver =
+      sparse_marginals && (end_pose - start_pose) > window_length_ * 10;
   /// ZZZZ WHY IS THIS NEEDED? SPARSE IS BROKEN WITH TRIANGULAR IT SEEMS.
   options.use_triangular_matrices = !options.use_sparse_solver;
-  options.calculate_calibration_marginals = true;
+  options.calculate_calibration_marginals = !sparse_marginals;
   options.error_change_threshold = 1e-6;
   options.trust_region_size = 100;
 
@@ -629,7 +923,7 @@ void OnlineCalibrator::AnalyzeCalibrationWindow(
                     current_tracks->size() * poses.size());
 
     {
-      ba.AddCamera(rig_->cameras_[0]);
+      ba.AddCamera(rig_->cameras_[cam_id_]);
       std::lock_guard<std::mutex> lock(*ba_mutex_);
       AddCalibrationWindowToBa<UseImu>(poses, window);
     }
@@ -641,7 +935,15 @@ void OnlineCalibrator::AnalyzeCalibrationWindow(
         ba.GetSolutionSummary();
     // Obtain the mean from the BA.
     window.mean = ba.rig()->cameras_[0]->GetParams();
-    window.covariance = summary.calibration_marginals;
+    Eigen::MatrixXd covariance;
+    if (!sparse_marginals) {
+      covariance = summary.calibration_marginals;
+    } else if (!ComputeSparseMarginals(poses, window, covariance)) {
+      // Rank zero, so the window is scored as degenerate.
+      covariance =
+          Eigen::MatrixXd::Zero(window.mean.rows(), window.mean.rows());
+    }
+    SetWindowCovariance(window, covariance);
     std::cerr << "BA cov is:\n" << window.covariance << std::endl;
     std::cerr << "BA mean is:" << window.mean.transpose().format(kLongFmt) <<
                  std::endl;
@@ -649,18 +951,11 @@ void OnlineCalibrator::AnalyzeCalibrationWindow(
 
     if (apply_results) {
       std::lock_guard<std::mutex> lock(*ba_mutex_);
-      rig_->cameras_[0]->Pose().so3() = ba.rig()->cameras_[0]->Pose().so3();
-      std::cerr << "new t_wc\n:" << rig_->cameras_[0]->Pose().matrix() << std::endl;
-
-      Sophus::SE3d t_ba;
-      std::shared_ptr<TrackerPose> last_pose = poses.back();
-      // Get the pose of the last pose. This is used to calculate the relative
-      // transform from the pose to the current pose.
-      last_pose->t_wp = ba.GetPose(last_pose->opt_id[ba_id_]).t_wp;
-      // std::cerr << "last pose t_wp: " << std::endl << last_pose->t_wp.matrix() <<
-      //              std::endl;
-
-      // Read out the pose and landmark values.
+      rig_->cameras_[cam_id_]->Pose().so3() = ba.rig()->cameras_[0]->Pose().so3();
+      std::cerr << "new t_wc\n:" << rig_->cameras_[cam_id_]->Pose().matrix() << std::endl;
+
+      // Read out the poses. Patches are backprojected by the tracker, once
+      // the caller tells it the calibration changed.
       for (uint32_t ii = start_pose ; ii < poses.size() ; ++ii) {
         std::shared_ptr<TrackerPose> pose = poses[ii];
         const ba::PoseT<double>& ba_pose =
@@ -670,44 +965,10 @@ void OnlineCalibrator::AnalyzeCalibrationWindow(
         //              std::endl << ba_pose.t_wp.matrix() << std::endl;
 
         pose->t_wp = ba_pose.t_wp;
-
-        t_ba = last_pose->t_wp.inverse() * pose->t_wp;
-        for (std::shared_ptr<DenseTrack> track: pose->tracks) {
-          if (track->external_id[ba_id_] == UINT_MAX) {
-            continue;
-          }
-          /*
-          // Set the t_ab on this track.
-          //std::cerr << "Changing track t_ba from " << std::endl <<
-          //             track->t_ba.matrix() << std::endl << " to " <<
-          //             t_ba.matrix() << std::endl;
-          track->t_ba = t_ba;
-
-          // Get the landmark location in the world frame.
-          const Eigen::Vector4d& x_w =
-              ba.GetLandmark(track->external_id[ba_id_]);
-          Eigen::Vector4d prev_ray;
-          prev_ray.head<3>() = track->ref_keypoint.ray;
-          prev_ray[3] = track->ref_keypoint.rho;
-          // Make the ray relative to the pose.
-          Eigen::Vector4d x_r = sdtrack::MultHomogeneous()
-                (pose->t_wp * rig_->t_wc_[0]).inverse(), x_w);
-
-          track->ref_keypoint.ray = x_r.head<3>();
-          // Normalize the xyz component of the ray to compare to the original
-          // ray.
-          x_r /= x_r.head<3>().norm();
-          // std::cerr << "lm " << track->external_id << " x_r " <<
-          //              prev_ray.transpose() << " after opt: " <<
-          //              x_r.transpose() << std::endl;
-          // Update the inverse depth on the track
-          track->ref_keypoint.rho = x_r[3];*/
-          track->needs_backprojection = true;
-        }
       }
     } else {
       std::lock_guard<std::mutex> lock(*ba_mutex_);
-      rig_->cameras_[0]->SetParams(cam_params_backup);
+      rig_->cameras_[cam_id_]->SetParams(cam_params_backup);
     }
   }
 }
@@ -1,12 +1,15 @@
 #pragma once
+#include <algorithm>
 #include <vector>
 #include <calibu/cam/camera_crtp.h>
+#include <Eigen/Cholesky>
 #include <Eigen/Eigenvalues>
 #include <ba/BundleAdjuster.h>
-#include <ba/InterpolationBuffer.h>
 #include <sdtrack/semi_dense_tracker.h>
 #include "math_types.h"
 #include "etc_common.h"
+#include "imu_history.h"
+#include "f_distribution_table.h"
 #include <mutex>
 
 #define LM_DIM 3
@@ -27,6 +30,18 @@ struct CalibrationWindow {
   double kl_divergence = 0;
   Eigen::MatrixXd covariance;
   Eigen::VectorXd mean;
+  // Inverse of the covariance, i.e. the window's information on the
+  // calibration parameters with all other states marginalized out. Cached
+  // when the window is analyzed so that the queue can be fused without
+  // solving it again.
+  Eigen::MatrixXd information;
+  // Factorization of the covariance, whether it has full rank and the
+  // log-determinant of the weighted covariance. Set along with the
+  // covariance by OnlineCalibrator::SetWindowCovariance, so that comparing
+  // windows only takes solves.
+  Eigen::LDLT<Eigen::MatrixXd> covariance_ldlt;
+  bool is_full_rank = false;
+  double weighted_log_det = 0;
   uint32_t num_measurements;
 };
 
@@ -37,8 +52,8 @@ class OnlineCalibrator {
       std::mutex* ba_mutex, calibu::Rig<Scalar>* rig, uint32_t num_windows,
       uint32_t window_length, Eigen::VectorXd covariance_weights,
       double imu_time_offset_in = 0,
-      ba::InterpolationBufferT<ba::ImuMeasurementT<double>, double>* buffer =
-          nullptr);
+      sdtrack::ImuHistory<ba::ImuMeasurementT<double>>* buffer =
+          nullptr, uint32_t cam_id = 0);
   void TestJacobian(Eigen::Vector2t pix, Sophus::SE3t t_ba, Scalar rho);
 
   template <bool UseImu>
@@ -48,6 +63,16 @@ class OnlineCalibrator {
       CalibrationWindow& overal_window, uint32_t num_iterations = 1,
       bool apply_results = false);
 
+  ///
+  /// \brief Forms the priority queue distribution from the information
+  /// cached on each window, treating the windows as independent
+  /// measurements of the calibration. This replaces the joint solve of
+  /// AnalyzePriorityQueue, which is only needed to refine the solution.
+  /// \return false if the windows do not constrain all parameters.
+  ///
+  bool FusePriorityQueue(CalibrationWindow& overal_window,
+                         bool apply_results = false);
+
   template <bool UseImu>
   void AddCalibrationWindowToBa(
       std::vector<std::shared_ptr<TrackerPose>>& poses,
@@ -63,7 +88,44 @@ class OnlineCalibrator {
       uint32_t num_iterations = 1, bool apply_results = false);
   const std::vector<CalibrationWindow>& windows() { return windows_; }
   void ClearQueue() { windows_.clear(); }
+
+  ///
+  /// \brief Replaces the queue with windows saved by a previous run, of
+  /// which only the mean, covariance and number of measurements are used.
+  /// They have no poses in this run, so they only enter the queue through
+  /// FusePriorityQueue, until better windows of this run replace them.
+  ///
+  void RestoreQueue(const std::vector<CalibrationWindow>& windows);
   double GetWindowScore(const CalibrationWindow& window);
+  Eigen::MatrixXd GetWindowInformation(const CalibrationWindow& window);
+
+  ///
+  /// \brief Sets the covariance of a window along with its factorization,
+  /// rank, weighted log-determinant and information.
+  ///
+  void SetWindowCovariance(CalibrationWindow& window,
+                           const Eigen::MatrixXd& covariance);
+
+  ///
+  /// \brief Information on the camera parameters from the observations made
+  /// at one pose, holding the poses and landmarks fixed. Only tracks started
+  /// up to a window length earlier are counted, so that summed over a window
+  /// this is, to first order, never less than what the window's solve will
+  /// find, and the score from it is a lower bound on the window's score.
+  ///
+  Eigen::MatrixXd GetFrameInformation(
+      const std::vector<std::shared_ptr<TrackerPose>>& poses,
+      uint32_t pose_id);
+
+  /// Score of a window with the given information, 0 if it is degenerate.
+  double GetInformationScore(const Eigen::MatrixXd& information);
+
+  ///
+  /// \brief Whether a window with the given score could enter the queue. As
+  /// only a full queue is checked against, this never rejects a window that
+  /// AnalyzeCalibrationWindow would accept.
+  ///
+  bool CanEnterQueue(double score);
 
   double ComputeKlDivergence(const CalibrationWindow& window0,
                              const CalibrationWindow& window1);
@@ -82,12 +144,55 @@ class OnlineCalibrator {
 
   void SetBaDebugLevel(int level);
 
+  ///
+  /// \brief Whether visual windows recover their calibration marginals with
+  /// ComputeSparseMarginals instead of from the adjuster's dense system.
+  ///
+  void SetUseSparseMarginals(bool use_sparse_marginals) {
+    use_sparse_marginals_ = use_sparse_marginals;
+  }
+
+  /// Camera of the rig whose parameters this calibrator estimates.
+  uint32_t cam_id() { return cam_id_; }
   uint32_t NumWindows() { return windows_.size(); }
   uint32_t queue_length() { return queue_length_; }
   bool needs_update() { return needs_update_; }
 private:
+  ///
+  /// \brief Marginal covariance of the camera parameters of a visual window
+  /// solved by selfcal_ba, computed from a sparse Schur complement.
+  /// \return false if the window does not constrain all parameters.
+  ///
+  bool ComputeSparseMarginals(
+      const std::vector<std::shared_ptr<TrackerPose>>& poses,
+      const CalibrationWindow& window, Eigen::MatrixXd& covariance);
+
+  // The track of a camera with the most keypoints, whose landmark fixes the
+  // scale of a visual window.
+  static std::shared_ptr<DenseTrack> GetLongestTrack(const TrackerPose& pose,
+                                                     uint32_t cam_id);
+
+  // F statistic of the Hotelling and Yao tests between two windows, and its
+  // second number of degrees of freedom. false if the windows cannot be
+  // compared, in which case the score is fixed instead.
+  static bool GetHotellingStatistic(const CalibrationWindow& window0,
+                                    const CalibrationWindow& window1,
+                                    double& f, double& nu2);
+  static bool GetYao1965Statistic(const CalibrationWindow& window0,
+                                  const CalibrationWindow& window1,
+                                  double& f, double& nu2, double& t2);
+
+  // Q(f|p,nu2) of the F distribution, from the table when p is the number
+  // of camera parameters.
+  double GetPScore(double f, double p, double nu2) const;
+
+  // Margin by which a window has to beat one in the queue to replace it.
+  static constexpr double kMinReplaceMargin = 0.05;
+
   bool needs_update_ = false;
+  bool use_sparse_marginals_ = true;
   std::vector<CalibrationWindow> windows_;
+  FDistributionTable f_table_;
   uint32_t queue_length_ = 5;
   uint32_t window_length_ = 10;
   calibu::Rig<Scalar>* rig_;
@@ -95,7 +200,10 @@ private:
   CalibrationWindow total_window_;
   ba::BundleAdjuster<double, 1, 6, 5> selfcal_ba;
   ba::BundleAdjuster<double, 1, 15, 5, false> vi_selfcal_ba;
-  ba::InterpolationBufferT<ba::ImuMeasurementT<double>, double>* imu_buffer;
+  sdtrack::ImuHistory<ba::ImuMeasurementT<double>>* imu_buffer;
+  uint32_t cam_id_ = 0;
+  // Calibrators of different cameras use different ids, so that they can
+  // analyze the same poses concurrently.
   uint32_t ba_id_ = 2;
   double imu_time_offset;
   std::mutex* ba_mutex_;
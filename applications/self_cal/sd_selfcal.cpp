@@ -16,12 +16,21 @@
 #include <SceneGraph/SceneGraph.h>
 #include <pangolin/pangolin.h>
 #include <ba/BundleAdjuster.h>
-#include <ba/InterpolationBuffer.h>
 #include <sdtrack/utils.h>
 #include "math_types.h"
 #include "gui_common.h"
+#include "ba_window.h"
+#include "imu_history.h"
+#include "imu_preintegration.h"
+#include "landmark_selector.h"
+#include "ba_scheduler.h"
+#include "pose_graph.h"
+#include "spsc_ring.h"
 #include "CVars/CVar.h"
+#include <atomic>
 #include <thread>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 #include "selfcal-cvars.h"
 #include "chi2inv.h"
 
@@ -30,8 +39,13 @@
 #endif
 
 #include <sdtrack/semi_dense_tracker.h>
+#include <sdtrack/trace.h>
+#include <sdtrack/diagnostics.h>
 
 #include "online_calibrator.h"
+#include "calibration_state.h"
+#include "sliding_information.h"
+#include "observability_gate.h"
 
 #define POSES_TO_INIT 30
 
@@ -55,7 +69,9 @@ uint32_t self_cal_segment_length = 10;
 const int window_width = 640 * 1.5;
 const int window_height = 480 * 1.5;
 std::string g_usage = "SD SELFCAL. Example usage:\n"
-    "-cam file:[loop=1]///Path/To/Dataset/[left,right]*pgm -cmod cameras.xml";
+    "-cam file:[loop=1]///Path/To/Dataset/[left,right]*pgm -cmod cameras.xml\n"
+    "Add -calib_state calib.bin to start from, and keep, the calibration of "
+    "previous runs.";
 bool is_keyframe = true, is_prev_keyframe = true;
 bool optimize_landmarks = true;
 bool optimize_pose = true;
@@ -71,12 +87,25 @@ int image_height;
 calibu::Rig<Scalar> rig;
 calibu::Rig<Scalar> selfcal_rig;
 calibu::Rig<Scalar> aac_rig;
+// Own copy of the cameras for the calibration worker, so that the tracker
+// never sees the parameters it is solving for.
+calibu::Rig<Scalar> window_rig;
 hal::Camera camera_device;
 bool has_imu = false;
 hal::IMU imu_device;
 sdtrack::SemiDenseTracker tracker;
 
-sdtrack::OnlineCalibrator online_calib;
+// Priority queue of each camera. Batch mode and change detection only run
+// for camera 0, the others are refined from their loaded calibration.
+std::vector<std::shared_ptr<sdtrack::OnlineCalibrator>> online_calibs;
+// Analyze the candidate windows of each camera on the calibration worker.
+std::vector<std::shared_ptr<sdtrack::OnlineCalibrator>> window_calibs;
+std::mutex window_calib_mutex;
+// Where the calibration is kept between runs, if anywhere.
+std::string calibration_state_file;
+// Set while the calibration restored from calibration_state_file has not
+// been checked against a window of this run.
+bool verify_restored_calibration = false;
 std::vector<pangolin::DataLog> plot_logs;
 std::vector<pangolin::Plotter*> plot_views;
 std::vector<pangolin::Plotter*> analysis_views;
@@ -102,15 +131,65 @@ std::shared_ptr<SceneGraph::GLPrimitives<>> line_strip;
 ba::BundleAdjuster<double, 1, 6, 0> bundle_adjuster;
 ba::BundleAdjuster<double, 1, 15, 0> vi_bundle_adjuster;
 ba::BundleAdjuster<double, 1, 15, 0> aac_bundle_adjuster;
-ba::InterpolationBufferT<ba::ImuMeasurementT<Scalar>, Scalar> imu_buffer;
+// Filled by the IMU driver thread and drained by the tracking thread.
+sdtrack::SpscRing<ba::ImuMeasurementT<Scalar>> imu_ring(4096);
+sdtrack::ImuHistory<ba::ImuMeasurementT<Scalar>> imu_buffer;
+sdtrack::ImuPreintegrationCache<ba::ImuMeasurementT<Scalar>> imu_preintegration;
 std::vector<uint32_t> ba_imu_residual_ids, aac_imu_residual_ids;
 int orig_num_aac_poses = num_aac_poses;
 double prev_cond_error;
 int imu_cond_start_pose_id = -1;
 int imu_cond_residual_id = -1;
-std::shared_ptr<std::thread> aac_thread;
+// Window state of each adjuster, indexed like TrackerPose::opt_id.
+sdtrack::BaWindow<ba::ImuMeasurementT<Scalar>> ba_windows[3];
+sdtrack::LandmarkSelector landmark_selectors[3];
+sdtrack::BaScheduler ba_scheduler;
 std::mutex aac_mutex;
 
+// Candidate window handed to the calibration worker.
+struct CalibrationRequest {
+  uint32_t epoch = 0;
+  uint32_t start_pose = 0;
+  uint32_t end_pose = 0;
+  bool use_imu = false;
+  // Per camera.
+  std::vector<Eigen::VectorXd> cam_params;
+  std::vector<Sophus::SE3d, Eigen::aligned_allocator<Sophus::SE3d>> t_wc;
+  // Copies of poses start_pose to end_pose, at their index.
+  sdtrack::PoseVector poses;
+  std::list<std::shared_ptr<sdtrack::DenseTrack>> tracks;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+struct CalibrationResult {
+  uint32_t epoch = 0;
+  // Per camera.
+  std::vector<sdtrack::CalibrationWindow> windows;
+  // Extrinsics of camera 0 solved along with a batch window.
+  Sophus::SE3d t_wc;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+sdtrack::BaScheduler calib_scheduler;
+std::shared_ptr<CalibrationRequest> calibration_request;
+std::shared_ptr<CalibrationResult> calibration_result;
+// Batch mode windows of camera 0, over everything since the calibration
+// became unknown. They have their own slots so that candidate windows do
+// not replace them.
+std::shared_ptr<CalibrationRequest> batch_request;
+std::shared_ptr<CalibrationResult> batch_result;
+// Bumped whenever the priority queue is cleared, which drops the windows
+// that are being analyzed.
+std::atomic<uint32_t> calibration_epoch(0);
+// Information of the candidate window of each camera, slid one keyframe at
+// a time.
+std::vector<sdtrack::SlidingInformation> window_information;
+// Excitation of the candidate window of each camera.
+std::vector<sdtrack::ObservabilityGate> observability_gates;
+uint32_t last_posted_window_end = 0;
+
 sdtrack::CalibrationWindow pq_window;
 sdtrack::CalibrationWindow candidate_window;
 double last_window_kl_divergence = 0;
@@ -129,11 +208,18 @@ void ImuCallback(const hal::ImuMsg& ref) {
   Eigen::VectorXd a, w;
   hal::ReadVector(ref.accel(), &a);
   hal::ReadVector(ref.gyro(), &w);
-  imu_buffer.AddElement(ba::ImuMeasurementT<Scalar>(w, a, timestamp));
+  imu_ring.Push(ba::ImuMeasurementT<Scalar>(w, a, timestamp));
   // std::cerr << "Added accel: " << a.transpose() << " and gyro " <<
   //              w.transpose() << " at time " << timestamp << std::endl;
 }
 
+// Moves the measurements received by ImuCallback into imu_buffer.
+void DrainImu() {
+  imu_ring.Drain([](const ba::ImuMeasurementT<Scalar>& meas) {
+    imu_buffer.AddElement(meas);
+  });
+}
+
 template <typename BaType>
 void DoBundleAdjustment(BaType& ba, bool use_imu,
                         bool do_adaptive_conditioning,
@@ -141,6 +227,7 @@ void DoBundleAdjustment(BaType& ba, bool use_imu,
                         std::vector<uint32_t>& imu_residual_ids,
                         calibu::Rig<Scalar>& ba_rig)
 {
+  SDTRACK_TRACE_SCOPE("DoBundleAdjustment");
   std::vector<uint32_t> last_frame_proj_residual_ids;
   if (reset_outliers) {
     for (std::shared_ptr<sdtrack::TrackerPose> pose : poses) {
@@ -192,6 +279,7 @@ void DoBundleAdjustment(BaType& ba, bool use_imu,
   }
 
   bool all_poses_active = start_active_pose == start_pose_id;
+  sdtrack::LandmarkSelector& selector = landmark_selectors[id];
 
   // Do a bundle adjustment on the current set
   if (current_tracks && end_pose_id) {
@@ -201,8 +289,27 @@ void DoBundleAdjustment(BaType& ba, bool use_imu,
         ba.SetGravity(gravity_vector);
       }
 
-      ba.Init(options, end_pose_id + 1, current_tracks->size() *
-              (end_pose_id + 1));
+      sdtrack::BaWindow<ba::ImuMeasurementT<Scalar>>& window = ba_windows[id];
+      window.Slide(poses, start_pose_id, end_pose_id);
+
+      // Pick the landmarks that go into the problem.
+      selector.Select(poses, start_pose_id, end_pose_id, ba_rig,
+                      id == 0 ? num_ba_landmarks : num_aac_landmarks,
+                      [&](uint32_t pose_id, const sdtrack::DenseTrack& track)
+                      -> sdtrack::LandmarkSelector::Candidacy {
+        const bool constrains_active =
+            track.keypoints.size() + pose_id > start_active_pose;
+        if (track.num_good_tracked_frames <= 1 || track.is_outlier ||
+            !constrains_active) {
+          return sdtrack::LandmarkSelector::kExcluded;
+        }
+        // The longest track may be the landmark that fixes the gauge.
+        return track.id == tracker.longest_track_id() ?
+              sdtrack::LandmarkSelector::kRequired :
+              sdtrack::LandmarkSelector::kCandidate;
+      });
+
+      ba.Init(options, window.num_poses(), selector.num_selected());
       for (uint32_t cam_id = 0; cam_id < ba_rig.cameras_.size(); ++cam_id) {
         ba.AddCamera(ba_rig.cameras_[cam_id]);
       }
@@ -219,8 +326,8 @@ void DoBundleAdjustment(BaType& ba, bool use_imu,
         }
 
         if (use_imu && ii >= start_active_pose && ii > 0) {
-          std::vector<ba::ImuMeasurementT<Scalar>> meas =
-              imu_buffer.GetRange(poses[ii - 1]->time, pose->time);
+          const std::vector<ba::ImuMeasurementT<Scalar>>& meas =
+              window.ImuMeasurements(poses, ii, imu_buffer);
 
           /*std::cerr << "Adding imu residual between poses " << ii - 1 << std::setprecision(15) <<
                        " with time " << poses[ii - 1]->time << " active: " <<
@@ -251,10 +358,7 @@ void DoBundleAdjustment(BaType& ba, bool use_imu,
         }
 
         for (std::shared_ptr<sdtrack::DenseTrack> track: pose->tracks) {
-          const bool constrains_active =
-              track->keypoints.size() + ii > start_active_pose;
-          if (track->num_good_tracked_frames <= 1 || track->is_outlier ||
-              !constrains_active) {
+          if (!selector.IsSelected(*track)) {
             track->external_id[id] = UINT_MAX;
             continue;
           }
@@ -350,6 +454,10 @@ void DoBundleAdjustment(BaType& ba, bool use_imu,
         t_ba = last_pose->t_wp.inverse() * pose->t_wp;
         for (std::shared_ptr<sdtrack::DenseTrack> track: pose->tracks) {
           if (track->external_id[id] == UINT_MAX) {
+            // Landmarks left out by the budget still follow the poses.
+            if (selector.IsCandidate(*track)) {
+              track->t_ba = t_ba;
+            }
             continue;
           }
           track->t_ba = t_ba;
@@ -416,10 +524,13 @@ void DoBundleAdjustment(BaType& ba, bool use_imu,
       prev_cond_error = DBL_MAX;
     }
 
-    const Scalar cond_v_chi2_dist =
-        chi2inv(adaptive_threshold, summary.num_cond_proj_residuals * 2);
+    // Called from the foreground and the conditioning threads, so each has
+    // its own table.
+    static thread_local Chi2InvTable chi2inv_table;
+    const Scalar cond_v_chi2_dist = chi2inv_table(
+          adaptive_threshold, summary.num_cond_proj_residuals * 2);
     const Scalar cond_i_chi2_dist =
-        chi2inv(adaptive_threshold, BaType::kPoseDim);
+        chi2inv_table(adaptive_threshold, BaType::kPoseDim);
 
     if (num_active_poses > end_pose_id) {
       num_active_poses = orig_num_aac_poses;
@@ -461,42 +572,441 @@ void UpdateCurrentPose()
     max_track_length = std::max(track->keypoints.size(), max_track_length);
   }
   current_pose->longest_track = max_track_length;
-  std::cerr << "Setting longest track for pose " << poses.size() << " to " <<
-               current_pose->longest_track << std::endl;
+  SDTRACK_LOG(FRAME) << "Setting longest track for pose " << poses.size() << " to " <<
+      current_pose->longest_track;
 }
 
-void DoAAC()
+void DoAAC(const sdtrack::BaScheduler::Job& job)
 {
+  if (!has_imu || !use_imu_measurements || poses.size() <= 10 ||
+      !do_async_ba) {
+    return;
+  }
+
+  orig_num_aac_poses = num_aac_poses;
   while (true) {
-    if (has_imu && use_imu_measurements &&
-        poses.size() > 10 && do_async_ba) {
-
-      orig_num_aac_poses = num_aac_poses;
-      while (true) {
-        if (poses.size() > min_poses_for_imu &&
-            use_imu_measurements && has_imu) {
-          {
-            std::lock_guard<std::mutex> lock(aac_mutex);
-            aac_rig.cameras_[0]->SetParams(rig.cameras_[0]->GetParams());
-            aac_rig.cameras_[0] = rig.cameras_[0];
-          }
-          DoBundleAdjustment(aac_bundle_adjuster, true, do_adaptive,
-                             num_aac_poses, 1, aac_imu_residual_ids,
-                             aac_rig);
-        }
+    if (poses.size() > min_poses_for_imu &&
+        use_imu_measurements && has_imu) {
+      {
+        std::lock_guard<std::mutex> lock(aac_mutex);
+        aac_rig.cameras_[0]->SetParams(rig.cameras_[0]->GetParams());
+        aac_rig.cameras_[0] = rig.cameras_[0];
+      }
+      DoBundleAdjustment(aac_bundle_adjuster, true, do_adaptive,
+                         num_aac_poses, 1, aac_imu_residual_ids,
+                         aac_rig);
+    }
 
-        if ((int)num_aac_poses == orig_num_aac_poses || !do_adaptive) {
-          break;
-        }
+    if ((int)num_aac_poses == orig_num_aac_poses || !do_adaptive) {
+      break;
+    }
 
-        usleep(10);
+    // A newer keyframe supersedes this window.
+    if (job.IsCancelled()) {
+      num_aac_poses = orig_num_aac_poses;
+      break;
+    }
+  }
+
+  imu_cond_start_pose_id = -1;
+  prev_cond_error = -1;
+}
+
+// Copies what the calibration worker needs to solve poses start_pose to
+// end_pose.
+std::shared_ptr<CalibrationRequest> SnapshotCalibrationWindow(
+    uint32_t start_pose, uint32_t end_pose, bool use_imu)
+{
+  std::shared_ptr<CalibrationRequest> request(new CalibrationRequest);
+  request->epoch = calibration_epoch;
+  request->start_pose = start_pose;
+  request->end_pose = end_pose;
+  request->use_imu = use_imu;
+  request->tracks = *current_tracks;
+  {
+    std::lock_guard<std::mutex> lock(aac_mutex);
+    for (uint32_t cam_id = 0; cam_id < selfcal_rig.cameras_.size();
+         ++cam_id) {
+      request->cam_params.push_back(
+            selfcal_rig.cameras_[cam_id]->GetParams());
+      request->t_wc.push_back(selfcal_rig.cameras_[cam_id]->Pose());
+    }
+    request->poses.resize(request->end_pose);
+    for (uint32_t ii = request->start_pose; ii < request->end_pose; ++ii) {
+      request->poses[ii] = sdtrack::PoseGraph::CopyPose(*poses[ii]);
+    }
+  }
+  return request;
+}
+
+// Snapshots the candidate window ending at the newest pose and hands it to
+// the calibration worker. A request the worker has not started yet is
+// replaced.
+void PostCalibrationWindow(bool use_imu)
+{
+  if (!current_tracks) {
+    return;
+  }
+
+  std::shared_ptr<CalibrationRequest> request = SnapshotCalibrationWindow(
+        std::max(0, (int)poses.size() - (int)self_cal_segment_length),
+        poses.size(), use_imu);
+  last_posted_window_end = request->end_pose;
+  std::atomic_store(&calibration_request, request);
+  calib_scheduler.Post(sdtrack::BaScheduler::kCalibrationWindow,
+                       request->end_pose);
+}
+
+// How much the newest keyframe excites the parameters of a camera.
+sdtrack::KeyframeExcitation GetKeyframeExcitation(uint32_t cam_id)
+{
+  sdtrack::KeyframeExcitation excitation;
+  const uint32_t pose_id = poses.size() - 1;
+  const sdtrack::TrackerPose& pose = *poses[pose_id];
+  const std::shared_ptr<calibu::CameraInterface<Scalar>> cam =
+      rig.cameras_[cam_id];
+  std::lock_guard<std::mutex> lock(aac_mutex);
+
+  // The gyro sees all of the rotation between the keyframes, the poses only
+  // the net one.
+  if (pose_id > 0) {
+    const sdtrack::TrackerPose& prev_pose = *poses[pose_id - 1];
+    const std::vector<ba::ImuMeasurementT<Scalar>> meas =
+        has_imu && use_imu_measurements ?
+          imu_buffer.GetRange(prev_pose.time, pose.time) :
+          std::vector<ba::ImuMeasurementT<Scalar>>();
+    if (meas.size() > 1) {
+      for (size_t ii = 1; ii < meas.size(); ++ii) {
+        excitation.rotation += 0.5 * (meas[ii - 1].w + meas[ii].w).norm() *
+            (meas[ii].time - meas[ii - 1].time);
       }
+    } else {
+      excitation.rotation =
+          (prev_pose.t_wp.so3().inverse() * pose.t_wp.so3()).log().norm();
+    }
+  }
 
-      imu_cond_start_pose_id = -1;
-      prev_cond_error = -1;
+  const Sophus::SO3d r_cw_b = (pose.t_wp.so3() * cam->Pose().so3()).inverse();
+  const uint32_t first_pose = pose_id >= self_cal_segment_length ?
+      pose_id - self_cal_segment_length + 1 : 0;
+  uint32_t num_observations = 0;
+  for (uint32_t ii = first_pose; ii < pose_id; ++ii) {
+    const Sophus::SO3d r_ba =
+        r_cw_b * poses[ii]->t_wp.so3() * cam->Pose().so3();
+    const uint32_t jj = pose_id - ii;
+    for (const std::shared_ptr<sdtrack::DenseTrack>& track :
+         poses[ii]->tracks) {
+      if (track->ref_cam_id != cam_id || track->is_outlier ||
+          jj >= track->keypoints.size() ||
+          !track->keypoints[jj][cam_id].tracked) {
+        continue;
+      }
+      const Eigen::Vector3d ray_a =
+          (r_ba * track->ref_keypoint.ray).normalized();
+      const Eigen::Vector3d ray_b =
+          cam->Unproject(track->keypoints[jj][cam_id].kp).normalized();
+      excitation.parallax +=
+          std::acos(std::max(-1.0, std::min(1.0, ray_a.dot(ray_b))));
+      num_observations++;
+    }
+  }
+  if (num_observations > 0) {
+    excitation.parallax /= num_observations;
+  }
+
+  uint32_t num_cells = 0, num_covered_cells = 0;
+  const auto& cells = tracker.feature_cells()[cam_id];
+  for (int row = 0; row < cells.rows(); ++row) {
+    for (int col = 0; col < cells.cols(); ++col) {
+      if (cells(row, col) != sdtrack::SemiDenseTracker::kUnusedCell) {
+        num_cells++;
+        num_covered_cells += cells(row, col) > 0;
+      }
     }
-    usleep(1000);
   }
+  if (num_cells > 0) {
+    excitation.coverage = (double)num_covered_cells / num_cells;
+  }
+  return excitation;
+}
+
+// Adds the newest keyframe to the candidate window information and
+// excitation of each camera, which drops the keyframe that left the window.
+void UpdateWindowInformation()
+{
+  if (poses.empty()) {
+    return;
+  }
+  for (uint32_t cam_id = 0; cam_id < window_information.size(); ++cam_id) {
+    window_information[cam_id].Push(
+          online_calibs[cam_id]->GetFrameInformation(poses, poses.size() - 1));
+    observability_gates[cam_id].AddKeyframe(GetKeyframeExcitation(cam_id));
+  }
+}
+
+// Whether the motion over the candidate window ending at the newest
+// keyframe excites the parameters of any camera.
+bool IsCandidateWindowObservable()
+{
+  if (!observability_gating) {
+    return true;
+  }
+  sdtrack::ObservabilityGate::Options options;
+  options.min_rotation = min_window_rotation_deg * M_PI / 180.0;
+  options.min_parallax = min_window_parallax_deg * M_PI / 180.0;
+  options.min_coverage = min_window_coverage;
+  for (const sdtrack::ObservabilityGate& gate : observability_gates) {
+    if (gate.IsInformative(options)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether the candidate window ending at the newest keyframe is worth a
+// full solve. The score from the accumulated information is a lower bound
+// on the solved one, so a window is only skipped if it cannot enter any
+// queue. The IMU adds information the bound does not know of, so IMU
+// windows are always solved, as are windows that do not overlap the last
+// one solved, so that change detection still sees the whole trajectory.
+bool IsCandidateWindowInformative(bool use_imu)
+{
+  if (!incremental_window_scoring || use_imu ||
+      poses.size() >= last_posted_window_end + self_cal_segment_length) {
+    return true;
+  }
+  for (uint32_t cam_id = 0; cam_id < window_information.size(); ++cam_id) {
+    sdtrack::OnlineCalibrator& calib = *online_calibs[cam_id];
+    if (calib.CanEnterQueue(calib.GetInformationScore(
+                              window_information[cam_id].information()))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void DoCalibrationWindow(const sdtrack::BaScheduler::Job&)
+{
+  // Always the newest request: the ones posted while the previous window
+  // was solved are superseded without being started. A solve that has
+  // started runs to the end, as the adjuster cannot be interrupted, and its
+  // window is still a valid candidate.
+  std::shared_ptr<CalibrationRequest> request = std::atomic_exchange(
+        &calibration_request, std::shared_ptr<CalibrationRequest>());
+  if (!request || request->epoch != calibration_epoch) {
+    return;
+  }
+
+  for (uint32_t cam_id = 0; cam_id < window_calibs.size(); ++cam_id) {
+    window_calibs[cam_id]->SetBaDebugLevel(selfcal_ba_debug_level);
+    window_calibs[cam_id]->SetUseSparseMarginals(sparse_calibration_marginals);
+    window_rig.cameras_[cam_id]->SetParams(request->cam_params[cam_id]);
+    window_rig.cameras_[cam_id]->Pose() = request->t_wc[cam_id];
+  }
+
+  // The cameras are solved concurrently against the same snapshot. Each
+  // calibrator only writes its own ids into it, and its own camera.
+  std::shared_ptr<CalibrationResult> result(new CalibrationResult);
+  result->epoch = request->epoch;
+  result->windows.resize(window_calibs.size());
+  tbb::parallel_for(
+        tbb::blocked_range<int>(0, window_calibs.size(), 1),
+        [&](const tbb::blocked_range<int>& range) {
+    for (int cam_id = range.begin(); cam_id != range.end(); ++cam_id) {
+      if (request->use_imu) {
+        window_calibs[cam_id]->AnalyzeCalibrationWindow<true>(
+              request->poses, &request->tracks, request->start_pose,
+              request->end_pose, result->windows[cam_id], 50);
+      } else {
+        window_calibs[cam_id]->AnalyzeCalibrationWindow<false>(
+              request->poses, &request->tracks, request->start_pose,
+              request->end_pose, result->windows[cam_id], 50);
+      }
+    }
+  });
+
+  // The queue was cleared while solving.
+  if (result->epoch != calibration_epoch) {
+    return;
+  }
+  std::atomic_store(&calibration_result, result);
+}
+
+// Snapshots the batch mode window, from batch_start to the newest pose, and
+// hands it to the calibration worker. As with candidate windows, a request
+// that has not started yet is replaced.
+void PostBatchWindow(uint32_t batch_start, bool use_imu)
+{
+  if (!current_tracks) {
+    return;
+  }
+  std::atomic_store(&batch_request, SnapshotCalibrationWindow(
+                      batch_start, poses.size(), use_imu));
+  calib_scheduler.Post(sdtrack::BaScheduler::kCalibrationBatch, poses.size());
+}
+
+void DoCalibrationBatch(const sdtrack::BaScheduler::Job&)
+{
+  std::shared_ptr<CalibrationRequest> request = std::atomic_exchange(
+        &batch_request, std::shared_ptr<CalibrationRequest>());
+  if (!request || request->epoch != calibration_epoch) {
+    return;
+  }
+
+  window_calibs[0]->SetBaDebugLevel(selfcal_ba_debug_level);
+  window_calibs[0]->SetUseSparseMarginals(sparse_calibration_marginals);
+  for (uint32_t cam_id = 0; cam_id < window_calibs.size(); ++cam_id) {
+    window_rig.cameras_[cam_id]->SetParams(request->cam_params[cam_id]);
+    window_rig.cameras_[cam_id]->Pose() = request->t_wc[cam_id];
+  }
+
+  // Applying the results leaves the solved parameters and extrinsics in
+  // window_rig, and the solved poses in the snapshot.
+  std::shared_ptr<CalibrationResult> result(new CalibrationResult);
+  result->epoch = request->epoch;
+  result->windows.resize(1);
+  if (request->use_imu) {
+    window_calibs[0]->AnalyzeCalibrationWindow<true>(
+          request->poses, &request->tracks, request->start_pose,
+          request->end_pose, result->windows[0], 50, true);
+  } else {
+    window_calibs[0]->AnalyzeCalibrationWindow<false>(
+          request->poses, &request->tracks, request->start_pose,
+          request->end_pose, result->windows[0], 50, true);
+  }
+  result->t_wc = window_rig.cameras_[0]->Pose();
+
+  if (result->epoch != calibration_epoch) {
+    return;
+  }
+  std::atomic_store(&batch_result, result);
+}
+
+// Takes the batch mode window analyzed by the calibration worker since the
+// last call, if any, and leaves its parameters and extrinsics in camera 0.
+bool TakeBatchWindow(sdtrack::CalibrationWindow& window)
+{
+  std::shared_ptr<CalibrationResult> result = std::atomic_exchange(
+        &batch_result, std::shared_ptr<CalibrationResult>());
+  if (!result || result->epoch != calibration_epoch) {
+    return false;
+  }
+  window = result->windows[0];
+  if (window.mean.rows() != 0) {
+    std::lock_guard<std::mutex> lock(aac_mutex);
+    selfcal_rig.cameras_[0]->SetParams(window.mean);
+    selfcal_rig.cameras_[0]->Pose().so3() = result->t_wc.so3();
+  }
+  return true;
+}
+
+// Takes the windows, one per camera, analyzed by the calibration worker
+// since the last call, if any.
+bool TakeCalibrationWindows(std::vector<sdtrack::CalibrationWindow>& windows)
+{
+  std::shared_ptr<CalibrationResult> result = std::atomic_exchange(
+        &calibration_result, std::shared_ptr<CalibrationResult>());
+  if (!result || result->epoch != calibration_epoch) {
+    return false;
+  }
+  windows = result->windows;
+  return true;
+}
+
+// Saves the parameters and priority queue of every camera.
+void SaveCalibrationState()
+{
+  if (calibration_state_file.empty()) {
+    return;
+  }
+  sdtrack::CalibrationState state;
+  state.cameras.resize(online_calibs.size());
+  {
+    std::lock_guard<std::mutex> lock(aac_mutex);
+    for (uint32_t cam_id = 0; cam_id < online_calibs.size(); ++cam_id) {
+      state.cameras[cam_id].params = selfcal_rig.cameras_[cam_id]->GetParams();
+      state.cameras[cam_id].windows = online_calibs[cam_id]->windows();
+    }
+  }
+  if (!state.Save(calibration_state_file)) {
+    LOG(WARNING) << "Could not save the calibration to " <<
+                    calibration_state_file;
+  }
+}
+
+// Starts from the calibration saved by a previous run, if it matches the
+// rig, instead of from batch mode.
+bool LoadCalibrationState()
+{
+  std::vector<uint32_t> num_params;
+  for (uint32_t cam_id = 0; cam_id < rig.cameras_.size(); ++cam_id) {
+    num_params.push_back(rig.cameras_[cam_id]->NumParams());
+  }
+  sdtrack::CalibrationState state;
+  if (calibration_state_file.empty() ||
+      !state.Load(calibration_state_file, num_params)) {
+    return false;
+  }
+
+  for (uint32_t cam_id = 0; cam_id < rig.cameras_.size(); ++cam_id) {
+    const Eigen::VectorXd& params = state.cameras[cam_id].params;
+    rig.cameras_[cam_id]->SetParams(params);
+    selfcal_rig.cameras_[cam_id]->SetParams(params);
+    aac_rig.cameras_[cam_id]->SetParams(params);
+
+    sdtrack::OnlineCalibrator& calib = *online_calibs[cam_id];
+    calib.RestoreQueue(state.cameras[cam_id].windows);
+    sdtrack::CalibrationWindow queue_window;
+    if (calib.FusePriorityQueue(queue_window)) {
+      calib.SetPriorityQueueDistribution(queue_window.covariance,
+                                         queue_window.mean);
+      if (cam_id == 0) {
+        pq_window = queue_window;
+      }
+    }
+    std::cerr << "Restored camera " << cam_id << " with params " <<
+                 params.transpose() << " and " << calib.NumWindows() <<
+                 " windows" << std::endl;
+  }
+  unknown_cam_calibration = false;
+  verify_restored_calibration = true;
+  return true;
+}
+
+// Adds a candidate window of a camera other than camera 0 to its priority
+// queue, and applies the fused queue when it changes.
+void UpdateCameraQueue(uint32_t cam_id, sdtrack::CalibrationWindow& window)
+{
+  sdtrack::OnlineCalibrator& calib = *online_calibs[cam_id];
+  // The poses are not reliable while camera 0 is in batch mode.
+  if (unknown_cam_calibration || !calib.AnalyzeCalibrationWindow(window)) {
+    return;
+  }
+
+  sdtrack::CalibrationWindow queue_window;
+  if (!calib.FusePriorityQueue(queue_window, true)) {
+    return;
+  }
+  calib.SetPriorityQueueDistribution(queue_window.covariance,
+                                     queue_window.mean);
+  std::cerr << "Camera " << cam_id << " queue mean " <<
+               queue_window.mean.transpose() << std::endl;
+
+  {
+    std::lock_guard<std::mutex> lock(aac_mutex);
+    for (size_t ii = unknown_cam_calibration_start_pose;
+         ii < poses.size(); ++ii) {
+      for (std::shared_ptr<sdtrack::DenseTrack> track : poses[ii]->tracks) {
+        if (track->ref_cam_id == cam_id) {
+          track->ref_keypoint.ray =
+              rig.cameras_[cam_id]->Unproject(
+                track->ref_keypoint.center_px).normalized();
+        }
+      }
+    }
+  }
+  tracker.NotifyCalibrationChanged();
+  SaveCalibrationState();
 }
 
 void BaAndStartNewLandmarks()
@@ -516,63 +1026,65 @@ void BaAndStartNewLandmarks()
   const uint32_t batch_end = poses.size();
   if (do_self_cal && (unknown_cam_calibration || unknown_imu_calibration)
       && ((batch_end - batch_start) > self_cal_segment_length)) {
-    bool window_analyzed = false;
+    // The window is solved by the calibration worker, and its result is
+    // applied on a later keyframe. The solved poses are not copied back, as
+    // the BA below runs over the whole batch range anyway.
     if (imu_selfcal_active && poses.size() > min_poses_for_imu &&
         unknown_imu_calibration) {
-      online_calib.AnalyzeCalibrationWindow<true>(
-            poses, current_tracks, batch_start,
-            batch_end, pq_window, 50, true);
-      window_analyzed = true;
+      PostBatchWindow(batch_start, true);
     } else if(unknown_cam_calibration) {
-      online_calib.AnalyzeCalibrationWindow<false>(
-            poses, current_tracks, batch_start,
-            batch_end, pq_window, 50, true);
-      window_analyzed = true;
+      PostBatchWindow(batch_start, false);
     }
 
-    double score = window_analyzed ? online_calib.GetWindowScore(pq_window) : 0;
-
-    if (pq_window.covariance.fullPivLu().rank() ==
-        selfcal_rig.cameras_[0]->GetParams().rows() /*&& score < 1e7*/) {
-      std::cerr << "Setting new batch params: " << std::endl;
-      const Eigen::VectorXd new_params = selfcal_rig.cameras_[0]->GetParams();
-      rig.cameras_[0]->SetParams(new_params);
-      rig.cameras_[0] = selfcal_rig.cameras_[0];
-      {
-        std::unique_lock<std::mutex>(aac_mutex);
-        for (uint32_t ii = unknown_cam_calibration_start_pose ;
-             ii < poses.size() ; ++ii) {
-          poses[ii]->cam_params = new_params;
-          for (std::shared_ptr<sdtrack::DenseTrack> track: poses[ii]->tracks) {
-            if (track->external_id[0] == UINT_MAX) {
-              continue;
+    double score = 0;
+    if (TakeBatchWindow(pq_window)) {
+      score = online_calibs[0]->GetWindowScore(pq_window);
+      if (pq_window.is_full_rank && pq_window.covariance.rows() ==
+          selfcal_rig.cameras_[0]->GetParams().rows() /*&& score < 1e7*/) {
+        std::cerr << "Setting new batch params: " << std::endl;
+        const Eigen::VectorXd new_params =
+            selfcal_rig.cameras_[0]->GetParams();
+        rig.cameras_[0]->SetParams(new_params);
+        rig.cameras_[0] = selfcal_rig.cameras_[0];
+        {
+          std::lock_guard<std::mutex> lock(aac_mutex);
+          for (uint32_t ii = unknown_cam_calibration_start_pose ;
+               ii < poses.size() ; ++ii) {
+            poses[ii]->cam_params = new_params;
+            for (std::shared_ptr<sdtrack::DenseTrack> track :
+                 poses[ii]->tracks) {
+              if (track->external_id[0] == UINT_MAX ||
+                  track->ref_cam_id != 0) {
+                continue;
+              }
+              track->ref_keypoint.ray =
+                  rig.cameras_[0]->Unproject(
+                    track->ref_keypoint.center_px).normalized();
             }
-            // We also have to backproject this track again.
-            // tracker.BackProjectTrack(track);
-            track->ref_keypoint.ray =
-                rig.cameras_[0]->Unproject(
-                  track->ref_keypoint.center_px).normalized();
-            track->needs_backprojection = true;
           }
         }
       }
-    }
 
-    if (pq_window.mean.rows() != 0) {
-      current_window = pq_window;
-    }
+      // The estimate is left in the shared camera either way, so the
+      // patches of the live tracks have to be backprojected again.
+      tracker.NotifyCalibrationChanged();
 
-    // Write this to the batch file.
-    std::ofstream("batch.txt", std::ios_base::app) << keyframe_id << ", " <<
-      pq_window.covariance.diagonal().transpose().format(
-      sdtrack::kLongCsvFmt) << ", " << score << ", " <<
-      pq_window.mean.transpose().format(sdtrack::kLongCsvFmt) << std::endl;
+      if (pq_window.mean.rows() != 0) {
+        current_window = pq_window;
+      }
 
-    std::cerr << "Batch means are: " << pq_window.mean.transpose() <<
-                 std::endl;
-    std::cerr << "Batch sigmas are:\n" <<
-                 pq_window.covariance << std::endl;
-    std::cerr << "Batch score: " << score << std::endl;
+      // Write this to the batch file.
+      std::ofstream("batch.txt", std::ios_base::app) << keyframe_id << ", " <<
+        pq_window.covariance.diagonal().transpose().format(
+        sdtrack::kLongCsvFmt) << ", " << score << ", " <<
+        pq_window.mean.transpose().format(sdtrack::kLongCsvFmt) << std::endl;
+
+      std::cerr << "Batch means are: " << pq_window.mean.transpose() <<
+                   std::endl;
+      std::cerr << "Batch sigmas are:\n" <<
+                   pq_window.covariance << std::endl;
+      std::cerr << "Batch score: " << score << std::endl;
+    }
 
     // If the determinant is smaller than a heuristic, switch to self_cal.
     if ((score < 1e7 && score != 0 && !std::isnan(score) && !std::isinf(score)) ||
@@ -581,11 +1093,14 @@ void BaAndStartNewLandmarks()
                    std::endl;
       unknown_cam_calibration = false;
       unknown_imu_calibration = false;
+      // A batch window that has not started is no longer needed.
+      std::atomic_store(&batch_request, std::shared_ptr<CalibrationRequest>());
     }
   }
   batch_time = sdtrack::Toc(batch_time);
 
   if (do_bundle_adjustment) {
+    sdtrack::BaScheduler::Foreground foreground(ba_scheduler);
     ba_time = sdtrack::Tic();
     uint32_t ba_size = std::max(num_ba_poses, unknown_cam_calibration ?
                                   batch_end - batch_start : num_ba_poses);
@@ -601,30 +1116,49 @@ void BaAndStartNewLandmarks()
     }
     ba_time = sdtrack::Toc(ba_time);
 
-    if (do_self_cal && (batch_end - batch_start) >= self_cal_segment_length) {
+    UpdateWindowInformation();
+    // Windows the motion cannot constrain are dropped before anything is
+    // built for them.
+    if (do_self_cal && (batch_end - batch_start) >= self_cal_segment_length &&
+        IsCandidateWindowObservable() &&
+        IsCandidateWindowInformative(imu_selfcal_active)) {
+      PostCalibrationWindow(imu_selfcal_active);
+    }
+
+    // Candidate windows are analyzed in the background and enter the
+    // priority queue on the keyframe after they are done.
+    std::vector<sdtrack::CalibrationWindow> candidate_windows;
+    if (do_self_cal && TakeCalibrationWindows(candidate_windows)) {
       analyze_time = sdtrack::Tic();
-      uint32_t start_pose =
-          std::max(0, (int)poses.size() - (int)self_cal_segment_length);
-      uint32_t end_pose = poses.size();
-      if (imu_selfcal_active) {
-        online_calib.AnalyzeCalibrationWindow<true>(
-              poses, current_tracks, start_pose, end_pose,
-              candidate_window, 50);
-      } else {
-        online_calib.AnalyzeCalibrationWindow<false>(
-              poses, current_tracks, start_pose, end_pose,
-              candidate_window, 50);
+      for (uint32_t cam_id = 1; cam_id < candidate_windows.size(); ++cam_id) {
+        UpdateCameraQueue(cam_id, candidate_windows[cam_id]);
       }
-
-      online_calib.AnalyzeCalibrationWindow(candidate_window);
+      candidate_window = candidate_windows[0];
+      online_calibs[0]->AnalyzeCalibrationWindow(candidate_window);
       last_window_kl_divergence =
-          online_calib.ComputeYao1965(
+          online_calibs[0]->ComputeYao1965(
             pq_window, candidate_window);
 
       if (candidate_window.mean.rows() != 0) {
         current_window = candidate_window;
       }
 
+      // The first window of this run that constrains the calibration decides
+      // whether the restored one still holds, with the same test as change
+      // detection. If not, it is dropped and batch mode starts over.
+      if (verify_restored_calibration && candidate_window.is_full_rank) {
+        verify_restored_calibration = false;
+        if (last_window_kl_divergence < 0.2 &&
+            last_window_kl_divergence != 0) {
+          std::cerr << "Restored calibration is inconsistent, starting " <<
+                       "batch mode" << std::endl;
+          unknown_cam_calibration = true;
+          unknown_cam_calibration_start_pose = 0;
+          online_calibs[0]->ClearQueue();
+          calibration_epoch++;
+        }
+      }
+
       std::cerr << "KL divergence for last window: " <<
                    last_window_kl_divergence << " num change: " <<
                    num_change_detected << std::endl;
@@ -634,7 +1168,8 @@ void BaAndStartNewLandmarks()
       }
 
       if (last_window_kl_divergence < 0.2 && last_window_kl_divergence != 0 &&
-          (online_calib.NumWindows() == online_calib.queue_length()) &&
+          (online_calibs[0]->NumWindows() ==
+           online_calibs[0]->queue_length()) &&
           !unknown_cam_calibration) {
         num_change_detected++;
 
@@ -644,7 +1179,8 @@ void BaAndStartNewLandmarks()
           unknown_cam_calibration_start_pose = poses.size() - num_change_needed;
           std::cerr << "Unknown calibration = true with start pose " <<
                        unknown_cam_calibration_start_pose << std::endl;
-          online_calib.ClearQueue();
+          online_calibs[0]->ClearQueue();
+          calibration_epoch++;
         }
       } else {
         num_change_detected = 0;
@@ -652,44 +1188,52 @@ void BaAndStartNewLandmarks()
       analyze_time = sdtrack::Toc(analyze_time);
 
       // If the priority queue was modified, calculate the new results for it.
-      if (online_calib.needs_update() && !unknown_cam_calibration) {
+      if (online_calibs[0]->needs_update() && !unknown_cam_calibration) {
         queue_time = sdtrack::Toc(ba_time);
         last_added_window_kl_divergence = last_window_kl_divergence;
         const bool apply_results =
             !(unknown_cam_calibration || unknown_imu_calibration);
-        if (imu_selfcal_active) {
-          online_calib.AnalyzePriorityQueue<true>(
+        // Only solve the whole queue again if asked to, or if the cached
+        // window information does not constrain the calibration.
+        const bool queue_fused = !resolve_self_cal_queue &&
+            online_calibs[0]->FusePriorityQueue(pq_window, apply_results);
+        if (!queue_fused && imu_selfcal_active) {
+          online_calibs[0]->AnalyzePriorityQueue<true>(
                 poses, current_tracks, pq_window, 50, apply_results);
-        } else {
-          online_calib.AnalyzePriorityQueue<false>(
+        } else if (!queue_fused) {
+          online_calibs[0]->AnalyzePriorityQueue<false>(
                 poses, current_tracks, pq_window, 50, apply_results);
         }
         if (apply_results) {
-          std::unique_lock<std::mutex>(aac_mutex);
+          std::lock_guard<std::mutex> lock(aac_mutex);
           const Eigen::VectorXd new_params =
               selfcal_rig.cameras_[0]->GetParams();
           rig.cameras_[0]->SetParams(new_params);
           for (size_t ii = unknown_cam_calibration_start_pose;
                ii < poses.size(); ++ii) {
+            poses[ii]->cam_params = new_params;
             for (std::shared_ptr<sdtrack::DenseTrack> track : poses[ii]->tracks) {
-              poses[ii]->cam_params = new_params;
+              if (track->ref_cam_id != 0) {
+                continue;
+              }
               track->ref_keypoint.ray =
                   rig.cameras_[0]->Unproject(
                     track->ref_keypoint.center_px).normalized();
-              // tracker.BackProjectTrack(track);
-              track->needs_backprojection = true;
             }
           }
+          // Only the live tracks need their patches again, the tracker does
+          // them all at once before the next image.
+          tracker.NotifyCalibrationChanged();
         }
         std::cerr << "Analyzed priority queue with mean " <<
                      pq_window.mean.transpose() << " and cov\n " <<
                      pq_window.covariance << std::endl;
-        online_calib.SetPriorityQueueDistribution(pq_window.covariance,
+        online_calibs[0]->SetPriorityQueueDistribution(pq_window.covariance,
                                                   pq_window.mean);
 
 
         const double score =
-            online_calib.GetWindowScore(pq_window);
+            online_calibs[0]->GetWindowScore(pq_window);
 
         // Write this to the pq file.
         std::ofstream("pq.txt", std::ios_base::app) << keyframe_id << ", " <<
@@ -702,15 +1246,15 @@ void BaAndStartNewLandmarks()
           // Also analyze the full batch solution.
           sdtrack::CalibrationWindow batch_window;
           if (imu_selfcal_active) {
-            online_calib.AnalyzeCalibrationWindow<true>(
+            online_calibs[0]->AnalyzeCalibrationWindow<true>(
                   poses, current_tracks, 0, poses.size(), batch_window, 50);
           } else {
-            online_calib.AnalyzeCalibrationWindow<false>(
+            online_calibs[0]->AnalyzeCalibrationWindow<false>(
                   poses, current_tracks, 0, poses.size(), batch_window, 50);
           }
 
           const double batch_score =
-              online_calib.GetWindowScore(batch_window);
+              online_calibs[0]->GetWindowScore(batch_window);
 
           // Write this to the batch file.
           std::ofstream("batch.txt", std::ios_base::app) << keyframe_id << ", " <<
@@ -726,6 +1270,7 @@ void BaAndStartNewLandmarks()
           std::cerr << "Batch score: " << batch_score << std::endl;
         }
 
+        SaveCalibrationState();
         queue_time = sdtrack::Toc(queue_time);
       }
     }
@@ -746,9 +1291,9 @@ void BaAndStartNewLandmarks()
     snl_time = sdtrack::Toc(snl_time);
   }
 
-  std::cerr << "Timings batch: " << batch_time << " ba: " << ba_time <<
-               " analyze: " << analyze_time << " queue: " << queue_time <<
-               " snl: " << snl_time << std::endl;
+  SDTRACK_LOG(INFO) << "Timings batch: " << batch_time << " ba: " << ba_time <<
+      " analyze: " << analyze_time << " queue: " << queue_time <<
+      " snl: " << snl_time;
 
   std::ofstream("timings.txt", std::ios_base::app) << keyframe_id << ", " <<
     batch_time << ", " << ba_time << ", " << analyze_time << ", " <<
@@ -761,14 +1306,23 @@ void BaAndStartNewLandmarks()
   if (!do_bundle_adjustment) {
     tracker.TransformTrackTabs(tracker.t_ba());
   }
+
+  if (do_async_ba) {
+    ba_scheduler.Post(sdtrack::BaScheduler::kAdaptiveConditioning,
+                      poses.size());
+  }
 }
 
-void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
+void ProcessImage(
+    std::vector<std::shared_ptr<sdtrack::FrameBuffer>>& images, double timestamp)
 {
   bundle_adjuster.debug_level_threshold = ba_debug_level;
   vi_bundle_adjuster.debug_level_threshold = vi_ba_debug_level;
   aac_bundle_adjuster.debug_level_threshold = aac_ba_debug_level;
-  online_calib.SetBaDebugLevel(selfcal_ba_debug_level);
+  for (std::shared_ptr<sdtrack::OnlineCalibrator>& calib : online_calibs) {
+    calib->SetBaDebugLevel(selfcal_ba_debug_level);
+    calib->SetUseSparseMarginals(sparse_calibration_marginals);
+  }
 
 #ifdef CHECK_NANS
   _MM_SET_EXCEPTION_MASK(_MM_GET_EXCEPTION_MASK() &
@@ -799,6 +1353,8 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
   // Add a pose to the poses array
   if (is_prev_keyframe) {
     std::shared_ptr<sdtrack::TrackerPose> new_pose(new sdtrack::TrackerPose);
+    // Ids for the two adjusters, plus one per camera calibrator.
+    new_pose->opt_id.resize(2 + rig.cameras_.size());
     if (poses.size() > 0) {
       new_pose->t_wp = poses.back()->t_wp * last_t_ba.inverse();
       if (use_imu_measurements && has_imu) {
@@ -806,10 +1362,10 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
         new_pose->b = poses.back()->b;
       }
     } else {
-      if (has_imu && use_imu_measurements && imu_buffer.elements.size() > 0) {
-        Eigen::Vector3t down = -imu_buffer.elements.front().a.normalized();
-        std::cerr << "Down vector based on first imu meas: " <<
-                     down.transpose() << std::endl;
+      if (has_imu && use_imu_measurements && !imu_buffer.empty()) {
+        Eigen::Vector3t down = -imu_buffer.front().a.normalized();
+        SDTRACK_LOG(INFO) << "Down vector based on first imu meas: " <<
+            down.transpose();
 
         // compute path transformation
         Eigen::Vector3t forward(1.0, 0.0, 0.0);
@@ -831,7 +1387,7 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
     }
 
     {
-      std::unique_lock<std::mutex>(aac_mutex);
+      std::lock_guard<std::mutex> lock(aac_mutex);
       new_pose->cam_params = rig.cameras_[0]->GetParams();
       poses.push_back(new_pose);
     }
@@ -858,32 +1414,30 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
       use_imu_for_guess && poses.size() >= min_poses_for_imu) {
     std::shared_ptr<sdtrack::TrackerPose> pose1 = poses[poses.size() - 2];
     std::shared_ptr<sdtrack::TrackerPose> pose2 = poses.back();
-    std::vector<ba::ImuPoseT<Scalar>> imu_poses;
-    ba::PoseT<Scalar> start_pose;
-    start_pose.t_wp = pose1->t_wp;
-    start_pose.b = pose1->b;
-    start_pose.v_w = pose1->v_w;
-    start_pose.time = pose1->time;
-    // Integrate the measurements since the last frame.
-    std::vector<ba::ImuMeasurementT<Scalar> > meas =
-        imu_buffer.GetRange(pose1->time, pose2->time);
-    decltype(vi_bundle_adjuster)::ImuResidual::IntegrateResidual(
-          start_pose, meas, start_pose.b.head<3>(), start_pose.b.tail<3>(),
-          vi_bundle_adjuster.GetImuCalibration().g_vec, imu_poses);
-
-    if (imu_poses.size() > 1) {
-      ba::ImuPoseT<Scalar>& last_pose = imu_poses.back();
-      guess = last_pose.t_wp.inverse() *
-          imu_poses.front().t_wp;
-      pose2->t_wp = last_pose.t_wp;
-      pose2->v_w = last_pose.v_w;
+    // Integrate the measurements since the last frame, on top of those
+    // already integrated since the keyframe.
+    imu_preintegration.SetNoise(gyro_sigma, accel_sigma);
+    imu_preintegration.EraseBefore(pose1->time);
+    const sdtrack::ImuPreintegration preintegration =
+        imu_preintegration.Integrate(pose1->time, pose2->time, pose1->b,
+                                     imu_buffer);
+
+    if (preintegration.dt() > 0) {
+      Sophus::SE3t t_wp;
+      Eigen::Vector3t v_w;
+      preintegration.Predict(pose1->t_wp, pose1->v_w, pose1->b,
+                             vi_bundle_adjuster.GetImuCalibration().g_vec,
+                             t_wp, v_w);
+      guess = t_wp.inverse() * pose1->t_wp;
+      pose2->t_wp = t_wp;
+      pose2->v_w = v_w;
       poses.back()->t_wp = pose2->t_wp;
       poses.back()->v_w = pose2->v_w;
       poses.back()->b = pose2->b;
     }
   }
 
-  std::cerr << "Guess:\n " << guess.matrix() << std::endl;
+  SDTRACK_LOG(FRAME) << "Guess:\n " << guess.matrix();
 
   bool tracking_failed = false;
   {
@@ -900,7 +1454,7 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
 
     if ((tracker.num_successful_tracks() < 10) &&
         has_imu && use_imu_measurements) {
-      std::cerr << "Tracking failed. using guess." << std::endl;
+      SDTRACK_LOG(WARNING) << "Tracking failed. using guess.";
       tracking_failed = true;
       tracker.set_t_ba(guess);
     }
@@ -921,8 +1475,8 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
     bool keyframe_condition = track_ratio < 0.8 || total_trans > 0.2 ||
         total_rot > 0.1 /*|| tracker.num_successful_tracks() < 64*/;
 
-    std::cerr << "\tRatio: " << track_ratio << " trans: " << total_trans <<
-                 " rot: " << total_rot << std::endl;
+    SDTRACK_LOG(FRAME) << "\tRatio: " << track_ratio << " trans: " << total_trans <<
+        " rot: " << total_rot;
 
     {
       std::lock_guard<std::mutex> lock(aac_mutex);
@@ -947,8 +1501,8 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
     tracker.AddKeyframe();
   }
 
-  std::cerr << "Num successful : " << tracker.num_successful_tracks() <<
-               " keyframe tracks: " << keyframe_tracks << std::endl;
+  SDTRACK_LOG(FRAME) << "Num successful : " << tracker.num_successful_tracks() <<
+      " keyframe tracks: " << keyframe_tracks;
 
   if (!is_manual_mode) {
     BaAndStartNewLandmarks();
@@ -983,11 +1537,11 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
   }
 
   if (is_keyframe) {
-    std::cerr << "KEYFRAME." << std::endl;
+    SDTRACK_LOG(INFO) << "KEYFRAME.";
     keyframe_tracks = tracker.GetCurrentTracks().size();
-    std::cerr << "New keyframe tracks: " << keyframe_tracks << std::endl;
+    SDTRACK_LOG(INFO) << "New keyframe tracks: " << keyframe_tracks;
   } else {
-    std::cerr << "NOT KEYFRAME." << std::endl;
+    SDTRACK_LOG(FRAME) << "NOT KEYFRAME.";
   }
 
   current_tracks = &tracker.GetCurrentTracks();
@@ -998,8 +1552,8 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
                           _MM_MASK_DIV_ZERO));
 #endif
 
-  std::cerr << "FRAME : " << frame_count << " KEYFRAME: " << poses.size() <<
-               " FPS: " << frame_count / sdtrack::Toc(start_time) << std::endl;
+  SDTRACK_LOG(FRAME) << "FRAME : " << frame_count << " KEYFRAME: " << poses.size() <<
+      " FPS: " << frame_count / sdtrack::Toc(start_time);
 }
 
 void DrawImageData(uint32_t cam_id)
@@ -1074,9 +1628,11 @@ void Run()
       // timestamp
       if (has_imu && use_imu_measurements) {
         const double start_time = sdtrack::Tic();
-        while (imu_buffer.end_time < timestamp &&
+        DrainImu();
+        while (imu_buffer.end_time() < timestamp &&
                sdtrack::Toc(start_time) < 0.1) {
           usleep(10);
+          DrainImu();
         }
       }
 
@@ -1100,11 +1656,9 @@ void Run()
       gui_vars.handler->image_height = image_height;
       gui_vars.handler->image_width = image_width;
 
-      std::vector<cv::Mat> cvmat_images;
-      for (int ii = 0; ii < images->Size() ; ++ii) {
-        cvmat_images.push_back(images->at(ii)->Mat());
-      }
-      ProcessImage(cvmat_images, timestamp);
+      std::vector<std::shared_ptr<sdtrack::FrameBuffer>> frames =
+          BorrowFrames(images);
+      ProcessImage(frames, timestamp);
     }
 
     if (camera_img && camera_img->data()) {
@@ -1230,7 +1784,8 @@ void InitGui() {
     unknown_cam_calibration_start_pose = poses.size() - 2;
     std::cerr << "Unknown calibration = true with start pose " <<
                  unknown_cam_calibration_start_pose << std::endl;
-    online_calib.ClearQueue();
+    online_calibs[0]->ClearQueue();
+    calibration_epoch++;
   });
 
   pangolin::RegisterKeyPressCallback('b', [&]() {
@@ -1386,6 +1941,8 @@ bool LoadCameras(GetPot& cl)
     selfcal_rig.AddCamera(rig.cameras_[cam_id]);
     aac_rig.AddCamera(rig.cameras_[cam_id]);
   }
+  LoadRig(cl, camera_device.GetDeviceProperty(hal::DeviceDirectory),
+          window_rig);
 
   // Load the imu
   std::string imu_str = cl.follow("","-imu");
@@ -1449,8 +2006,9 @@ bool LoadCameras(GetPot& cl)
   if (has_imu && use_imu_measurements) {
     // Capture an image so we have some IMU data.
     std::shared_ptr<hal::ImageArray> images = hal::ImageArray::Create();
-    while (imu_buffer.elements.size() == 0) {
+    while (imu_buffer.empty()) {
       camera_device.Capture(*images);
+      DrainImu();
     }
   }
 
@@ -1508,22 +2066,37 @@ int main(int argc, char** argv) {
   tracker.Initialize(keypoint_options, tracker_options, &rig);
 
 
-  // Initialize the online calibration component.
-  Eigen::VectorXd weights(rig.cameras_[0]->NumParams());
-  if (weights.rows() > 4) {
-    weights << 1.0, 1.0, 1.7, 1.7, 320000;
-    //weights << 1.0, 1.0, 1.0, 1.0, 1.0;
-  } else {
-    weights << 1.0, 1.0, 1.7, 1.7;
-  }
+  // Initialize the online calibration component, one calibrator per camera.
+  for (uint32_t cam_id = 0; cam_id < rig.cameras_.size(); ++cam_id) {
+    Eigen::VectorXd weights(rig.cameras_[cam_id]->NumParams());
+    if (weights.rows() > 4) {
+      weights << 1.0, 1.0, 1.7, 1.7, 320000;
+      //weights << 1.0, 1.0, 1.0, 1.0, 1.0;
+    } else {
+      weights << 1.0, 1.0, 1.7, 1.7;
+    }
 
-  /// ZZZZZZZ : TEMPORARY FOR IMU
-  // weights = Eigen::VectorXd(6);
-  // weights << 1.0, 1.0, 1.0, 1.0, 1.0, 1.0;
+    /// ZZZZZZZ : TEMPORARY FOR IMU
+    // weights = Eigen::VectorXd(6);
+    // weights << 1.0, 1.0, 1.0, 1.0, 1.0, 1.0;
+
+    online_calibs.emplace_back(new sdtrack::OnlineCalibrator);
+    online_calibs.back()->Init(&aac_mutex, &selfcal_rig, num_self_cal_segments,
+                               self_cal_segment_length, weights,
+                               imu_time_offset, &imu_buffer, cam_id);
+    window_information.emplace_back(self_cal_segment_length);
+    observability_gates.emplace_back(self_cal_segment_length);
+    window_calibs.emplace_back(new sdtrack::OnlineCalibrator);
+    window_calibs.back()->Init(&window_calib_mutex, &window_rig,
+                               num_self_cal_segments, self_cal_segment_length,
+                               weights, imu_time_offset, &imu_buffer, cam_id);
+  }
 
-  online_calib.Init(&aac_mutex, &selfcal_rig, num_self_cal_segments,
-                    self_cal_segment_length, weights,
-                    imu_time_offset, &imu_buffer);
+  calibration_state_file = cl.follow("", "-calib_state");
+  if (LoadCalibrationState()) {
+    LOG(INFO) << "Starting from the calibration in " <<
+                 calibration_state_file;
+  }
 
   InitGui();
 
@@ -1531,9 +2104,25 @@ int main(int argc, char** argv) {
   /// ZZZZZZZZZZZZZZZZZZ: Get rid of this. Only valid for ICRA test rig
   imu_time_offset = -0.0697;
 
-  aac_thread = std::shared_ptr<std::thread>(new std::thread(&DoAAC));
+  ba_scheduler.SetTask(sdtrack::BaScheduler::kAdaptiveConditioning, &DoAAC);
+  ba_scheduler.Start();
+  calib_scheduler.SetTask(sdtrack::BaScheduler::kCalibrationBatch,
+                          &DoCalibrationBatch);
+  calib_scheduler.SetTask(sdtrack::BaScheduler::kCalibrationWindow,
+                          &DoCalibrationWindow);
+  calib_scheduler.Start();
+
+  const std::string trace_file = cl.follow("", "-trace");
+  sdtrack::TraceRecorder::Instance().set_enabled(!trace_file.empty());
 
   Run();
+  calib_scheduler.Stop();
+  ba_scheduler.Stop();
+  SaveCalibrationState();
+
+  if (!trace_file.empty()) {
+    sdtrack::TraceRecorder::Instance().WriteChromeTrace(trace_file);
+  }
 
   return 0;
 }
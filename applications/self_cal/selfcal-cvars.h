@@ -43,6 +43,10 @@ static bool& use_imu_measurements =
     CVarUtils::CreateCVar<>("sd.UseImu", false, "");
 static uint32_t& num_aac_poses =
     CVarUtils::CreateCVar<>("sd.NumAACPoses",20u, "");
+static uint32_t& num_ba_landmarks =
+    CVarUtils::CreateCVar<>("sd.NumBALandmarks", 0u, "");
+static uint32_t& num_aac_landmarks =
+    CVarUtils::CreateCVar<>("sd.NumAACLandmarks", 0u, "");
 static bool& do_keyframing =
     CVarUtils::CreateCVar<>("sd.DoKeyframing", true, "");
 static bool& do_adaptive =
@@ -71,4 +75,18 @@ static double& ncc_threshold =
     CVarUtils::CreateCVar<>("sd.NCCThreshold", 0.875, "");
 static bool& regularize_biases_in_batch =
     CVarUtils::CreateCVar<>("sd.RegularizeBiasesInBatch", false, "");
+static bool& resolve_self_cal_queue =
+    CVarUtils::CreateCVar<>("sd.ResolveSelfCalQueue", false, "");
+static bool& sparse_calibration_marginals =
+    CVarUtils::CreateCVar<>("sd.SparseCalibrationMarginals", true, "");
+static bool& incremental_window_scoring =
+    CVarUtils::CreateCVar<>("sd.IncrementalWindowScoring", true, "");
+static bool& observability_gating =
+    CVarUtils::CreateCVar<>("sd.ObservabilityGating", true, "");
+static double& min_window_rotation_deg =
+    CVarUtils::CreateCVar<>("sd.MinWindowRotationDeg", 3.0, "");
+static double& min_window_parallax_deg =
+    CVarUtils::CreateCVar<>("sd.MinWindowParallaxDeg", 0.5, "");
+static double& min_window_coverage =
+    CVarUtils::CreateCVar<>("sd.MinWindowCoverage", 0.25, "");
 
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <deque>
+#include <Eigen/Core>
+
+namespace sdtrack {
+///
+/// \brief Sum of the information of the last frames, kept up to date as a
+/// frame is added and the oldest one dropped. A window sliding one keyframe
+/// at a time can then be scored at the cost of the two frames that changed,
+/// instead of its whole length.
+///
+class SlidingInformation {
+public:
+  explicit SlidingInformation(uint32_t max_frames = 10)
+    : max_frames_(max_frames) {}
+
+  /// Adds the newest frame, dropping the oldest one beyond max_frames.
+  void Push(const Eigen::MatrixXd& information) {
+    if (sum_.rows() != information.rows()) {
+      frames_.clear();
+      sum_ = Eigen::MatrixXd::Zero(information.rows(), information.cols());
+    }
+    frames_.push_back(information);
+    sum_ += information;
+    if (frames_.size() > max_frames_) {
+      sum_ -= frames_.front();
+      frames_.pop_front();
+      // Subtracting lets rounding errors build up, so the sum is formed
+      // again once per window length.
+      if (++num_dropped_ % max_frames_ == 0) {
+        sum_.setZero();
+        for (const Eigen::MatrixXd& frame : frames_) {
+          sum_ += frame;
+        }
+      }
+    }
+  }
+
+  void Clear() {
+    frames_.clear();
+    sum_.resize(0, 0);
+  }
+
+  /// Information of the frames in the window.
+  const Eigen::MatrixXd& information() const { return sum_; }
+  uint32_t size() const { return frames_.size(); }
+
+private:
+  uint32_t max_frames_;
+  uint32_t num_dropped_ = 0;
+  std::deque<Eigen::MatrixXd> frames_;
+  Eigen::MatrixXd sum_;
+};
+}
@@ -0,0 +1,143 @@
+#include <random>
+#include <vector>
+#include <gtest/gtest.h>
+#include <Eigen/Dense>
+#include "calibration_marginals.h"
+
+namespace {
+const uint32_t kNumPoses = 6;
+const uint32_t kNumParams = 4;
+const uint32_t kNumLandmarks = 40;
+const uint32_t kNumObservations = 3;
+
+struct Observation {
+  int pose;
+  sdtrack::CalibrationMarginals::PoseJacobian dz_dref_pose;
+  sdtrack::CalibrationMarginals::PoseJacobian dz_dpose;
+  Eigen::Vector2d dz_drho;
+  Eigen::MatrixXd dz_dparams;
+};
+
+struct Landmark {
+  int ref_pose;
+  bool has_inverse_depth;
+  std::vector<Observation> observations;
+};
+
+// Random landmarks over pose variables 0 to num_observed_poses - 1 and the
+// fixed pose -1. The first landmark fixes the scale. Parameter columns in
+// unobservable_params get no jacobian.
+std::vector<Landmark> RandomWindow(uint32_t num_observed_poses,
+                                   const std::vector<int>& unobservable_params,
+                                   std::mt19937& rng) {
+  std::normal_distribution<double> normal;
+  std::uniform_int_distribution<int> pose(-1, num_observed_poses - 1);
+  auto random = [&](int rows, int cols) {
+    Eigen::MatrixXd m(rows, cols);
+    for (int ii = 0; ii < m.size(); ++ii) {
+      m(ii) = normal(rng);
+    }
+    return m;
+  };
+
+  std::vector<Landmark> landmarks(kNumLandmarks);
+  for (uint32_t ll = 0; ll < kNumLandmarks; ++ll) {
+    Landmark& landmark = landmarks[ll];
+    landmark.ref_pose = pose(rng);
+    landmark.has_inverse_depth = ll != 0;
+    while (landmark.observations.size() < kNumObservations) {
+      Observation obs;
+      obs.pose = pose(rng);
+      if (obs.pose == landmark.ref_pose) {
+        continue;
+      }
+      obs.dz_dref_pose = random(2, 6);
+      obs.dz_dpose = random(2, 6);
+      obs.dz_drho = random(2, 1);
+      obs.dz_dparams = random(2, kNumParams);
+      for (int param : unobservable_params) {
+        obs.dz_dparams.col(param).setZero();
+      }
+      landmark.observations.push_back(obs);
+    }
+  }
+  return landmarks;
+}
+
+bool ComputeMarginals(const std::vector<Landmark>& landmarks,
+                      Eigen::MatrixXd& covariance) {
+  sdtrack::CalibrationMarginals marginals(kNumPoses, kNumParams);
+  for (const Landmark& landmark : landmarks) {
+    marginals.BeginLandmark(landmark.ref_pose, landmark.has_inverse_depth);
+    for (const Observation& obs : landmark.observations) {
+      marginals.AddObservation(obs.pose, obs.dz_dref_pose, obs.dz_dpose,
+                               obs.dz_drho, obs.dz_dparams);
+    }
+    marginals.EndLandmark();
+  }
+  return marginals.Compute(covariance);
+}
+
+// The parameter block of the inverse of the full system, over the first
+// num_observed_poses poses, the parameters and the inverse depths.
+Eigen::MatrixXd DenseMarginals(const std::vector<Landmark>& landmarks,
+                               uint32_t num_observed_poses) {
+  const uint32_t params_col = 6 * num_observed_poses;
+  uint32_t num_cols = params_col + kNumParams;
+  for (const Landmark& landmark : landmarks) {
+    num_cols += landmark.has_inverse_depth;
+  }
+  Eigen::MatrixXd jacobian =
+      Eigen::MatrixXd::Zero(2 * kNumLandmarks * kNumObservations, num_cols);
+  uint32_t row = 0, rho_col = params_col + kNumParams;
+  for (const Landmark& landmark : landmarks) {
+    for (const Observation& obs : landmark.observations) {
+      if (landmark.ref_pose >= 0) {
+        jacobian.block(row, 6 * landmark.ref_pose, 2, 6) += obs.dz_dref_pose;
+      }
+      if (obs.pose >= 0) {
+        jacobian.block(row, 6 * obs.pose, 2, 6) += obs.dz_dpose;
+      }
+      jacobian.block(row, params_col, 2, kNumParams) = obs.dz_dparams;
+      if (landmark.has_inverse_depth) {
+        jacobian.block(row, rho_col, 2, 1) = obs.dz_drho;
+      }
+      row += 2;
+    }
+    rho_col += landmark.has_inverse_depth;
+  }
+  const Eigen::MatrixXd inverse =
+      (jacobian.transpose() * jacobian).inverse();
+  return inverse.block(params_col, params_col, kNumParams, kNumParams);
+}
+}
+
+TEST(CalibrationMarginals, MatchesDenseInverse) {
+  std::mt19937 rng(0);
+  for (int trial = 0; trial < 20; ++trial) {
+    const std::vector<Landmark> landmarks = RandomWindow(kNumPoses, {}, rng);
+    Eigen::MatrixXd covariance;
+    ASSERT_TRUE(ComputeMarginals(landmarks, covariance));
+    const Eigen::MatrixXd expected = DenseMarginals(landmarks, kNumPoses);
+    EXPECT_LT((covariance - expected).norm(), 1e-9 * expected.norm()) <<
+        "computed\n" << covariance << "\nexpected\n" << expected;
+  }
+}
+
+TEST(CalibrationMarginals, IgnoresUnobservedPoses) {
+  std::mt19937 rng(1);
+  // The last pose variable sees no landmark.
+  const std::vector<Landmark> landmarks =
+      RandomWindow(kNumPoses - 1, {}, rng);
+  Eigen::MatrixXd covariance;
+  ASSERT_TRUE(ComputeMarginals(landmarks, covariance));
+  const Eigen::MatrixXd expected = DenseMarginals(landmarks, kNumPoses - 1);
+  EXPECT_LT((covariance - expected).norm(), 1e-9 * expected.norm());
+}
+
+TEST(CalibrationMarginals, RejectsUnobservableParameters) {
+  std::mt19937 rng(2);
+  const std::vector<Landmark> landmarks = RandomWindow(kNumPoses, {2}, rng);
+  Eigen::MatrixXd covariance;
+  EXPECT_FALSE(ComputeMarginals(landmarks, covariance));
+}
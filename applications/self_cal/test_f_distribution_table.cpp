@@ -0,0 +1,103 @@
+#include <assert.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <gtest/gtest.h>
+#include <glog/logging.h>
+#include "chi2inv.h"
+#include "f_distribution_table.h"
+
+namespace {
+// What the table promises against compute_p_score.
+const double kTableTolerance = 1e-6;
+const uint32_t kMaxNu1 = 12;
+const double kMaxNu2 = 1e6;
+}
+
+TEST(FDistributionTable, MatchesComputePScore) {
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  for (uint32_t nu1 = 1; nu1 <= kMaxNu1; ++nu1) {
+    const sdtrack::FDistributionTable table(nu1);
+    ASSERT_EQ(nu1, table.nu1());
+    for (int ii = 0; ii < 20000; ++ii) {
+      const double nu2 = table.min_nu2() *
+          std::pow(kMaxNu2 / table.min_nu2(), uniform(rng));
+      // Uniform in sqrt(nu1 * f), the table's own axis, up to past its end.
+      const double f = std::pow(1.1 * uniform(rng), 2) * table.max_f();
+      EXPECT_NEAR(table.UpperTail(f, nu2), compute_p_score(f, nu1, nu2),
+                  kTableTolerance) << "nu1 " << nu1 << " nu2 " << nu2 <<
+                                      " f " << f;
+    }
+  }
+}
+
+TEST(FDistributionTable, TableEnds) {
+  for (uint32_t nu1 = 1; nu1 <= kMaxNu1; ++nu1) {
+    const sdtrack::FDistributionTable table(nu1);
+    const double max_f = table.max_f() * (1 - 1e-9);
+    for (double nu2 : {table.min_nu2(), table.min_nu2() * (1 + 1e-9),
+                       kMaxNu2}) {
+      EXPECT_NEAR(table.UpperTail(0, nu2), 1.0, kTableTolerance);
+      for (double f : {1e-12, 1e-6, 1.0, max_f}) {
+        EXPECT_NEAR(table.UpperTail(f, nu2), compute_p_score(f, nu1, nu2),
+                    kTableTolerance) << "nu1 " << nu1 << " nu2 " << nu2 <<
+                                        " f " << f;
+      }
+    }
+    // The first row is the chi-square limit.
+    for (double f : {0.0, 1e-6, 1.0, max_f}) {
+      EXPECT_NEAR(table.UpperTail(f, std::numeric_limits<double>::infinity()),
+                  sdtrack::ChiSquareUpperTail(nu1 * f, nu1), kTableTolerance);
+    }
+  }
+}
+
+TEST(FDistributionTable, FallsBackOffTheTable) {
+  for (uint32_t nu1 = 1; nu1 <= kMaxNu1; ++nu1) {
+    const sdtrack::FDistributionTable table(nu1);
+    const double below_min_nu2 = table.min_nu2() * (1 - 1e-9);
+    const double past_max_f = table.max_f() * (1 + 1e-9);
+    for (double f : {0.5, 1.0, 2.0}) {
+      for (double nu2 : {1.0, 10.0, below_min_nu2}) {
+        EXPECT_EQ(compute_p_score(f, nu1, nu2), table.UpperTail(f, nu2));
+      }
+    }
+    for (double nu2 : {table.min_nu2(), 1000.0, kMaxNu2}) {
+      for (double f : {past_max_f, 10 * past_max_f}) {
+        EXPECT_EQ(compute_p_score(f, nu1, nu2), table.UpperTail(f, nu2));
+      }
+    }
+  }
+}
+
+TEST(ChiSquareUpperTail, IsTheLimitOfTheFDistribution) {
+  for (uint32_t nu1 = 1; nu1 <= kMaxNu1; ++nu1) {
+    for (double f = 0.05; f < 5; f += 0.05) {
+      // Q goes as 1 / nu2 towards the limit, so that term is extrapolated
+      // away.
+      const double limit = 2 * compute_p_score(f, nu1, 2e6) -
+          compute_p_score(f, nu1, 1e6);
+      EXPECT_NEAR(sdtrack::ChiSquareUpperTail(nu1 * f, nu1), limit, 1e-7) <<
+          "nu1 " << nu1 << " f " << f;
+    }
+  }
+  for (double x = 0; x < 20; x += 0.5) {
+    EXPECT_NEAR(sdtrack::ChiSquareUpperTail(x, 1),
+                std::erfc(std::sqrt(x / 2)), 1e-15);
+    EXPECT_NEAR(sdtrack::ChiSquareUpperTail(x, 2), std::exp(-x / 2), 1e-15);
+  }
+}
+
+TEST(Chi2InvTable, MatchesChi2Inv) {
+  const unsigned int max_dim = 64;
+  Chi2InvTable table(max_dim);
+  // Changing P and back rebuilds the table.
+  for (double P : {0.0, 0.5, 0.95, 0.99, 0.999, 0.95, 0.0, 0.99}) {
+    for (unsigned int dim = 1; dim < 4 * max_dim; ++dim) {
+      EXPECT_EQ(chi2inv(P, dim), table(P, dim)) << "P " << P << " dim " <<
+                                                   dim;
+    }
+  }
+}
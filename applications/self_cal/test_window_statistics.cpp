@@ -0,0 +1,271 @@
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <gtest/gtest.h>
+#include <glog/logging.h>
+#include <Eigen/Dense>
+#include "online_calibrator.h"
+#include "ftest.h"
+
+// The window statistics work on the factorization cached by
+// SetWindowCovariance. These check them against the explicit inverses and
+// determinants they replaced.
+
+namespace {
+const int kNumParams = 5;
+const int kNumTrials = 50;
+// What the F distribution table promises against compute_p_score.
+const double kPScoreTolerance = 1e-6;
+
+class WindowStatisticsTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    // Scales like those of camera parameters, with weights that undo them.
+    scales_.resize(kNumParams);
+    scales_ << 300, 300, 100, 100, 0.05;
+    weights_ = scales_.cwiseInverse().cwiseAbs2();
+    calib_.Init(&mutex_, nullptr, 5, 10, weights_);
+  }
+
+  // Random covariance of the given rank.
+  Eigen::MatrixXd RandomCovariance(int rank) {
+    Eigen::MatrixXd a(kNumParams, rank);
+    for (int ii = 0; ii < a.size(); ++ii) {
+      a(ii) = normal_(rng_);
+    }
+    Eigen::MatrixXd covariance = a * a.transpose();
+    if (rank == kNumParams) {
+      covariance += 0.1 * Eigen::MatrixXd::Identity(kNumParams, kNumParams);
+    }
+    return scales_.asDiagonal() * covariance * scales_.asDiagonal();
+  }
+
+  sdtrack::CalibrationWindow RandomWindow(int rank = kNumParams) {
+    std::uniform_int_distribution<uint32_t> num_measurements(20, 500);
+    sdtrack::CalibrationWindow window;
+    window.mean.resize(kNumParams);
+    for (int ii = 0; ii < kNumParams; ++ii) {
+      window.mean[ii] = scales_[ii] * (1 + 0.1 * normal_(rng_));
+    }
+    window.num_measurements = num_measurements(rng_);
+    calib_.SetWindowCovariance(window, RandomCovariance(rank));
+    return window;
+  }
+
+  // Moves the mean of window1 away from that of window0 by a random multiple
+  // of the spread a test measures the difference against, so that its
+  // p-values are neither all 0 nor all 1.
+  void OffsetMean(const sdtrack::CalibrationWindow& window0,
+                  sdtrack::CalibrationWindow& window1,
+                  const Eigen::MatrixXd& spread) {
+    std::uniform_real_distribution<double> magnitude(0.2, 2);
+    Eigen::VectorXd z(kNumParams);
+    for (int ii = 0; ii < kNumParams; ++ii) {
+      z[ii] = normal_(rng_);
+    }
+    const Eigen::VectorXd offset = spread.llt().matrixL() * z;
+    window1.mean = window0.mean + magnitude(rng_) * offset;
+  }
+
+  // The weights as OnlineCalibrator applies them, on both sides.
+  Eigen::MatrixXd Weighted(const Eigen::MatrixXd& covariance) const {
+    const Eigen::VectorXd sqrt_weights = weights_.cwiseSqrt();
+    return sqrt_weights.asDiagonal() * covariance *
+        sqrt_weights.asDiagonal();
+  }
+
+  std::mt19937 rng_{0};
+  std::normal_distribution<double> normal_;
+  Eigen::VectorXd scales_;
+  Eigen::VectorXd weights_;
+  std::mutex mutex_;
+  sdtrack::OnlineCalibrator calib_;
+};
+
+Eigen::MatrixXd PooledCovariance(const sdtrack::CalibrationWindow& window0,
+                                 const sdtrack::CalibrationWindow& window1) {
+  const double n0 = window0.num_measurements;
+  const double n1 = window1.num_measurements;
+  return ((n0 - 1) * window0.covariance + n1 * window1.covariance) /
+      (n0 + n1 - 2) * (1.0 / n0 + 1.0 / n1);
+}
+
+void ExpectRelativeNear(double actual, double expected, double tolerance) {
+  EXPECT_NEAR(actual, expected, tolerance * std::max(1.0, std::abs(expected)));
+}
+
+bool IsFullRank(const Eigen::MatrixXd& covariance) {
+  return covariance.fullPivLu().rank() == covariance.rows();
+}
+
+double KlDivergence(const Eigen::MatrixXd& weighted_cov0,
+                    const Eigen::MatrixXd& weighted_cov1,
+                    const Eigen::VectorXd& weighted_mean0,
+                    const Eigen::VectorXd& weighted_mean1) {
+  const Eigen::VectorXd mean1_sub_mean0 = weighted_mean1 - weighted_mean0;
+  const Eigen::MatrixXd cov1_inv = weighted_cov1.inverse();
+  return (cov1_inv * weighted_cov0).trace() +
+      mean1_sub_mean0.dot(cov1_inv * mean1_sub_mean0) -
+      mean1_sub_mean0.rows() -
+      std::log(weighted_cov0.determinant() / weighted_cov1.determinant());
+}
+
+double HotellingScore(const sdtrack::CalibrationWindow& window0,
+                      const sdtrack::CalibrationWindow& window1) {
+  const double p = kNumParams;
+  const double n0 = window0.num_measurements;
+  const double n1 = window1.num_measurements;
+  const Eigen::MatrixXd cov_pooled =
+      ((n0 - 1) * window0.covariance + n1 * window1.covariance) /
+      (n0 + n1 - 2);
+  const Eigen::VectorXd mean_diff = window0.mean - window1.mean;
+  const double t_squared = mean_diff.dot(
+        (cov_pooled * (1.0 / n0 + 1.0 / n1)).inverse() * mean_diff);
+  const double f = (n0 + n1 - p - 1.0) / (p * (n0 + n1 - 2.0)) * t_squared;
+  return compute_p_score(f, p, n0 + n1 - p - 1);
+}
+
+double BhattacharyyaDistance(const sdtrack::CalibrationWindow& window0,
+                             const sdtrack::CalibrationWindow& window1) {
+  const double n0 = window0.num_measurements;
+  const double n1 = window1.num_measurements;
+  const Eigen::MatrixXd cov_pooled =
+      ((n0 - 1) * window0.covariance + n1 * window1.covariance) /
+      (n0 + n1 - 2);
+  const Eigen::VectorXd mean_diff = window0.mean - window1.mean;
+  return 1.0 / 8.0 * mean_diff.dot(cov_pooled.inverse() * mean_diff);
+}
+
+double Yao1965(const sdtrack::CalibrationWindow& window0,
+               const sdtrack::CalibrationWindow& window1) {
+  const double p = kNumParams;
+  const double n0 = window0.num_measurements;
+  const double n1 = window1.num_measurements;
+  const Eigen::MatrixXd& s0 = window0.covariance;
+  const Eigen::MatrixXd& s1 = window1.covariance;
+  if (!IsFullRank(s0) || !IsFullRank(s1)) {
+    return 1.0;
+  }
+  const Eigen::MatrixXd s_inv = (s0 + s1).inverse();
+  const Eigen::VectorXd xd = window0.mean - window1.mean;
+  const double t2 = xd.dot(s_inv * xd);
+  const double v = 1.0 /
+      ((1.0 / n0) * std::pow(xd.dot(s_inv * s0 * s_inv * xd) / t2, 2) +
+       (1.0 / n1) * std::pow(xd.dot(s_inv * s1 * s_inv * xd) / t2, 2));
+  const double f = t2 / ((v * p) / (v - p + 1));
+  return compute_p_score(f, p, v - p + 1);
+}
+
+double NelVanDerMerwe1986(const sdtrack::CalibrationWindow& window0,
+                          const sdtrack::CalibrationWindow& window1) {
+  const double p = kNumParams;
+  const double n0 = window0.num_measurements;
+  const double n1 = window1.num_measurements;
+  const Eigen::MatrixXd s0 = window0.covariance / (n0 * (n0 - 1.0));
+  const Eigen::MatrixXd s1 = window1.covariance / (n1 * (n1 - 1.0));
+  if (!IsFullRank(s0) || !IsFullRank(s1)) {
+    return 1.0;
+  }
+  const Eigen::MatrixXd s = s0 + s1;
+  const double v = ((s * s).trace() + std::pow(s.trace(), 2)) /
+      (1.0 / n0 * ((s0 * s0).trace() + std::pow(s0.trace(), 2)) +
+       1.0 / n1 * ((s1 * s1).trace() + std::pow(s1.trace(), 2)));
+  const Eigen::VectorXd xd = window0.mean - window1.mean;
+  const double t2 = xd.dot(s.inverse() * xd);
+  const double f = t2 / ((v * p) / (v - p + 1));
+  return compute_p_score(f, p, v - p + 1);
+}
+}
+
+TEST_F(WindowStatisticsTest, CachedFactorization) {
+  for (int trial = 0; trial < kNumTrials; ++trial) {
+    const sdtrack::CalibrationWindow window = RandomWindow();
+    ASSERT_TRUE(window.is_full_rank);
+    const Eigen::MatrixXd weighted = Weighted(window.covariance);
+    ExpectRelativeNear(window.weighted_log_det,
+                       std::log(weighted.determinant()), 1e-10);
+    ExpectRelativeNear(calib_.GetWindowScore(window), weighted.determinant(),
+                       1e-10);
+    const Eigen::MatrixXd inverse = window.covariance.inverse();
+    EXPECT_LT((window.information - inverse).norm(), 1e-9 * inverse.norm());
+  }
+}
+
+TEST_F(WindowStatisticsTest, KlDivergence) {
+  const Eigen::VectorXd sqrt_weights = weights_.cwiseSqrt();
+  for (int trial = 0; trial < kNumTrials; ++trial) {
+    const sdtrack::CalibrationWindow window0 = RandomWindow();
+    const sdtrack::CalibrationWindow window1 = RandomWindow();
+    ExpectRelativeNear(
+          calib_.ComputeKlDivergence(window0, window1),
+          KlDivergence(Weighted(window0.covariance),
+                       Weighted(window1.covariance),
+                       sqrt_weights.cwiseProduct(window0.mean),
+                       sqrt_weights.cwiseProduct(window1.mean)), 1e-8);
+  }
+}
+
+TEST_F(WindowStatisticsTest, HotellingAndBhattacharyya) {
+  for (int trial = 0; trial < kNumTrials; ++trial) {
+    const sdtrack::CalibrationWindow window0 = RandomWindow();
+    sdtrack::CalibrationWindow window1 = RandomWindow();
+    OffsetMean(window0, window1, PooledCovariance(window0, window1));
+    EXPECT_NEAR(calib_.ComputeHotellingScore(window0, window1),
+                HotellingScore(window0, window1), kPScoreTolerance);
+    ExpectRelativeNear(calib_.ComputeBhattacharyyaDistance(window0, window1),
+                       BhattacharyyaDistance(window0, window1), 1e-9);
+  }
+}
+
+TEST_F(WindowStatisticsTest, Yao1965) {
+  for (int trial = 0; trial < kNumTrials; ++trial) {
+    const sdtrack::CalibrationWindow window0 = RandomWindow();
+    sdtrack::CalibrationWindow window1 = RandomWindow();
+    OffsetMean(window0, window1, window0.covariance + window1.covariance);
+    EXPECT_NEAR(calib_.ComputeYao1965(window0, window1),
+                Yao1965(window0, window1), kPScoreTolerance);
+  }
+}
+
+TEST_F(WindowStatisticsTest, NelVanDerMerwe1986) {
+  for (int trial = 0; trial < kNumTrials; ++trial) {
+    const sdtrack::CalibrationWindow window0 = RandomWindow();
+    sdtrack::CalibrationWindow window1 = RandomWindow();
+    const double n0 = window0.num_measurements;
+    const double n1 = window1.num_measurements;
+    OffsetMean(window0, window1, window0.covariance / (n0 * (n0 - 1)) +
+               window1.covariance / (n1 * (n1 - 1)));
+    EXPECT_NEAR(calib_.ComputeNelVanDerMerwe1986(window0, window1),
+                NelVanDerMerwe1986(window0, window1), kPScoreTolerance);
+  }
+}
+
+TEST_F(WindowStatisticsTest, RankDeficientWindows) {
+  for (int trial = 0; trial < kNumTrials; ++trial) {
+    const sdtrack::CalibrationWindow full = RandomWindow();
+    const sdtrack::CalibrationWindow deficient = RandomWindow(kNumParams - 1);
+    ASSERT_FALSE(IsFullRank(deficient.covariance));
+    EXPECT_FALSE(deficient.is_full_rank);
+    EXPECT_EQ(0, deficient.weighted_log_det);
+    EXPECT_EQ(0, calib_.GetWindowScore(deficient));
+
+    // The information is the pseudo-inverse, i.e. nothing along the
+    // unobservable direction.
+    const Eigen::MatrixXd pseudo_inverse =
+        deficient.covariance.completeOrthogonalDecomposition()
+        .pseudoInverse();
+    EXPECT_LT((deficient.information - pseudo_inverse).norm(),
+              1e-6 * pseudo_inverse.norm());
+
+    // The rank tests give up on the pair, as before.
+    EXPECT_EQ(1.0, calib_.ComputeYao1965(full, deficient));
+    EXPECT_EQ(1.0, calib_.ComputeYao1965(deficient, full));
+    EXPECT_EQ(1.0, calib_.ComputeNelVanDerMerwe1986(full, deficient));
+    EXPECT_EQ(1.0, calib_.ComputeNelVanDerMerwe1986(deficient, full));
+    // The pooled covariance of the other tests is still invertible.
+    EXPECT_NEAR(calib_.ComputeHotellingScore(full, deficient),
+                HotellingScore(full, deficient), kPScoreTolerance);
+    ExpectRelativeNear(calib_.ComputeBhattacharyyaDistance(full, deficient),
+                       BhattacharyyaDistance(full, deficient), 1e-9);
+  }
+}
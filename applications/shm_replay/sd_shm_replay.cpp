@@ -0,0 +1,110 @@
+// Copyright (c) George Washington University, all rights reserved.  See the
+// accompanying LICENSE file for more information.
+//
+// Stand-in for an external capture process. Replays a logged dataset into the
+// shared-memory transport so that a tracker started with -shm can consume it
+// from a separate process.
+
+#include <glog/logging.h>
+#include "GetPot"
+#include <unistd.h>
+#include <HAL/Camera/CameraDevice.h>
+#include <HAL/IMU/IMUDevice.h>
+#include <HAL/Messages/Matrix.h>
+#include <sdtrack/TicToc.h>
+#include <sdtrack/shm_transport.h>
+
+std::string g_usage = "SD SHM REPLAY. Example usage:\n"
+    "-cam file:[loop=1]///Path/To/Dataset/[left,right]*pgm "
+    "-imu join:///path/to/imu -shm /sdtrack [-slots 4] [-realtime]";
+
+bool use_system_time = false;
+sdtrack::ShmFrameProducer producer;
+
+void ImuCallback(const hal::ImuMsg& ref) {
+  Eigen::VectorXd a, w;
+  hal::ReadVector(ref.accel(), &a);
+  hal::ReadVector(ref.gyro(), &w);
+  sdtrack::ShmImuSample sample;
+  sample.time = use_system_time ? ref.system_time() : ref.device_time();
+  for (int ii = 0; ii < 3; ++ii) {
+    sample.a[ii] = a[ii];
+    sample.w[ii] = w[ii];
+  }
+  producer.WriteImu(sample);
+}
+
+int main(int argc, char** argv) {
+  GetPot cl(argc, argv);
+  if (cl.search("--help")) {
+    LOG(INFO) << g_usage;
+    exit(-1);
+  }
+
+  if (cl.search("-use_system_time")) {
+    use_system_time = true;
+  }
+  const bool realtime = cl.search("-realtime");
+  const std::string shm_name = cl.follow("/sdtrack", "-shm");
+  const int num_slots = cl.follow(4, "-slots");
+
+  hal::Camera camera_device;
+  try {
+    camera_device = hal::Camera(hal::Uri(cl.follow("", "-cam")));
+  } catch (hal::DeviceException& e) {
+    LOG(FATAL) << "Error loading camera device: " << e.what();
+  }
+
+  std::shared_ptr<hal::ImageArray> images = hal::ImageArray::Create();
+  if (!camera_device.Capture(*images) || images->Size() == 0) {
+    LOG(FATAL) << "Could not capture the first frame.";
+  }
+  if (!producer.Create(shm_name, images->Size(), images->at(0)->Width(),
+                       images->at(0)->Height(), num_slots)) {
+    LOG(FATAL) << "Could not create shared memory " << shm_name;
+  }
+
+  // The IMU callback only starts once the producer exists.
+  hal::IMU imu_device;
+  std::string imu_str = cl.follow("", "-imu");
+  if (!imu_str.empty()) {
+    try {
+      imu_device = hal::IMU(imu_str);
+    } catch (hal::DeviceException& e) {
+      LOG(ERROR) << "Error loading imu device: " << e.what()
+                 << " ... proceeding without.";
+    }
+    imu_device.RegisterIMUDataCallback(&ImuCallback);
+  }
+
+  LOG(INFO) << "Replaying into " << shm_name;
+  uint32_t num_frames = 0;
+  double first_timestamp = -1, start_time = sdtrack::Tic();
+  do {
+    const double timestamp = use_system_time ? images->Ref().system_time() :
+                                               images->Ref().device_time();
+    if (realtime) {
+      if (first_timestamp < 0) {
+        first_timestamp = timestamp;
+      }
+      const double wait =
+          (timestamp - first_timestamp) - sdtrack::Toc(start_time);
+      if (wait > 0) {
+        usleep(wait * 1e6);
+      }
+    }
+
+    std::vector<cv::Mat> cvmat_images;
+    for (int ii = 0; ii < images->Size(); ++ii) {
+      cvmat_images.push_back(images->at(ii)->Mat());
+    }
+    // A file never drops frames, so wait for the consumer to free a slot.
+    while (!producer.WriteFrames(cvmat_images, timestamp)) {
+      usleep(1000);
+    }
+    num_frames++;
+  } while (camera_device.Capture(*images));
+
+  LOG(INFO) << "Replayed " << num_frames << " frames.";
+  return 0;
+}
@@ -15,10 +15,16 @@
 #include <SceneGraph/SceneGraph.h>
 #include <pangolin/pangolin.h>
 #include <ba/BundleAdjuster.h>
-#include <ba/InterpolationBuffer.h>
 #include <sdtrack/utils.h>
 #include "math_types.h"
 #include "gui_common.h"
+#include "ba_window.h"
+#include "imu_history.h"
+#include "imu_preintegration.h"
+#include "landmark_selector.h"
+#include "ba_scheduler.h"
+#include "spsc_ring.h"
+#include "pose_graph.h"
 #include "CVars/CVar.h"
 #include "chi2inv.h"
 #include "vitrack-cvars.h"
@@ -29,6 +35,9 @@
 
 #define POSES_TO_INIT 10
 #include <sdtrack/semi_dense_tracker.h>
+#include <sdtrack/trace.h>
+#include <sdtrack/diagnostics.h>
+#include <sdtrack/shm_transport.h>
 
 
 
@@ -41,7 +50,9 @@ const int window_width = 1024;
 const int window_height = 764;
 std::string g_usage = "SD VITRACKER. Example usage:\n"
     "-cam file:[loop=1]///Path/To/Dataset/[left,right]*pgm "
-    "-imu join:///path/to/imu -cmod cameras.xml";
+    "-imu join:///path/to/imu -cmod cameras.xml\n"
+    "or, to read from an sd_shm_replay process: "
+    "-shm /sdtrack -sdir /Path/To/Dataset -cmod cameras.xml";
 bool is_keyframe = true, is_prev_keyframe = true;
 bool include_new_landmarks = true;
 bool optimize_landmarks = true;
@@ -61,6 +72,7 @@ calibu::Rig<Scalar> old_rig;
 calibu::Rig<Scalar> rig;
 hal::Camera camera_device;
 hal::IMU imu_device;
+std::shared_ptr<sdtrack::ShmFrameConsumer> shm_consumer;
 
 sdtrack::SemiDenseTracker tracker;
 TrackerGuiVars gui_vars;
@@ -68,7 +80,7 @@ std::shared_ptr<GetPot> cl;
 
 std::list<std::shared_ptr<sdtrack::DenseTrack>>* current_tracks = nullptr;
 int last_optimization_level = 0;
-std::shared_ptr<hal::Image> camera_img;
+std::vector<std::shared_ptr<sdtrack::FrameBuffer>> camera_frames;
 std::vector<std::vector<std::shared_ptr<SceneGraph::ImageView>>> patches;
 std::vector<std::shared_ptr<sdtrack::TrackerPose>> poses;
 std::vector<std::unique_ptr<SceneGraph::GLAxis> > axes;
@@ -80,17 +92,23 @@ std::shared_ptr<std::thread> gps_thread;
 
 
 // Inertial stuff.
-std::mutex aac_mutex;
-std::shared_ptr<std::thread> aac_thread;
+sdtrack::BaScheduler ba_scheduler;
+sdtrack::PoseGraph pose_graph;
 ba::BundleAdjuster<double, 1, 6, 0> bundle_adjuster;
 ba::BundleAdjuster<double, 1, 15, 0> vi_bundle_adjuster;
 ba::BundleAdjuster<double, 1, 15, 0> aac_bundle_adjuster;
-ba::InterpolationBufferT<ba::ImuMeasurementT<Scalar>, Scalar> imu_buffer;
+// Filled by the IMU driver thread and drained by the tracking thread.
+sdtrack::SpscRing<ba::ImuMeasurementT<Scalar>> imu_ring(4096);
+sdtrack::ImuHistory<ba::ImuMeasurementT<Scalar>> imu_buffer;
+sdtrack::ImuPreintegrationCache<ba::ImuMeasurementT<Scalar>> imu_preintegration;
 std::vector<uint32_t> ba_imu_residual_ids, aac_imu_residual_ids;
 int orig_num_aac_poses = num_aac_poses;
 double prev_cond_error;
 int imu_cond_start_pose_id = -1;
 int imu_cond_residual_id = -1;
+// Window state of each adjuster, indexed like TrackerPose::opt_id.
+sdtrack::BaWindow<ba::ImuMeasurementT<Scalar>> ba_windows[3];
+sdtrack::LandmarkSelector landmark_selectors[3];
 
 // Plotters.
 std::vector<Eigen::VectorXd> plot_data;
@@ -108,25 +126,76 @@ void ImuCallback(const hal::ImuMsg& ref) {
   hal::ReadVector(ref.gyro(), &w);
   // std::cerr << "Added accel: " << a.transpose() << " and gyro " <<
   //             w.transpose() << " at time " << timestamp << std::endl;
-  imu_buffer.AddElement(ba::ImuMeasurementT<Scalar>(w, a, timestamp));
+  imu_ring.Push(ba::ImuMeasurementT<Scalar>(w, a, timestamp));
 }
 
+// Moves the measurements received by ImuCallback into imu_buffer.
+void DrainImu() {
+  imu_ring.Drain([](const ba::ImuMeasurementT<Scalar>& meas) {
+    imu_buffer.AddElement(meas);
+  });
+}
+
+// Equivalent of ImuCallback for samples published by an external capture
+// process through shared memory.
+void ReadShmImu() {
+  static std::vector<sdtrack::ShmImuSample> samples;
+  samples.clear();
+  shm_consumer->ReadImu(samples);
+  for (const sdtrack::ShmImuSample& sample : samples) {
+    const Eigen::Vector3t w(sample.w[0], sample.w[1], sample.w[2]);
+    const Eigen::Vector3t a(sample.a[0], sample.a[1], sample.a[2]);
+    imu_buffer.AddElement(ba::ImuMeasurementT<Scalar>(w, a, sample.time));
+  }
+}
+
+// Grabs the next set of frames, either from the camera device or from the
+// shared memory transport if one was given with -shm.
+bool CaptureFrames(const std::shared_ptr<hal::ImageArray>& images,
+                   std::vector<std::shared_ptr<sdtrack::FrameBuffer>>& frames,
+                   double& timestamp) {
+  if (shm_consumer) {
+    ReadShmImu();
+    return shm_consumer->ReadFrames(frames, timestamp);
+  }
+
+  if (!camera_device.Capture(*images)) {
+    return false;
+  }
+  timestamp = use_system_time ? images->Ref().system_time() :
+                                images->Ref().device_time();
+  frames = BorrowFrames(images);
+  return true;
+}
+
+///
+/// \brief Runs bundle adjustment on a window of ba_poses. The foreground BA
+/// passes the live poses and writes its results straight back. Background BA
+/// passes the poses of a snapshot and a result: the poses in the window are
+/// then replaced by private copies which receive the solution, and are handed
+/// to the result to be applied by the tracking thread.
+///
 template <typename BaType>
 void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
                         bool initialize_lm, bool do_adaptive_conditioning,
-                        uint32_t id, std::vector<uint32_t>& imu_residual_ids)
+                        uint32_t id, std::vector<uint32_t>& imu_residual_ids,
+                        sdtrack::PoseVector& ba_poses,
+                        uint32_t longest_track_id,
+                        sdtrack::PoseGraphResult* result = nullptr)
 {
+  SDTRACK_TRACE_SCOPE("DoBundleAdjustment");
   if (initialize_lm) {
     use_imu = false;
   }
 
-  if (reset_outliers) {
-    for (std::shared_ptr<sdtrack::TrackerPose> pose : poses) {
+  if (reset_outliers && result == nullptr) {
+    for (std::shared_ptr<sdtrack::TrackerPose> pose : ba_poses) {
       for (std::shared_ptr<sdtrack::DenseTrack> track: pose->tracks) {
         track->is_outlier = false;
       }
     }
     reset_outliers = false;
+    pose_graph.MarkDirty(0);
   }
 
   bundle_adjuster.debug_level_threshold = ba_debug_level;
@@ -146,7 +215,7 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
   options.use_robust_norm_for_proj_residuals =
       use_robust_norm_for_proj && !initialize_lm;
   options.projection_outlier_threshold = outlier_threshold;
-  options.regularize_biases_in_batch = poses.size() < POSES_TO_INIT ||
+  options.regularize_biases_in_batch = ba_poses.size() < POSES_TO_INIT ||
       regularize_biases_in_batch;
   options.calculate_inertial_covariance_once = calculate_covariance_once;
   uint32_t num_outliers = 0;
@@ -154,49 +223,75 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
   // Find the earliest pose touched by the current tracks.
   uint32_t start_active_pose, start_pose_id;
 
-  uint32_t end_pose_id;
-  {
-    std::lock_guard<std::mutex> lock(aac_mutex);
-    end_pose_id = poses.size() - 1;
+  uint32_t end_pose_id = ba_poses.size() - 1;
+  GetBaPoseRange(ba_poses, num_active_poses, start_pose_id, start_active_pose);
 
-    GetBaPoseRange(poses, num_active_poses, start_pose_id, start_active_pose);
+  if (start_pose_id == end_pose_id) {
+    return;
+  }
 
-    if (start_pose_id == end_pose_id) {
-      return;
-    }
+  // Add an extra pose to conditon the IMU
+  if (use_imu && use_imu_measurements && start_active_pose == start_pose_id &&
+      start_pose_id != 0) {
+    start_pose_id--;
+    std::cerr << "expanding sp from " << start_pose_id - 1 << " to " << start_pose_id << std::endl;
+  }
 
-    // Add an extra pose to conditon the IMU
-    if (use_imu && use_imu_measurements && start_active_pose == start_pose_id &&
-        start_pose_id != 0) {
-      start_pose_id--;
-      std::cerr << "expanding sp from " << start_pose_id - 1 << " to " << start_pose_id << std::endl;
+  // The snapshot is shared, so detach the window before anything is written
+  // to it.
+  if (result != nullptr) {
+    result->start_pose_id = start_pose_id;
+    result->end_pose_id = end_pose_id;
+    result->poses.clear();
+    for (uint32_t ii = start_pose_id ; ii <= end_pose_id ; ++ii) {
+      ba_poses[ii] = sdtrack::PoseGraph::CopyPose(*ba_poses[ii]);
+      result->poses.push_back(ba_poses[ii]);
     }
   }
 
   bool all_poses_active = start_active_pose == start_pose_id;
+  sdtrack::LandmarkSelector& selector = landmark_selectors[id];
 
 
   // Do a bundle adjustment on the current set
   if (current_tracks && end_pose_id) {
 
     if (!do_adaptive_conditioning) {
-      gui_vars.timer.Tic("ba_pre");
+      gui_vars.timer.Tic(kTimerBaPre);
     }
 
     {
-      std::lock_guard<std::mutex> lock(aac_mutex);
       if (use_imu) {
         ba.SetGravity(gravity_vector);
       }
-      ba.Init(options, end_pose_id + 1,
-              current_tracks->size() * (end_pose_id + 1));
+      sdtrack::BaWindow<ba::ImuMeasurementT<Scalar>>& window = ba_windows[id];
+      window.Slide(ba_poses, start_pose_id, end_pose_id);
+
+      // Pick the landmarks that go into the problem.
+      selector.Select(ba_poses, start_pose_id, end_pose_id, rig,
+                      id == 0 ? num_ba_landmarks : num_aac_landmarks,
+                      [&](uint32_t pose_id, const sdtrack::DenseTrack& track)
+                      -> sdtrack::LandmarkSelector::Candidacy {
+        const bool constrains_active =
+            track.keypoints.size() + pose_id >= start_active_pose;
+        if (track.num_good_tracked_frames <= 1 || track.is_outlier ||
+            !constrains_active) {
+          return sdtrack::LandmarkSelector::kExcluded;
+        }
+        // The longest track may be the landmark that fixes the gauge.
+        return track.id == longest_track_id ?
+              sdtrack::LandmarkSelector::kRequired :
+              sdtrack::LandmarkSelector::kCandidate;
+      });
+
+      ba.Init(options, window.num_poses(), selector.num_selected());
       for (uint32_t cam_id = 0; cam_id < rig.cameras_.size(); ++cam_id) {
         ba.AddCamera(rig.cameras_[cam_id]);
       }
 
       // First add all the poses and landmarks to ba.
       for (uint32_t ii = start_pose_id ; ii <= end_pose_id ; ++ii) {
-        std::shared_ptr<sdtrack::TrackerPose> pose = poses[ii];
+        std::shared_ptr<sdtrack::TrackerPose> pose = ba_poses[ii];
         const bool is_active = ii >= start_active_pose && !initialize_lm;
         pose->opt_id[id] = ba.AddPose(
               pose->t_wp, Eigen::VectorXt(), pose->v_w, pose->b,
@@ -206,20 +301,20 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
         }
 
         if (use_imu && ii >= start_active_pose && ii > 0) {
-          std::vector<ba::ImuMeasurementT<Scalar>> meas =
-              imu_buffer.GetRange(poses[ii - 1]->time, pose->time);
+          const std::vector<ba::ImuMeasurementT<Scalar>>& meas =
+              window.ImuMeasurements(ba_poses, ii, imu_buffer);
           /*std::cerr << "Adding imu residual between poses " << ii - 1 << " with "
                      " time " << poses[ii - 1]->time <<  " and " << ii <<
                      " with time " << pose->time << " with " << meas.size() <<
                      " measurements" << std::endl;
                      */
           imu_residual_ids.push_back(
-                ba.AddImuResidual(poses[ii - 1]->opt_id[id],
+                ba.AddImuResidual(ba_poses[ii - 1]->opt_id[id],
                 pose->opt_id[id], meas));
           // Store the conditioning edge of the IMU.
           if (do_adaptive_conditioning) {
             if (imu_cond_start_pose_id == -1 &&
-                !ba.GetPose(poses[ii - 1]->opt_id[id]).is_active &&
+                !ba.GetPose(ba_poses[ii - 1]->opt_id[id]).is_active &&
                 ba.GetPose(pose->opt_id[id]).is_active) {
               // std::cerr << "Setting cond pose id to " << ii - 1 << std::endl;
               imu_cond_start_pose_id = ii - 1;
@@ -236,17 +331,7 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
 
         if (!use_only_imu) {
           for (std::shared_ptr<sdtrack::DenseTrack> track: pose->tracks) {
-            const bool constrains_active =
-                track->keypoints.size() + ii >= start_active_pose;
-            if (track->num_good_tracked_frames <= 1 || track->is_outlier ||
-                !constrains_active) {
-              /*
-            std::cerr << "ignoring track " << track->id << " with " <<
-                         track->keypoints.size() << "keypoints with ngf " <<
-                         track->num_good_tracked_frames << " outlier: " <<
-                         track->is_outlier << " constraints " << constrains_active <<
-                         std::endl;
-                         */
+            if (!selector.IsSelected(*track)) {
               track->external_id[id] = UINT_MAX;
               continue;
             }
@@ -256,7 +341,7 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
             ray[3] = track->ref_keypoint.rho;
             ray = sdtrack::MultHomogeneous(
                   pose->t_wp * rig.cameras_[track->ref_cam_id]->Pose(), ray);
-            bool active = track->id != tracker.longest_track_id() ||
+            bool active = track->id != longest_track_id ||
                 !all_poses_active || use_imu || initialize_lm;
             if (!active) {
               std::cerr << "Landmark " << track->id << " inactive. outlier = " <<
@@ -272,7 +357,7 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
       if (!use_only_imu) {
         // Now add all reprojections to ba)
         for (uint32_t ii = start_pose_id ; ii <= end_pose_id ; ++ii) {
-          std::shared_ptr<sdtrack::TrackerPose> pose = poses[ii];
+          std::shared_ptr<sdtrack::TrackerPose> pose = ba_poses[ii];
           for (std::shared_ptr<sdtrack::DenseTrack> track : pose->tracks) {
             if (track->external_id[id] == UINT_MAX) {
               continue;
@@ -295,33 +380,35 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
     }
 
     if (!do_adaptive_conditioning) {
-      gui_vars.timer.Toc("ba_pre");
+      gui_vars.timer.Toc(kTimerBaPre);
     }
 
     // Optimize the poses
     if (!do_adaptive_conditioning) {
-      gui_vars.timer.Tic("ba_solve");
+      gui_vars.timer.Tic(kTimerBaSolve);
     }
 
     ba.Solve(num_ba_iterations);
 
     if (!do_adaptive_conditioning) {
-      gui_vars.timer.Toc("ba_solve");
+      gui_vars.timer.Toc(kTimerBaSolve);
     }
 
     if (!do_adaptive_conditioning) {
-      gui_vars.timer.Tic("ba_post");
+      gui_vars.timer.Tic(kTimerBaPost);
     }
 
     {
-      std::lock_guard<std::mutex> lock(aac_mutex);
-
+      // Relative transforms of the tracks are only updated in the foreground.
+      // Background results get theirs when they are applied, against the
+      // keyframe that is current by then.
+      const bool update_t_ba = result == nullptr && !initialize_lm;
       uint32_t last_pose_id =
-          is_keyframe ? poses.size() - 1 : poses.size() - 2;
+          is_keyframe ? ba_poses.size() - 1 : ba_poses.size() - 2;
       std::shared_ptr<sdtrack::TrackerPose> last_pose = is_keyframe ?
-            poses.back() : poses[poses.size() - 2];
+            ba_poses.back() : ba_poses[ba_poses.size() - 2];
 
-      if (last_pose_id <= end_pose_id) {
+      if (last_pose_id <= end_pose_id && result == nullptr) {
         // Get the pose of the last pose. This is used to calculate the relative
         // transform from the pose to the current pose.
         last_pose->t_wp = ba.GetPose(last_pose->opt_id[id]).t_wp;
@@ -331,7 +418,7 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
 
       // Read out the pose and landmark values.
       for (uint32_t ii = start_pose_id ; ii <= end_pose_id ; ++ii) {
-        std::shared_ptr<sdtrack::TrackerPose> pose = poses[ii];
+        std::shared_ptr<sdtrack::TrackerPose> pose = ba_poses[ii];
         const ba::PoseT<double>& ba_pose = ba.GetPose(pose->opt_id[id]);
 
         if (!initialize_lm) {
@@ -344,14 +431,20 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
 
         if (!use_only_imu) {
           // Here the last pose is actually t_wb and the current pose t_wa.
-          last_t_ba = t_ba;
-          t_ba = last_pose->t_wp.inverse() * pose->t_wp;
+          if (result == nullptr) {
+            last_t_ba = t_ba;
+            t_ba = last_pose->t_wp.inverse() * pose->t_wp;
+          }
           for (std::shared_ptr<sdtrack::DenseTrack> track: pose->tracks) {
             if (track->external_id[id] == UINT_MAX) {
+              // Landmarks left out by the budget still follow the poses.
+              if (selector.IsCandidate(*track) && update_t_ba) {
+                track->t_ba = t_ba;
+              }
               continue;
             }
 
-            if (!initialize_lm) {
+            if (update_t_ba) {
               track->t_ba = t_ba;
             }
 
@@ -360,7 +453,7 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
                 ba.GetLandmark(track->external_id[id]);
             double ratio = ba.LandmarkOutlierRatio(track->external_id[id]);
 
-            if (do_outlier_rejection && poses.size() > POSES_TO_INIT &&
+            if (do_outlier_rejection && ba_poses.size() > POSES_TO_INIT &&
                 !initialize_lm /*&& (do_adaptive_conditioning || !do_async_ba)*/) {
               if (ratio > 0.3 && track->tracked == false &&
                   (end_pose_id >= min_poses_for_imu - 1 || !use_imu)) {
@@ -400,13 +493,16 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
         }
       }
 
-      if (follow_camera) {
-        FollowCamera(gui_vars, poses.back()->t_wp);
+      if (result == nullptr) {
+        pose_graph.MarkDirty(start_pose_id);
+        if (follow_camera) {
+          FollowCamera(gui_vars, ba_poses.back()->t_wp);
+        }
       }
     }
 
     if (!do_adaptive_conditioning) {
-      gui_vars.timer.Toc("ba_post");
+      gui_vars.timer.Toc(kTimerBaPost);
     }
   }
   const ba::SolutionSummary<Scalar>& summary = ba.GetSolutionSummary();
@@ -431,11 +527,14 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
       prev_cond_error = DBL_MAX;
     }
 
+    // Called from the foreground and the conditioning threads, so each has
+    // its own table.
+    static thread_local Chi2InvTable chi2inv_table;
 //    const Scalar cond_chi2_dist = chi2inv(adaptive_threshold, cond_dims);
-    const Scalar cond_v_chi2_dist =
-        chi2inv(adaptive_threshold, summary.num_cond_proj_residuals * 2);
+    const Scalar cond_v_chi2_dist = chi2inv_table(
+          adaptive_threshold, summary.num_cond_proj_residuals * 2);
     const Scalar cond_i_chi2_dist =
-        chi2inv(adaptive_threshold, BaType::kPoseDim);
+        chi2inv_table(adaptive_threshold, BaType::kPoseDim);
 //    const Scalar active_chi2_dist = chi2inv(adaptive_threshold, active_dims);
     plot_logs[0].Log(cond_i_chi2_dist, cond_inertial_error);
     plot_logs[2].Log(cond_v_chi2_dist, summary.cond_proj_error);
@@ -500,9 +599,9 @@ void DoBundleAdjustment(BaType& ba, bool use_imu, uint32_t& num_active_poses,
       prev_cond_error = cond_total_error;
     }
     // }
-    plot_logs[1].Log(num_active_poses, poses.size());
+    plot_logs[1].Log(num_active_poses, ba_poses.size());
     Eigen::VectorXd data_to_save(6);
-    data_to_save << num_active_poses, poses.size(), cond_i_chi2_dist,
+    data_to_save << num_active_poses, ba_poses.size(), cond_i_chi2_dist,
         cond_inertial_error, cond_v_chi2_dist, summary.cond_proj_error;
 
     plot_data.push_back(data_to_save);
@@ -523,8 +622,11 @@ void UpdateCurrentPose()
     max_track_length = std::max(track->keypoints.size(), max_track_length);
   }
   new_pose->longest_track = max_track_length;
-  std::cerr << "Setting longest track for pose " << poses.size() << " to " <<
-               new_pose->longest_track << std::endl;
+  // Poses holding a track that is still being tracked have changed.
+  pose_graph.MarkDirty(poses.size() > max_track_length ?
+                         poses.size() - max_track_length : 0);
+  SDTRACK_LOG(FRAME) << "Setting longest track for pose " << poses.size() << " to " <<
+      new_pose->longest_track;
 }
 
 void DoGps()
@@ -532,63 +634,105 @@ void DoGps()
 
 }
 
-void DoAAC()
+void DoAAC(const sdtrack::BaScheduler::Job& job)
 {
+  std::shared_ptr<const sdtrack::PoseGraphSnapshot> snapshot =
+      pose_graph.snapshot();
+  if (!snapshot || snapshot->poses.size() <= 10 || !do_async_ba) {
+    return;
+  }
+  // Poses are detached from the snapshot as they are optimized, so every
+  // iteration starts from the result of the previous one.
+  sdtrack::PoseVector aac_poses = snapshot->poses;
+//  DoBundleAdjustment(bundle_adjuster, false, num_aac_poses, true, false,
+//                      1, aac_imu_residual_ids);
+  orig_num_aac_poses = num_aac_poses;
   while (true) {
-    if (poses.size() > 10 && do_async_ba) {
-//      DoBundleAdjustment(bundle_adjuster, false, num_aac_poses, true, false,
-//                          1, aac_imu_residual_ids);
-      //uint32_t num_poses = poses.size();
-      orig_num_aac_poses = num_aac_poses;
-      while (true) {
-        if (poses.size() > min_poses_for_imu && use_imu_measurements) {
-          DoBundleAdjustment(aac_bundle_adjuster, true, num_aac_poses,
-                             false, do_adaptive, 1, aac_imu_residual_ids);
-        }
+    if (aac_poses.size() > min_poses_for_imu && use_imu_measurements) {
+      std::shared_ptr<sdtrack::PoseGraphResult> result(
+            new sdtrack::PoseGraphResult);
+      result->version = snapshot->version;
+      result->epoch = snapshot->epoch;
+      DoBundleAdjustment(aac_bundle_adjuster, true, num_aac_poses,
+                         false, do_adaptive, 1, aac_imu_residual_ids,
+                         aac_poses, snapshot->longest_track_id, result.get());
+      pose_graph.PublishResult(result);
+    }
 
-        if ((int)num_aac_poses == orig_num_aac_poses || !do_adaptive) {
-          break;
-        }
-      }
+    if ((int)num_aac_poses == orig_num_aac_poses || !do_adaptive) {
+      break;
+    }
 
-      // std::cerr << "Resetting conditioning edge. " << std::endl;
-      imu_cond_start_pose_id = -1;
-      prev_cond_error = -1;
+    // A newer keyframe supersedes this window.
+    if (job.IsCancelled()) {
+      num_aac_poses = orig_num_aac_poses;
+      break;
+    }
+  }
+
+  // std::cerr << "Resetting conditioning edge. " << std::endl;
+  imu_cond_start_pose_id = -1;
+  prev_cond_error = -1;
+}
+
+void ApplyAacResults()
+{
+  std::shared_ptr<sdtrack::PoseGraphResult> result = pose_graph.TakeResult();
+  if (!result || !pose_graph.Apply(*result, 1, poses)) {
+    return;
+  }
+
+  // The tracks hold their transform to the last keyframe, which may have
+  // moved on since the snapshot was taken.
+  std::shared_ptr<sdtrack::TrackerPose> last_pose = is_keyframe ?
+        poses.back() : poses[poses.size() - 2];
+  Sophus::SE3d t_ba;
+  for (uint32_t ii = result->start_pose_id ; ii <= result->end_pose_id ;
+       ++ii) {
+    last_t_ba = t_ba;
+    t_ba = last_pose->t_wp.inverse() * poses[ii]->t_wp;
+    for (std::shared_ptr<sdtrack::DenseTrack>& track : poses[ii]->tracks) {
+      if (!track->is_outlier) {
+        track->t_ba = t_ba;
+      }
     }
-    usleep(1000);
   }
 }
 
 void DoBA()
 {
+  sdtrack::BaScheduler::Foreground foreground(ba_scheduler);
+  ApplyAacResults();
 //  DoBundleAdjustment(bundle_adjuster, false, num_ba_poses, true, false,
 //                     0, ba_imu_residual_ids);
   if (poses.size() > min_poses_for_imu && use_imu_measurements) {
     DoBundleAdjustment(vi_bundle_adjuster, true, num_ba_poses, false, false,
-                       0, ba_imu_residual_ids);
+                       0, ba_imu_residual_ids, poses,
+                       tracker.longest_track_id());
   } else {
     DoBundleAdjustment(bundle_adjuster, false, num_ba_poses,
-                       false, false, 0, ba_imu_residual_ids);
+                       false, false, 0, ba_imu_residual_ids, poses,
+                       tracker.longest_track_id());
   }
 }
 
 void BaAndStartNewLandmarks()
 {
-  gui_vars.timer.Tic("ba");
+  gui_vars.timer.Tic(kTimerBa);
   if (!is_keyframe) {
-    gui_vars.timer.Tic("snl");
-    gui_vars.timer.Toc("snl");
+    gui_vars.timer.Tic(kTimerSnl);
+    gui_vars.timer.Toc(kTimerSnl);
 
-    gui_vars.timer.Tic("ba_pre");
-    gui_vars.timer.Toc("ba_pre");
+    gui_vars.timer.Tic(kTimerBaPre);
+    gui_vars.timer.Toc(kTimerBaPre);
 
-    gui_vars.timer.Tic("ba_post");
-    gui_vars.timer.Toc("ba_post");
+    gui_vars.timer.Tic(kTimerBaPost);
+    gui_vars.timer.Toc(kTimerBaPost);
 
-    gui_vars.timer.Tic("ba_solve");
-    gui_vars.timer.Toc("ba_solve");
+    gui_vars.timer.Tic(kTimerBaSolve);
+    gui_vars.timer.Toc(kTimerBaSolve);
 
-    gui_vars.timer.Toc("ba");
+    gui_vars.timer.Toc(kTimerBa);
     return;
   }
   //uint32_t keyframe_id = poses.size();
@@ -598,13 +742,13 @@ void BaAndStartNewLandmarks()
     DoBA();
   }
   ba_time = sdtrack::Toc(ba_time);
-  gui_vars.timer.Toc("ba");
+  gui_vars.timer.Toc(kTimerBa);
 
-  gui_vars.timer.Tic("snl");
+  gui_vars.timer.Tic(kTimerSnl);
   if (do_start_new_landmarks) {
     tracker.StartNewLandmarks(0);
   }
-  gui_vars.timer.Toc("snl");
+  gui_vars.timer.Toc(kTimerSnl);
 
   std::shared_ptr<sdtrack::TrackerPose> new_pose = poses.back();
   // Update the tracks on this new pose.
@@ -614,14 +758,21 @@ void BaAndStartNewLandmarks()
     tracker.TransformTrackTabs(tracker.t_ba());
   }
 
+  if (do_async_ba) {
+    pose_graph.PublishSnapshot(poses, tracker.longest_track_id());
+    ba_scheduler.Post(sdtrack::BaScheduler::kAdaptiveConditioning,
+                      poses.size());
+  }
+
 
 
-  std::cerr << "Timings ba: " << ba_time << std::endl;
+  SDTRACK_LOG(INFO) << "Timings ba: " << ba_time;
 }
 
-void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
+void ProcessImage(
+    std::vector<std::shared_ptr<sdtrack::FrameBuffer>>& images, double timestamp)
 {
-  std::cerr << "Processing image with timestamp " << timestamp << std::endl;
+  SDTRACK_LOG(FRAME) << "Processing image with timestamp " << timestamp;
 #ifdef CHECK_NANS
   _MM_SET_EXCEPTION_MASK(_MM_GET_EXCEPTION_MASK() &
                          ~(_MM_MASK_INVALID | _MM_MASK_OVERFLOW |
@@ -633,6 +784,7 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
   }
 
   frame_count++;
+  ApplyAacResults();
   //  if (poses.size() > 100) {
   //    exit(EXIT_SUCCESS);
   //  }
@@ -655,10 +807,10 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
       new_pose->v_w = poses.back()->v_w;
       new_pose->b = poses.back()->b;
     } else {
-      if (imu_buffer.elements.size() > 0) {
-        Eigen::Vector3t down = -imu_buffer.elements.front().a.normalized();
-        std::cerr << "Down vector based on first imu meas: " <<
-                     down.transpose() << std::endl;
+      if (!imu_buffer.empty()) {
+        Eigen::Vector3t down = -imu_buffer.front().a.normalized();
+        SDTRACK_LOG(INFO) << "Down vector based on first imu meas: " <<
+            down.transpose();
 
         // compute path transformation
         Eigen::Vector3t forward(1.0, 0.0, 0.0);
@@ -690,10 +842,7 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
       //     -0.175229,  -0.0731785,    0.548693;
 
     }
-    {
-      std::unique_lock<std::mutex>(aac_mutex);
-      poses.push_back(new_pose);
-    }
+    poses.push_back(new_pose);
     axes.push_back(std::unique_ptr<SceneGraph::GLAxis>(
                       new SceneGraph::GLAxis(0.5)));
     gui_vars.scene_graph.AddChild(axes.back().get());
@@ -712,28 +861,24 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
       use_imu_for_guess && poses.size() >= min_poses_for_imu) {
     std::shared_ptr<sdtrack::TrackerPose> pose1 = poses[poses.size() - 2];
     std::shared_ptr<sdtrack::TrackerPose> pose2 = poses.back();
-    std::vector<ba::ImuPoseT<Scalar>> imu_poses;
-    ba::PoseT<Scalar> start_pose;
-    start_pose.t_wp = pose1->t_wp;
-    start_pose.b = pose1->b;
-    start_pose.v_w = pose1->v_w;
-    start_pose.time = pose1->time;
-    // Integrate the measurements since the last frame.
-    std::vector<ba::ImuMeasurementT<Scalar> > meas =
-        imu_buffer.GetRange(pose1->time, pose2->time);
-    decltype(vi_bundle_adjuster)::ImuResidual::IntegrateResidual(
-          start_pose, meas, start_pose.b.head<3>(), start_pose.b.tail<3>(),
-          vi_bundle_adjuster.GetImuCalibration().g_vec, imu_poses);
-
-    if (imu_poses.size() > 1) {
+    // Integrate the measurements since the last frame, on top of those
+    // already integrated since the keyframe.
+    imu_preintegration.SetNoise(gyro_sigma, accel_sigma);
+    imu_preintegration.EraseBefore(pose1->time);
+    const sdtrack::ImuPreintegration preintegration =
+        imu_preintegration.Integrate(pose1->time, pose2->time, pose1->b,
+                                     imu_buffer);
+
+    if (preintegration.dt() > 0) {
+      Sophus::SE3t t_wp;
+      Eigen::Vector3t v_w;
+      preintegration.Predict(pose1->t_wp, pose1->v_w, pose1->b,
+                             vi_bundle_adjuster.GetImuCalibration().g_vec,
+                             t_wp, v_w);
       // std::cerr << "Prev guess t_ab is\n" << guess.matrix3x4() << std::endl;
-      ba::ImuPoseT<Scalar>& last_pose = imu_poses.back();
-      //      guess.so3() = last_pose.t_wp.so3().inverse() *
-      //          imu_poses.front().t_wp.so3();
-      guess = last_pose.t_wp.inverse() *
-          imu_poses.front().t_wp;
-      pose2->t_wp = last_pose.t_wp;
-      pose2->v_w = last_pose.v_w;
+      guess = t_wp.inverse() * pose1->t_wp;
+      pose2->t_wp = t_wp;
+      pose2->v_w = v_w;
       poses.back()->t_wp = pose2->t_wp;
       poses.back()->v_w = pose2->v_w;
       poses.back()->b = pose2->b;
@@ -741,27 +886,23 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
     }
   }
 
-  gui_vars.timer.Tic("track");
-  {
-    std::lock_guard<std::mutex> lock(aac_mutex);
+  gui_vars.timer.Tic(kTimerTrack);
+  tracker.AddImage(images, guess);
+  gui_vars.timer.Tic(kTimerEvaluate);
+  tracker.EvaluateTrackResiduals(0, tracker.GetImagePyramid(),
+                                 tracker.GetCurrentTracks());
+  gui_vars.timer.Toc(kTimerEvaluate);
 
-    tracker.AddImage(images, guess);
-    gui_vars.timer.Tic("evaluate");
-    tracker.EvaluateTrackResiduals(0, tracker.GetImagePyramid(),
-                                   tracker.GetCurrentTracks());
-    gui_vars.timer.Toc("evaluate");
-
-    if (!is_manual_mode) {
-      tracker.OptimizeTracks(-1, optimize_landmarks, optimize_pose);
-      tracker.PruneTracks();
-    }
-    // Update the pose t_ab based on the result from the tracker.
-    UpdateCurrentPose();
-    if (follow_camera) {
-      FollowCamera(gui_vars, poses.back()->t_wp);
-    }
+  if (!is_manual_mode) {
+    tracker.OptimizeTracks(-1, optimize_landmarks, optimize_pose);
+    tracker.PruneTracks();
   }
-  gui_vars.timer.Toc("track");
+  // Update the pose t_ab based on the result from the tracker.
+  UpdateCurrentPose();
+  if (follow_camera) {
+    FollowCamera(gui_vars, poses.back()->t_wp);
+  }
+  gui_vars.timer.Toc(kTimerTrack);
 
   if (do_keyframing) {
     const double track_ratio = (double)tracker.num_successful_tracks() /
@@ -784,47 +925,43 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
         total_trans > 0.2 || total_rot > 0.1
         /*|| tracker.num_successful_tracks() < 64*/;
 
-    std::cerr << "\tRatio: " << track_ratio << " trans: " << total_trans <<
-                 "av: depth: " << average_depth << " rot: " <<
-                 total_rot << std::endl;
+    SDTRACK_LOG(FRAME) << "\tRatio: " << track_ratio << " trans: " << total_trans <<
+        "av: depth: " << average_depth << " rot: " <<
+        total_rot;
 
-    {
-      std::lock_guard<std::mutex> lock(aac_mutex);
-      if (keyframe_tracks != 0) {
-        if (keyframe_condition) {
-          is_keyframe = true;
-        } else {
-          is_keyframe = false;
-        }
+    if (keyframe_tracks != 0) {
+      if (keyframe_condition) {
+        is_keyframe = true;
+      } else {
+        is_keyframe = false;
+      }
 
 
-        // If this is a keyframe, set it as one on the tracker.
-        prev_delta_t_ba = tracker.t_ba() * prev_t_ba.inverse();
+      // If this is a keyframe, set it as one on the tracker.
+      prev_delta_t_ba = tracker.t_ba() * prev_t_ba.inverse();
 
-        if (is_keyframe) {
-          tracker.AddKeyframe();
-        }
-        is_prev_keyframe = is_keyframe;
+      if (is_keyframe) {
+        tracker.AddKeyframe();
       }
+      is_prev_keyframe = is_keyframe;
     }
   } else {
-    std::lock_guard<std::mutex> lock(aac_mutex);
     tracker.AddKeyframe();
   }
 
-  std::cerr << "Num successful : " << tracker.num_successful_tracks() <<
-               " keyframe tracks: " << keyframe_tracks << std::endl;
+  SDTRACK_LOG(FRAME) << "Num successful : " << tracker.num_successful_tracks() <<
+      " keyframe tracks: " << keyframe_tracks;
 
   if (!is_manual_mode) {
     BaAndStartNewLandmarks();
   }
 
   if (is_keyframe) {
-    std::cerr << "KEYFRAME." << std::endl;
+    SDTRACK_LOG(INFO) << "KEYFRAME.";
     keyframe_tracks = tracker.GetCurrentTracks().size();
-    std::cerr << "New keyframe tracks: " << keyframe_tracks << std::endl;
+    SDTRACK_LOG(INFO) << "New keyframe tracks: " << keyframe_tracks;
   } else {
-    std::cerr << "NOT KEYFRAME." << std::endl;
+    SDTRACK_LOG(FRAME) << "NOT KEYFRAME.";
   }
 
   current_tracks = &tracker.GetCurrentTracks();
@@ -835,8 +972,8 @@ void ProcessImage(std::vector<cv::Mat>& images, double timestamp)
                           _MM_MASK_DIV_ZERO));
 #endif
 
-  std::cerr << "FRAME : " << frame_count << " KEYFRAME: " << poses.size() <<
-               " FPS: " << frame_count / sdtrack::Toc(start_time) << std::endl;
+  SDTRACK_LOG(FRAME) << "FRAME : " << frame_count << " KEYFRAME: " << poses.size() <<
+      " FPS: " << frame_count / sdtrack::Toc(start_time);
 }
 
 void DrawImageData(uint32_t cam_id)
@@ -884,7 +1021,11 @@ void Run()
   // pangolin::Timer timer;
   bool capture_success = false;
   std::shared_ptr<hal::ImageArray> images = hal::ImageArray::Create();
-  camera_device.Capture(*images);
+  std::vector<std::shared_ptr<sdtrack::FrameBuffer>> frames;
+  double timestamp;
+  if (!shm_consumer) {
+    camera_device.Capture(*images);
+  }
 
   while(!pangolin::ShouldQuit()) {
     gui_vars.timer.Tic();
@@ -900,56 +1041,52 @@ void Run()
     glColor4f(1.0f,1.0f,1.0f,1.0f);
 
     if (go) {
-      capture_success = camera_device.Capture(*images);
+      capture_success = CaptureFrames(images, frames, timestamp);
     }
 
     if (capture_success) {
-      double timestamp = use_system_time ? images->Ref().system_time() :
-                                           images->Ref().device_time();
-
-
       // Wait until we have enough measurements to interpolate this frame's
       // timestamp
       const double start_time = sdtrack::Tic();
-      while (imu_buffer.end_time < timestamp &&
+      DrainImu();
+      while (imu_buffer.end_time() < timestamp &&
              sdtrack::Toc(start_time) < 0.1) {
         usleep(10);
+        if (shm_consumer) {
+          ReadShmImu();
+        }
+        DrainImu();
       }
 
-      gl_tex.resize(images->Size());
+      gl_tex.resize(frames.size());
 
-      for (uint32_t cam_id = 0 ; cam_id < (unsigned int) images->Size() ; ++cam_id) {
+      // The tracker only accepts 8-bit grayscale frames.
+      for (uint32_t cam_id = 0 ; cam_id < frames.size() ; ++cam_id) {
         if (!gl_tex[cam_id].tid) {
-          camera_img = images->at(cam_id);
-          GLint internal_format = (camera_img->Format() == GL_LUMINANCE ?
-                                     GL_LUMINANCE : GL_RGBA);
-          // Only initialise now we know format.
+          // Only initialise now we know the size.
           gl_tex[cam_id].Reinitialise(
-                camera_img->Width(), camera_img->Height(), internal_format,
-                false, 0, camera_img->Format(), camera_img->Type(), 0);
+                frames[cam_id]->width(), frames[cam_id]->height(),
+                GL_LUMINANCE, false, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, 0);
         }
       }
 
-      camera_img = images->at(0);
-      image_width = camera_img->Width();
-      image_height = camera_img->Height();
+      camera_frames = frames;
+      image_width = camera_frames[0]->width();
+      image_height = camera_frames[0]->height();
       gui_vars.handler->image_height = image_height;
       gui_vars.handler->image_width = image_width;
 
-      std::vector<cv::Mat> cvmat_images;
-      for (int ii = 0; (unsigned int) ii < (unsigned int) images->Size() ; ++ii) {
-        cvmat_images.push_back(images->at(ii)->Mat());
-      }
-      ProcessImage(cvmat_images, timestamp);
+      ProcessImage(frames, timestamp);
     }
 
-    if (camera_img && camera_img->data()) {
+    if (!camera_frames.empty()) {
       for (uint32_t cam_id = 0 ; cam_id < rig.cameras_.size() &&
-           cam_id < (unsigned int) images->Size(); ++cam_id) {
-        camera_img = images->at(cam_id);
+           cam_id < camera_frames.size(); ++cam_id) {
         gui_vars.camera_view[cam_id]->ActivateAndScissor();
-        gl_tex[cam_id].Upload(camera_img->data(), camera_img->Format(),
-                      camera_img->Type());
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, camera_frames[cam_id]->stride());
+        gl_tex[cam_id].Upload(camera_frames[cam_id]->data(), GL_LUMINANCE,
+                              GL_UNSIGNED_BYTE);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
         gl_tex[cam_id].RenderToViewportFlipY();
         DrawImageData(cam_id);
       }
@@ -1000,7 +1137,8 @@ void Run()
     gui_vars.timer.Toc();
     if (go) {
       gui_vars.timer_view.Update(20, gui_vars.timer.GetNames(3),
-                                 gui_vars.timer.GetTimes(3));
+                                 gui_vars.timer.GetTimes(3),
+                                 &gui_vars.timer.GetPercentileLabels(3));
     }
     pangolin::FinishFrame();
   }
@@ -1042,6 +1180,21 @@ void InitTracker()
 
 bool LoadCameras()
 {
+  // Frames (and IMU data) can also come from a separate capture process.
+  std::string shm_str = cl->follow("", "-shm");
+  if (!shm_str.empty()) {
+    shm_consumer.reset(new sdtrack::ShmFrameConsumer);
+    if (!shm_consumer->Open(shm_str)) {
+      LOG(FATAL) << "Could not attach to the capture process at " << shm_str;
+    }
+    LoadRig(*cl, "", rig);
+    while (imu_buffer.empty()) {
+      ReadShmImu();
+      usleep(1000);
+    }
+    return true;
+  }
+
   //LoadCameraAndRig(*cl, camera_device, old_rig);
   //rig.Clear();
   LoadCameraAndRig(*cl, camera_device, rig);
@@ -1059,12 +1212,13 @@ bool LoadCameras()
   }
   // Capture an image so we have some IMU data.
   std::shared_ptr<hal::ImageArray> images = hal::ImageArray::Create();
-  while (imu_buffer.elements.size() == 0) {
+  while (imu_buffer.empty()) {
     camera_device.Capture(*images);
+    DrainImu();
   }
 
   if (!use_system_time) {
-    imu_time_offset = imu_buffer.elements.back().time -
+    imu_time_offset = imu_buffer.back().time -
         images->Ref().device_time();
     std::cerr << "Setting initial time offset to " << imu_time_offset <<
                  std:: endl;
@@ -1093,15 +1247,17 @@ void InitGui()
   pangolin::RegisterKeyPressCallback(
         pangolin::PANGO_CTRL + 'r',
         [&]() {
-    camera_img.reset();
+    camera_frames.clear();
     is_keyframe = true;
     is_prev_keyframe = true;
     is_running = false;
     InitTracker();
     poses.clear();
+    pose_graph.Reset();
     ba_imu_residual_ids.clear();
     aac_imu_residual_ids.clear();
     imu_buffer.Clear();
+    imu_preintegration.Clear();
     gui_vars.scene_graph.Clear();
     gui_vars.scene_graph.AddChild(&gui_vars.grid);
     axes.clear();
@@ -1295,7 +1451,7 @@ int main(int argc, char** argv) {
   LoadCameras();
 
   // Set the initial gravity from the first bit of IMU data.
-  if (imu_buffer.elements.size() == 0) {
+  if (imu_buffer.empty()) {
     LOG(ERROR) << "No initial IMU measurements were found.";
   }
 
@@ -1311,11 +1467,20 @@ int main(int argc, char** argv) {
 
   InitGui();
 
-  aac_thread = std::shared_ptr<std::thread>(new std::thread(&DoAAC));
+  ba_scheduler.SetTask(sdtrack::BaScheduler::kAdaptiveConditioning, &DoAAC);
+  ba_scheduler.Start();
 
   gps_thread = std::shared_ptr<std::thread>(new std::thread(&DoGps));
 
+  const std::string trace_file = cl->follow("", "-trace");
+  sdtrack::TraceRecorder::Instance().set_enabled(!trace_file.empty());
+
   Run();
+  ba_scheduler.Stop();
+
+  if (!trace_file.empty()) {
+    sdtrack::TraceRecorder::Instance().WriteChromeTrace(trace_file);
+  }
 
   return 0;
 }
@@ -25,6 +25,10 @@ static uint32_t& num_ba_poses =
     CVarUtils::CreateCVar<>("sd.NumBAPoses",10u, "");
 static uint32_t& num_aac_poses =
     CVarUtils::CreateCVar<>("sd.NumAACPoses",20u, "");
+static uint32_t& num_ba_landmarks =
+    CVarUtils::CreateCVar<>("sd.NumBALandmarks", 0u, "");
+static uint32_t& num_aac_landmarks =
+    CVarUtils::CreateCVar<>("sd.NumAACLandmarks", 0u, "");
 static int& num_features =
     CVarUtils::CreateCVar<>("sd.NumFeatures",128, "");
 static int& feature_cells =
@@ -27,6 +27,8 @@
 #endif
 
 #include <sdtrack/semi_dense_tracker.h>
+#include <sdtrack/trace.h>
+#include <sdtrack/diagnostics.h>
 
 using namespace std;
 
@@ -73,6 +75,7 @@ Sophus::SE3d guess;
 
 void DoBundleAdjustment(uint32_t num_active_poses, uint32_t id)
 {
+  SDTRACK_TRACE_SCOPE("DoBundleAdjustment");
   if (reset_outliers) {
     for (std::shared_ptr<sdtrack::TrackerPose> pose : poses) {
       for (std::shared_ptr<sdtrack::DenseTrack> track: pose->tracks) {
@@ -264,10 +267,11 @@ void BaAndStartNewLandmarks()
     tracker.TransformTrackTabs(tracker.t_ba());
   }
 
-  std::cerr << "Timings ba: " << ba_time << std::endl;
+  SDTRACK_LOG(INFO) << "Timings ba: " << ba_time;
 }
 
-void ProcessImage(std::vector<cv::Mat>& images)
+void ProcessImage(
+    std::vector<std::shared_ptr<sdtrack::FrameBuffer>>& images)
 {
 #ifdef CHECK_NANS
   _MM_SET_EXCEPTION_MASK(_MM_GET_EXCEPTION_MASK() &
@@ -312,7 +316,7 @@ void ProcessImage(std::vector<cv::Mat>& images)
     guess.translation() = Eigen::Vector3d(0,0,0.001);
   }
 
-  std::cerr << "Guess: " << guess.matrix3x4() << std::endl;
+  SDTRACK_LOG(FRAME) << "Guess: " << guess.matrix3x4();
 
   tracker.AddImage(images, guess);
   tracker.EvaluateTrackResiduals(0, tracker.GetImagePyramid(),
@@ -327,7 +331,7 @@ void ProcessImage(std::vector<cv::Mat>& images)
   }
 
   if (tracker.num_successful_tracks() < 10) {
-    std::cerr << "Tracking failed. using guess." << std::endl;
+    SDTRACK_LOG(WARNING) << "Tracking failed. using guess.";
     tracker.set_t_ba(guess);
     poses.back()->tracks.clear();
   }
@@ -344,8 +348,8 @@ void ProcessImage(std::vector<cv::Mat>& images)
     bool keyframe_condition = track_ratio < 0.8 || total_trans > 0.2 ||
         total_rot > 0.1;
 
-    std::cerr << "\tRatio: " << track_ratio << " trans: " << total_trans <<
-                 " rot: " << total_rot << std::endl;
+    SDTRACK_LOG(FRAME) << "\tRatio: " << track_ratio << " trans: " << total_trans <<
+        " rot: " << total_rot;
 
     if (keyframe_tracks != 0) {
       if (keyframe_condition) {
@@ -366,19 +370,19 @@ void ProcessImage(std::vector<cv::Mat>& images)
     tracker.AddKeyframe();
   }
 
-  std::cerr << "Num successful : " << tracker.num_successful_tracks() <<
-               " keyframe tracks: " << keyframe_tracks << std::endl;
+  SDTRACK_LOG(FRAME) << "Num successful : " << tracker.num_successful_tracks() <<
+      " keyframe tracks: " << keyframe_tracks;
 
   if (!is_manual_mode) {
     BaAndStartNewLandmarks();
   }
 
   if (is_keyframe) {
-    std::cerr << "KEYFRAME." << std::endl;
+    SDTRACK_LOG(INFO) << "KEYFRAME.";
     keyframe_tracks = tracker.GetCurrentTracks().size();
-    std::cerr << "New keyframe tracks: " << keyframe_tracks << std::endl;
+    SDTRACK_LOG(INFO) << "New keyframe tracks: " << keyframe_tracks;
   } else {
-    std::cerr << "NOT KEYFRAME." << std::endl;
+    SDTRACK_LOG(FRAME) << "NOT KEYFRAME.";
   }
 
   current_tracks = &tracker.GetCurrentTracks();
@@ -389,8 +393,7 @@ void ProcessImage(std::vector<cv::Mat>& images)
                           _MM_MASK_DIV_ZERO));
 #endif
 
-  std::cerr << "FRAME : " << frame_count << " KEYFRAME: " << poses.size() <<
-               std::endl;
+  SDTRACK_LOG(FRAME) << "FRAME : " << frame_count << " KEYFRAME: " << poses.size();
 }
 
 void DrawImageData(uint32_t cam_id)
@@ -486,11 +489,9 @@ void Run()
       gui_vars.handler->image_height = image_height;
       gui_vars.handler->image_width = image_width;
 
-      std::vector<cv::Mat> cvmat_images;
-      for (int ii = 0; ii < images->Size() ; ++ii) {
-        cvmat_images.push_back(images->at(ii)->Mat());
-      }
-      ProcessImage(cvmat_images);
+      std::vector<std::shared_ptr<sdtrack::FrameBuffer>> frames =
+          BorrowFrames(images);
+      ProcessImage(frames);
     }
 
     if (camera_img && camera_img->data()) {
@@ -722,7 +723,14 @@ int main(int argc, char** argv) {
 
   bundle_adjuster.debug_level_threshold = -1;
 
+  const std::string trace_file = cl->follow("", "-trace");
+  sdtrack::TraceRecorder::Instance().set_enabled(!trace_file.empty());
+
   Run();
 
+  if (!trace_file.empty()) {
+    sdtrack::TraceRecorder::Instance().WriteChromeTrace(trace_file);
+  }
+
   return 0;
 }
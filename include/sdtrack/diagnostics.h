@@ -0,0 +1,120 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Verbosity levels of the tracker diagnostics. Anything above
+// SDTRACK_LOG_LEVEL is compiled out, including the formatting of its
+// arguments.
+#define SDTRACK_LOG_ERROR   0
+#define SDTRACK_LOG_WARNING 1
+#define SDTRACK_LOG_INFO    2  // At most once per keyframe.
+#define SDTRACK_LOG_FRAME   3  // Once per frame.
+#define SDTRACK_LOG_DEBUG   4  // Per camera, pyramid level or track.
+
+#ifndef SDTRACK_LOG_LEVEL
+#define SDTRACK_LOG_LEVEL SDTRACK_LOG_INFO
+#endif
+
+#define SDTRACK_LOG(level)                                              \
+  (SDTRACK_LOG_##level > SDTRACK_LOG_LEVEL) ? (void)0 :                 \
+  sdtrack::DiagnosticVoidify() &                                        \
+  sdtrack::DiagnosticMessage(SDTRACK_LOG_##level).stream()
+
+// Counts an event instead of printing it. Counters that changed are
+// reported by the sink at most once per report period.
+#define SDTRACK_COUNT(name)                                             \
+  do {                                                                  \
+    static sdtrack::DiagnosticCounter sdtrack_diagnostic_counter(name); \
+    sdtrack_diagnostic_counter.Increment();                             \
+  } while (0)
+
+namespace sdtrack {
+class DiagnosticCounter {
+public:
+  explicit DiagnosticCounter(const char* name);
+  ~DiagnosticCounter();
+
+  void Increment() {
+    count_.fetch_add(1, std::memory_order_relaxed);
+  }
+  uint64_t count() const {
+    return count_.load(std::memory_order_relaxed);
+  }
+  const char* name() const { return name_; }
+
+private:
+  friend class DiagnosticSink;
+  const char* name_;
+  std::atomic<uint64_t> count_;
+  uint64_t reported_count_ = 0;
+};
+
+///
+/// \brief Writes diagnostics to std::cerr from a background thread, so the
+/// calling thread only pays for formatting into its own buffer and a short
+/// queue push. Also periodically reports the event counters.
+///
+class DiagnosticSink {
+public:
+  static DiagnosticSink& Instance();
+  ~DiagnosticSink();
+
+  void Push(int level, std::string&& message);
+  void set_report_period(double seconds) { report_period_ = seconds; }
+  /// Blocks until everything queued so far has been written.
+  void Flush();
+
+  void Register(DiagnosticCounter* counter);
+  void Unregister(DiagnosticCounter* counter);
+
+private:
+  /// A counter that changed, copied so it can be written without the lock.
+  struct CounterReport {
+    const char* name;
+    uint64_t increment;
+    uint64_t count;
+  };
+
+  DiagnosticSink();
+  void Run();
+  void ReportCounter(DiagnosticCounter* counter,
+                     std::vector<CounterReport>& reports);
+  void ReportCounters(std::vector<CounterReport>& reports);
+  static void WriteCounterReports(const std::vector<CounterReport>& reports);
+
+  std::mutex mutex_;
+  std::condition_variable queue_cond_;
+  std::condition_variable flushed_cond_;
+  std::deque<std::pair<int, std::string>> queue_;
+  std::vector<DiagnosticCounter*> counters_;
+  double report_period_ = 5.0;
+  bool is_writing_ = false;
+  bool quit_ = false;
+  std::thread thread_;
+};
+
+class DiagnosticMessage {
+public:
+  explicit DiagnosticMessage(int level) : level_(level) {}
+  ~DiagnosticMessage() {
+    DiagnosticSink::Instance().Push(level_, stream_.str());
+  }
+  std::ostream& stream() { return stream_; }
+
+private:
+  int level_;
+  std::ostringstream stream_;
+};
+
+// Lets SDTRACK_LOG be used as an expression in both branches of ?:.
+struct DiagnosticVoidify {
+  void operator&(std::ostream&) {}
+};
+}
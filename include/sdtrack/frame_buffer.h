@@ -0,0 +1,94 @@
+#pragma once
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace sdtrack {
+///
+/// \brief An 8-bit grayscale image whose pixels are owned by someone else.
+/// The tracker only ever wraps the borrowed memory in a cv::Mat header, so no
+/// pixel data is copied on ingestion. The buffer is reference counted through
+/// std::shared_ptr; when the last reference goes away the release callback is
+/// invoked so that the producer can recycle or free the memory.
+///
+class FrameBuffer : public std::enable_shared_from_this<FrameBuffer> {
+public:
+  typedef std::function<void(unsigned char* data)> ReleaseCallback;
+
+  ///
+  /// \brief Borrow
+  /// \param data Pointer to the top-left pixel.
+  /// \param width Width of the image in pixels.
+  /// \param height Height of the image in pixels.
+  /// \param stride Number of bytes between consecutive rows. 0 means width.
+  /// \param release Called with data once the buffer is no longer in use.
+  ///
+  static std::shared_ptr<FrameBuffer> Borrow(unsigned char* data,
+                                             uint32_t width,
+                                             uint32_t height,
+                                             size_t stride = 0,
+                                             ReleaseCallback release =
+                                                 ReleaseCallback());
+
+  /// Borrows the memory of an existing image. The buffer holds a reference on
+  /// the image storage (if it is refcounted) until it is released.
+  static std::shared_ptr<FrameBuffer> Borrow(const cv::Mat& image,
+                                             ReleaseCallback release =
+                                                 ReleaseCallback());
+
+  ~FrameBuffer();
+
+  /// Returns a buffer covering a sub-region of this one. The pixels are
+  /// shared, and the parent is kept alive for as long as the view is.
+  std::shared_ptr<FrameBuffer> Roi(const cv::Rect& roi);
+
+  /// Header over the borrowed pixels. The pixels are never copied.
+  const cv::Mat& mat() const { return mat_; }
+  unsigned char* data() const { return mat_.data; }
+  uint32_t width() const { return mat_.cols; }
+  uint32_t height() const { return mat_.rows; }
+  size_t stride() const { return mat_.step; }
+
+private:
+  FrameBuffer(const cv::Mat& mat, ReleaseCallback release,
+              std::shared_ptr<FrameBuffer> parent);
+
+  cv::Mat mat_;
+  ReleaseCallback release_;
+  std::shared_ptr<FrameBuffer> parent_;
+};
+
+///
+/// \brief A fixed set of preallocated frame buffers that are handed out to a
+/// producer and returned to the pool when the tracker lets go of them. The
+/// pool storage outlives the pool object itself if buffers are still in
+/// flight, so it is safe to destroy the pool at any time.
+///
+class FrameBufferPool {
+public:
+  FrameBufferPool(uint32_t width, uint32_t height, uint32_t capacity,
+                  size_t stride = 0);
+
+  /// Returns a free buffer, or nullptr if all of them are in use.
+  std::shared_ptr<FrameBuffer> Acquire();
+
+  uint32_t capacity() const { return capacity_; }
+  uint32_t num_free() const;
+
+private:
+  struct Storage {
+    std::mutex mutex;
+    std::vector<unsigned char> memory;
+    std::vector<unsigned char*> free_buffers;
+  };
+
+  uint32_t width_;
+  uint32_t height_;
+  size_t stride_;
+  uint32_t capacity_;
+  std::shared_ptr<Storage> storage_;
+};
+}
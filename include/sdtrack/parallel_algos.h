@@ -78,4 +78,15 @@ namespace sdtrack {
 
     void operator() (const tbb::blocked_range<int>& r) const;
   };
+
+  class ParallelBackProject {
+  public:
+    SemiDenseTracker& tracker;
+    std::vector<std::shared_ptr<DenseTrack>>& tracks;
+
+    ParallelBackProject(SemiDenseTracker& tracker_ref,
+                        std::vector<std::shared_ptr<DenseTrack>>& tracks_v);
+
+    void operator() (const tbb::blocked_range<int>& r) const;
+  };
 }
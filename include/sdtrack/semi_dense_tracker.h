@@ -10,6 +10,7 @@
 #include "TicToc.h"
 #include <calibu/cam/camera_rig.h>
 #include "FeatureMask.h"
+#include "frame_buffer.h"
 //#include <Utils/Utils.h>
 #include <fstream>
 #include <calibu/cam/camera_crtp.h>
@@ -27,6 +28,7 @@ class SemiDenseTracker {
   friend class OptimizeTrack;
   friend class ParallelExtractKeypoints;
   friend class Parallel2dAlignment;
+  friend class ParallelBackProject;
 public:
   static const int kUnusedCell = -1;
 
@@ -64,6 +66,11 @@ public:
 
   void AddImage(const std::vector<cv::Mat>& images,
                 const Sophus::SE3t& t_ab_guess);
+  /// Zero-copy ingestion. Level 0 of the pyramid is a header over the
+  /// borrowed pixels, and the frames are held until the next image is added,
+  /// at which point they are released back to the producer.
+  void AddImage(const std::vector<std::shared_ptr<FrameBuffer>>& frames,
+                const Sophus::SE3t& t_ab_guess);
   void AddKeyframe() {
     last_image_was_keyframe_ = true;
   }
@@ -94,6 +101,22 @@ public:
   void BackProjectTrack(std::shared_ptr<DenseTrack> track,
                         bool initialize_pixel_vals = false);
 
+  ///
+  /// \brief Called when the intrinsics of the rig change. Tracks that were
+  /// backprojected with older intrinsics are backprojected again, as one
+  /// parallel pass over the live tracks, before the next image is tracked.
+  ///
+  void NotifyCalibrationChanged() {
+    calibration_epoch_++;
+  }
+  uint32_t calibration_epoch() {
+    return calibration_epoch_;
+  }
+  /// Backprojects the live tracks that are out of date, in parallel. Done at
+  /// the start of AddImage, but may be called earlier to take it off the
+  /// critical path.
+  void BackProjectStaleTracks();
+
   void Do2dAlignment(const AlignmentOptions &options,
                      const std::vector<std::vector<cv::Mat>>& image_pyrmaid,
                      std::list<std::shared_ptr<DenseTrack>>& tracks,
@@ -153,11 +176,13 @@ private:
   std::vector<std::vector<std::vector<double>>> pyramid_patch_interp_factors_;
   std::vector<Eigen::Vector2t> pyramid_coord_ratio_;
   std::vector<std::vector<cv::Mat>> image_pyramid_;
+  std::vector<std::shared_ptr<FrameBuffer>> frame_buffers_;
   std::vector<double> pyramid_error_thresholds_;
   std::vector<Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic>>
     feature_cells_;
   std::vector<uint32_t> active_feature_cells_;
   calibu::Rig<Scalar>* camera_rig_;
+  uint32_t calibration_epoch_ = 0;
   Eigen::Matrix4d generators_[6];
   std::default_random_engine generator_;
 
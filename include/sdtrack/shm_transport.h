@@ -0,0 +1,134 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "frame_buffer.h"
+
+namespace sdtrack {
+/// A single IMU measurement as stored in the shared-memory ring.
+struct ShmImuSample {
+  double time;
+  double a[3];
+  double w[3];
+};
+
+/// Layout of the start of the shared-memory segment. Frame slots follow the
+/// header, and the IMU ring follows the frame slots. Every index is a
+/// monotonically increasing sequence number which is reduced modulo the
+/// ring size to find the slot, so there are no locks shared between the
+/// producer and the consumer processes.
+struct ShmTransportHeader {
+  static const uint32_t kMagic = 0x5344544b;  // "SDTK"
+  static const uint32_t kVersion = 1;
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t num_cameras;
+  uint32_t width;
+  uint32_t height;
+  uint32_t num_slots;
+  uint32_t imu_capacity;
+  uint64_t slot_size;
+  uint64_t imu_offset;
+  /// Number of frame sets published by the producer.
+  std::atomic<uint64_t> frame_write_seq;
+  /// Number of frame sets the consumer has finished with. The producer never
+  /// overwrites a slot that has not been released.
+  std::atomic<uint64_t> frame_release_seq;
+  /// Number of IMU samples published by the producer.
+  std::atomic<uint64_t> imu_write_seq;
+};
+
+/// Per-slot header, followed by num_cameras images of width * height bytes.
+struct ShmFrameSlot {
+  uint64_t seq;
+  double timestamp;
+};
+
+///
+/// \brief Writes frames and IMU samples into a named shared-memory segment.
+/// Frames and IMU samples may be written from different threads, but each
+/// of the two streams must only have a single writer.
+///
+class ShmFrameProducer {
+public:
+  ShmFrameProducer() {}
+  ~ShmFrameProducer();
+
+  ///
+  /// \brief Create
+  /// \param name Name of the segment (as in shm_open, i.e. "/sdtrack").
+  /// \param num_cameras Number of images in each frame set.
+  /// \param width Width of every image.
+  /// \param height Height of every image.
+  /// \param num_slots Number of frame sets that can be in flight.
+  /// \param imu_capacity Number of IMU samples kept in the ring.
+  /// \return false if the segment could not be created.
+  ///
+  bool Create(const std::string& name, uint32_t num_cameras, uint32_t width,
+              uint32_t height, uint32_t num_slots = 4,
+              uint32_t imu_capacity = 4096);
+
+  /// Copies the images into the next free slot and publishes it. Returns
+  /// false if all slots are still held by the consumer.
+  bool WriteFrames(const std::vector<cv::Mat>& images, double timestamp);
+  void WriteImu(const ShmImuSample& sample);
+
+private:
+  std::string name_;
+  unsigned char* memory_ = nullptr;
+  size_t size_ = 0;
+  ShmTransportHeader* header_ = nullptr;
+};
+
+///
+/// \brief Reads frames and IMU samples published by a ShmFrameProducer.
+/// Frames are returned as buffers borrowing the shared memory directly, and
+/// the slot is handed back to the producer once every buffer of the frame
+/// set has been released.
+///
+class ShmFrameConsumer {
+public:
+  ShmFrameConsumer() {}
+
+  /// Attaches to an existing segment. Returns false if it does not exist or
+  /// was created by an incompatible producer.
+  bool Open(const std::string& name);
+
+  /// Returns the next unread frame set, or false if none has been published.
+  bool ReadFrames(std::vector<std::shared_ptr<FrameBuffer>>& frames,
+                  double& timestamp);
+  /// Appends all IMU samples published since the last call, and returns the
+  /// number of samples added.
+  uint32_t ReadImu(std::vector<ShmImuSample>& samples);
+
+  uint32_t num_cameras() const { return header()->num_cameras; }
+  uint32_t width() const { return header()->width; }
+  uint32_t height() const { return header()->height; }
+
+private:
+  /// Owns the mapping. Outstanding frame buffers hold a reference on it, so
+  /// the memory stays mapped until all of them have been released.
+  struct Mapping {
+    ~Mapping();
+    void Release(uint64_t seq);
+
+    unsigned char* memory = nullptr;
+    size_t size = 0;
+    std::mutex release_mutex;
+    std::vector<uint64_t> out_of_order_releases;
+  };
+
+  ShmTransportHeader* header() const {
+    return reinterpret_cast<ShmTransportHeader*>(mapping_->memory);
+  }
+
+  std::shared_ptr<Mapping> mapping_;
+  uint64_t next_frame_seq_ = 0;
+  uint64_t next_imu_seq_ = 0;
+};
+}
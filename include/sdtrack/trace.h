@@ -0,0 +1,112 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Scoped trace spans. Building without SDTRACK_TRACE removes them entirely;
+// with it, a disabled recorder costs a single relaxed atomic load per span.
+#define SDTRACK_TRACE_CONCAT_INNER(a, b) a ## b
+#define SDTRACK_TRACE_CONCAT(a, b) SDTRACK_TRACE_CONCAT_INNER(a, b)
+#ifdef SDTRACK_TRACE
+#define SDTRACK_TRACE_SCOPE(name)                                       \
+  sdtrack::TraceScope SDTRACK_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define SDTRACK_TRACE_SCOPE_ARG(name, arg)                              \
+  sdtrack::TraceScope SDTRACK_TRACE_CONCAT(trace_scope_, __LINE__)(name, arg)
+#else
+#define SDTRACK_TRACE_SCOPE(name) ((void)0)
+#define SDTRACK_TRACE_SCOPE_ARG(name, arg) ((void)0)
+#endif
+
+namespace sdtrack {
+/// A completed span. Names must be string literals (or otherwise outlive the
+/// recorder) since only the pointer is stored.
+struct TraceEvent {
+  const char* name;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  int64_t arg;
+};
+
+///
+/// \brief Records spans into one fixed-size ring per thread. Each ring has a
+/// single writer (its thread) and is published through an atomic sequence
+/// number, so recording never takes a lock or allocates. Only registering a
+/// new thread and exporting take the registry mutex.
+///
+class TraceRecorder {
+public:
+  static const uint32_t kEventsPerThread = 1 << 14;
+  static constexpr int64_t kNoArg = std::numeric_limits<int64_t>::min();
+
+  static TraceRecorder& Instance();
+
+  void set_enabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+  bool enabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+  }
+
+  void Record(const char* name, uint64_t start_ns, uint64_t end_ns,
+              int64_t arg);
+
+  /// Writes every event still held in the rings as Chrome/Perfetto trace
+  /// JSON (load it in chrome://tracing or ui.perfetto.dev).
+  bool WriteChromeTrace(const std::string& filename);
+  /// Hides every event recorded so far from later exports. Threads may keep
+  /// recording meanwhile.
+  void Clear();
+
+  static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+private:
+  struct ThreadBuffer {
+    explicit ThreadBuffer(uint32_t id) : tid(id), events(kEventsPerThread) {}
+    uint32_t tid;
+    std::atomic<uint64_t> write_seq{0};
+    /// Exports start at this sequence number. Only Clear writes it, so the
+    /// owning thread cannot overwrite a clear.
+    std::atomic<uint64_t> clear_seq{0};
+    std::vector<TraceEvent> events;
+  };
+
+  TraceRecorder() {}
+  ThreadBuffer* GetThreadBuffer();
+
+  std::atomic<bool> enabled_{false};
+  std::mutex registry_mutex_;
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+};
+
+class TraceScope {
+public:
+  explicit TraceScope(const char* name,
+                      int64_t arg = TraceRecorder::kNoArg) :
+    name_(name), arg_(arg),
+    start_ns_(TraceRecorder::Instance().enabled() ?
+                TraceRecorder::NowNs() : 0) {}
+
+  ~TraceScope() {
+    if (start_ns_ != 0) {
+      TraceRecorder::Instance().Record(name_, start_ns_,
+                                       TraceRecorder::NowNs(), arg_);
+    }
+  }
+
+private:
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+  const char* name_;
+  int64_t arg_;
+  uint64_t start_ns_;
+};
+}
@@ -91,7 +91,9 @@ namespace sdtrack
             ref_keypoint.patch_pyramid[0].dim;
       }
       ref_keypoint.track = this;
-      external_id.resize(2);
+      // Two adjusters of the tracking application, plus one per camera for
+      // online calibration.
+      external_id.resize(2 + num_cameras);
     }
 
     std::vector<PatchTransfer> transfer;
@@ -110,6 +112,8 @@ namespace sdtrack
     std::vector<Eigen::Vector2d> offset_2d;
     bool is_outlier = false;
     bool needs_backprojection = false;
+    // Calibration epoch of the tracker when the patch rays were computed.
+    uint32_t calibration_epoch = 0;
     Sophus::SE3d t_ba;
 
     double v_inv_vec;
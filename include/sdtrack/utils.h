@@ -4,6 +4,7 @@
 #include <sophus/se3.hpp>
 #include <vector>
 #include <iostream>
+#include "diagnostics.h"
 
 #ifdef REAL_TYPE
 typedef REAL_TYPE Scalar;
@@ -129,13 +130,14 @@ namespace sdtrack
       double y,						//< Input: Y coordinate
       const unsigned char* pImage,	//< Input: Pointer to Image
       const unsigned int uImageWidth,	//< Input: Image width
-      const unsigned int uImageHeight	//< Input: Image height
+      const unsigned int uImageHeight,	//< Input: Image height
+      const size_t uImageStride = 0	//< Input: Row stride, 0 if width
       )
   {
+    const size_t stride = uImageStride == 0 ? uImageWidth : uImageStride;
         if( !(x >= 0 && y >= 0 && x <= uImageWidth - 1 &&
               y <= uImageHeight - 1) ){
-          std::cerr << "\t!!BAD: " << x << ", " << y << " w: " << uImageWidth <<
-                       " h " << uImageHeight << std::endl;
+          SDTRACK_COUNT("Out of bounds image samples");
         }
     //    x = std::max(std::min(x,(double)uImageWidth-2.0),2.0);
     //    y = std::max(std::min(y,(double)uImageHeight-2.0),2.0);
@@ -147,7 +149,7 @@ namespace sdtrack
     const double ax1 = 1.0 - ax;
     const double ay1 = 1.0 - ay;
 
-    const unsigned char* p0 = pImage + (uImageWidth*py) + px;
+    const unsigned char* p0 = pImage + (stride*py) + px;
     //    const unsigned char& p1 = p0[0];
     //    const unsigned char& p2 = p0[1];
     //    const unsigned char& p3 = p0[ImageWidth];
@@ -156,8 +158,8 @@ namespace sdtrack
 
     double p1 = (double)p0[0];
     double p2 = (double)p0[1];
-    double p3 = (double)p0[uImageWidth];
-    double p4 = (double)p0[uImageWidth+1];
+    double p3 = (double)p0[stride];
+    double p4 = (double)p0[stride+1];
     p1 *= ay1;
     p2 *= ay1;
     p3 *= ay;
@@ -222,12 +224,14 @@ namespace sdtrack
       uint32_t   patch_dim,
       double     k,              //< Input: Harris constant
       double&    l1,
-      double&    l2
+      double&    l2,
+      size_t     image_stride = 0 //< Input: Row stride, 0 if width
       )
   {
 
     double dHessian[4];
-    ComputeHessian( image, image_width, image_height, col, row,
+    ComputeHessian( image, image_stride == 0 ? image_width : image_stride,
+                    image_height, col, row,
                     patch_dim, patch_dim, &dHessian[0] );
 
     double det   = dHessian[0]*dHessian[3] - dHessian[1]*dHessian[1];
@@ -244,7 +248,8 @@ namespace sdtrack
                           uint32_t           image_height,
                           uint32_t           patch_dim,
                           std::vector< cv::KeyPoint >& points,
-                          double                       k = 0.04)
+                          double                       k = 0.04,
+                          size_t                       image_stride = 0)
   {
 
     std::vector< cv::KeyPoint >::iterator it;
@@ -259,7 +264,7 @@ namespace sdtrack
       double l1, l2;
       it->response = ComputeScore(image, image_width, image_height,
                                   it->pt.y, it->pt.x,
-                                  patch_dim, k, l1, l2);
+                                  patch_dim, k, l1, l2, image_stride);
       it->angle = std::max(l1, l2);
     }
   }
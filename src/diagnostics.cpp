@@ -0,0 +1,141 @@
+#include <sdtrack/diagnostics.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+using namespace sdtrack;
+
+namespace {
+const char* kLevelNames[] = {"E", "W", "I", "F", "D"};
+}
+
+DiagnosticCounter::DiagnosticCounter(const char* name) :
+  name_(name), count_(0) {
+  DiagnosticSink::Instance().Register(this);
+}
+
+DiagnosticCounter::~DiagnosticCounter() {
+  DiagnosticSink::Instance().Unregister(this);
+}
+
+DiagnosticSink& DiagnosticSink::Instance() {
+  static DiagnosticSink sink;
+  return sink;
+}
+
+DiagnosticSink::DiagnosticSink() :
+  thread_(&DiagnosticSink::Run, this) {}
+
+DiagnosticSink::~DiagnosticSink() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  queue_cond_.notify_one();
+  thread_.join();
+}
+
+void DiagnosticSink::Push(int level, std::string&& message) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.emplace_back(level, std::move(message));
+  }
+  queue_cond_.notify_one();
+}
+
+void DiagnosticSink::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  flushed_cond_.wait(lock, [this]() {
+    return queue_.empty() && !is_writing_;
+  });
+}
+
+void DiagnosticSink::Register(DiagnosticCounter* counter) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  counters_.push_back(counter);
+}
+
+void DiagnosticSink::Unregister(DiagnosticCounter* counter) {
+  std::vector<CounterReport> reports;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Counters go away at exit, make sure their last counts are not lost.
+    ReportCounter(counter, reports);
+    counters_.erase(std::remove(counters_.begin(), counters_.end(), counter),
+                    counters_.end());
+  }
+  WriteCounterReports(reports);
+}
+
+void DiagnosticSink::ReportCounter(DiagnosticCounter* counter,
+                                   std::vector<CounterReport>& reports) {
+  // Called with the mutex held. Only the counts are taken here, they are
+  // written once the mutex has been released.
+  const uint64_t count = counter->count();
+  if (count != counter->reported_count_) {
+    reports.push_back({counter->name(), count - counter->reported_count_,
+                       count});
+    counter->reported_count_ = count;
+  }
+}
+
+void DiagnosticSink::ReportCounters(std::vector<CounterReport>& reports) {
+  for (DiagnosticCounter* counter : counters_) {
+    ReportCounter(counter, reports);
+  }
+}
+
+void DiagnosticSink::WriteCounterReports(
+    const std::vector<CounterReport>& reports) {
+  for (const CounterReport& report : reports) {
+    std::cerr << "[sdtrack] " << report.name << ": +" << report.increment
+              << " (total " << report.count << ")\n";
+  }
+  if (!reports.empty()) {
+    std::cerr.flush();
+  }
+}
+
+void DiagnosticSink::Run() {
+  std::deque<std::pair<int, std::string>> messages;
+  std::vector<CounterReport> reports;
+  auto next_report = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    const auto now = std::chrono::steady_clock::now();
+    if (now >= next_report || quit_) {
+      ReportCounters(reports);
+      next_report = now + std::chrono::duration_cast<
+          std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(report_period_));
+    }
+
+    if (queue_.empty() && reports.empty()) {
+      if (quit_) {
+        break;
+      }
+      queue_cond_.wait_until(lock, next_report);
+      continue;
+    }
+
+    // Write outside of the lock so producers never wait on the stream.
+    messages.swap(queue_);
+    is_writing_ = true;
+    lock.unlock();
+    WriteCounterReports(reports);
+    for (const std::pair<int, std::string>& message : messages) {
+      std::cerr << "[sdtrack " << kLevelNames[message.first] << "] "
+                << message.second;
+      if (message.second.empty() || message.second.back() != '\n') {
+        std::cerr << '\n';
+      }
+    }
+    std::cerr.flush();
+    messages.clear();
+    reports.clear();
+    lock.lock();
+    is_writing_ = false;
+    flushed_cond_.notify_all();
+  }
+  flushed_cond_.notify_all();
+}
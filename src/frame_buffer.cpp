@@ -0,0 +1,88 @@
+#include <glog/logging.h>
+#include <sdtrack/frame_buffer.h>
+
+using namespace sdtrack;
+
+FrameBuffer::FrameBuffer(const cv::Mat& mat, ReleaseCallback release,
+                         std::shared_ptr<FrameBuffer> parent) :
+  mat_(mat),
+  release_(release),
+  parent_(parent) {}
+
+FrameBuffer::~FrameBuffer() {
+  if (release_) {
+    release_(mat_.data);
+  }
+}
+
+std::shared_ptr<FrameBuffer> FrameBuffer::Borrow(unsigned char* data,
+                                                 uint32_t width,
+                                                 uint32_t height,
+                                                 size_t stride,
+                                                 ReleaseCallback release) {
+  CHECK(data != nullptr);
+  if (stride == 0) {
+    stride = width;
+  }
+  CHECK_GE(stride, width);
+  // This constructor does not allocate or refcount, it only wraps the data.
+  const cv::Mat header(height, width, CV_8UC1, data, stride);
+  return std::shared_ptr<FrameBuffer>(
+        new FrameBuffer(header, release, nullptr));
+}
+
+std::shared_ptr<FrameBuffer> FrameBuffer::Borrow(const cv::Mat& image,
+                                                 ReleaseCallback release) {
+  CHECK_EQ(image.type(), CV_8UC1) << "Only 8-bit grayscale is supported.";
+  return std::shared_ptr<FrameBuffer>(
+        new FrameBuffer(image, release, nullptr));
+}
+
+std::shared_ptr<FrameBuffer> FrameBuffer::Roi(const cv::Rect& roi) {
+  CHECK(roi.x >= 0 && roi.y >= 0 && roi.x + roi.width <= mat_.cols &&
+        roi.y + roi.height <= mat_.rows) << "ROI outside of the frame.";
+  return std::shared_ptr<FrameBuffer>(
+        new FrameBuffer(mat_(roi), ReleaseCallback(), shared_from_this()));
+}
+
+FrameBufferPool::FrameBufferPool(uint32_t width, uint32_t height,
+                                 uint32_t capacity, size_t stride) :
+  width_(width),
+  height_(height),
+  stride_(stride == 0 ? width : stride),
+  capacity_(capacity),
+  storage_(new Storage) {
+  CHECK_GE(stride_, width_);
+  const size_t buffer_size = stride_ * height_;
+  storage_->memory.resize(buffer_size * capacity_);
+  storage_->free_buffers.reserve(capacity_);
+  for (uint32_t ii = 0; ii < capacity_; ++ii) {
+    storage_->free_buffers.push_back(&storage_->memory[ii * buffer_size]);
+  }
+}
+
+std::shared_ptr<FrameBuffer> FrameBufferPool::Acquire() {
+  unsigned char* data = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(storage_->mutex);
+    if (storage_->free_buffers.empty()) {
+      return nullptr;
+    }
+    data = storage_->free_buffers.back();
+    storage_->free_buffers.pop_back();
+  }
+
+  // The callback holds on to the storage, so buffers that are still in
+  // flight keep the memory alive even if the pool itself is destroyed.
+  std::shared_ptr<Storage> storage = storage_;
+  return FrameBuffer::Borrow(data, width_, height_, stride_,
+                             [storage](unsigned char* released) {
+    std::lock_guard<std::mutex> lock(storage->mutex);
+    storage->free_buffers.push_back(released);
+  });
+}
+
+uint32_t FrameBufferPool::num_free() const {
+  std::lock_guard<std::mutex> lock(storage_->mutex);
+  return storage_->free_buffers.size();
+}
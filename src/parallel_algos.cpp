@@ -526,3 +526,16 @@ void Parallel2dAlignment::operator()(const tbb::blocked_range<int> &r) const
   }
 }
 
+
+ParallelBackProject::ParallelBackProject(
+    SemiDenseTracker &tracker_ref,
+    std::vector<std::shared_ptr<DenseTrack> > &tracks_v) :
+  tracker(tracker_ref),
+  tracks(tracks_v) {}
+
+void ParallelBackProject::operator()(const tbb::blocked_range<int> &r) const
+{
+  for (int ii = r.begin(); ii != r.end(); ii++) {
+    tracker.BackProjectTrack(tracks[ii]);
+  }
+}
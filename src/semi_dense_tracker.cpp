@@ -1,6 +1,8 @@
 #include <glog/logging.h>
 #include <sdtrack/semi_dense_tracker.h>
 #include <sdtrack/parallel_algos.h>
+#include <sdtrack/trace.h>
+#include <sdtrack/diagnostics.h>
 #include <CVars/CVar.h>
 
 using namespace sdtrack;
@@ -162,10 +164,10 @@ void SemiDenseTracker::ExtractKeypoints(const cv::Mat& image,
   }
 
   HarrisScore(image.data, image.cols, image.rows,
-              tracker_options_.patch_dim, keypoints);
-  LOG(INFO) << "extract feature detection for " << keypoints.size() <<
+              tracker_options_.patch_dim, keypoints, 0.04, image.step);
+  SDTRACK_LOG(DEBUG) << "extract feature detection for " << keypoints.size() <<
       " and "  << cells_hit << " cells " <<  " keypoints took " <<
-      Toc(time) << " seconds." << std::endl;
+      Toc(time) << " seconds.";
 }
 
 bool SemiDenseTracker::IsKeypointValid(const cv::KeyPoint& kp,
@@ -215,6 +217,8 @@ void SemiDenseTracker::BackProjectTrack(std::shared_ptr<DenseTrack> track,
                                         bool initialize_pixel_vals) {
   const uint32_t cam_id = track->ref_cam_id;
   DenseKeypoint& kp = track->ref_keypoint;
+  track->calibration_epoch = calibration_epoch_;
+  track->needs_backprojection = false;
   // Unproject the center pixel for this track.
   kp.ray =
       camera_rig_->cameras_[cam_id]->Unproject(kp.center_px).normalized() *
@@ -508,8 +512,7 @@ void SemiDenseTracker::ReprojectTrackCenters() {
             tracker_options_.feature_cells;
         if (addressy > feature_cells_[cam_id].rows() ||
             addressx > feature_cells_[cam_id].cols()) {
-          LOG(INFO) << "Out of bounds feature cell access at : " << addressy <<
-              ", " << addressx << std::endl;
+          SDTRACK_COUNT("Out of bounds feature cell accesses");
         }
         if (feature_cells_[cam_id](addressy, addressx) != kUnusedCell) {
           feature_cells_[cam_id](addressy, addressx)++;
@@ -570,6 +573,7 @@ void SemiDenseTracker::OptimizeTracks(const OptimizationOptions &options,
     double time = Tic();
     for (int ii = tracker_options_.pyramid_levels - 1 ; ii >= 0 ; ii--) {
       last_level = ii;
+      SDTRACK_TRACE_SCOPE_ARG("OptimizeTracks.level", last_level);
 
       if (options.trust_guess) {
         level_options.optimize_landmarks = true;
@@ -595,11 +599,11 @@ void SemiDenseTracker::OptimizeTracks(const OptimizationOptions &options,
         }
       }
 
-      LOG(INFO)
+      SDTRACK_LOG(DEBUG)
           << "Auto optim. level " << last_level << " with pose : " <<
              level_options.optimize_pose << " and lm : " <<
              level_options.optimize_landmarks << " with av track " <<
-             average_track_length_ << std::endl;
+             average_track_length_;
 
       uint32_t iterations = 0;
       // Continuously iterate this pyramid level until we meet a stop
@@ -645,7 +649,8 @@ void SemiDenseTracker::OptimizeTracks(const OptimizationOptions &options,
       } while (!pose_exit && !landmark_exit);
     }
 
-    std::cerr << "Pyramid optimization took " << Toc(time) << " seconds." << std::endl;
+    SDTRACK_LOG(FRAME) << "Pyramid optimization took " << Toc(time) <<
+                          " seconds.";
 
     time = Tic();
     // Do final 2d alignment of tracks.
@@ -654,33 +659,33 @@ void SemiDenseTracker::OptimizeTracks(const OptimizationOptions &options,
     alignment_options.only_optimize_camera_id = options.only_optimize_camera_id;
     Do2dAlignment(alignment_options, GetImagePyramid(), GetCurrentTracks(), 0);
 
-    std::cerr << "2D alignment optimization took " << Toc(time) << " seconds." << std::endl;
+    SDTRACK_LOG(FRAME) << "2D alignment optimization took " << Toc(time) <<
+                          " seconds.";
   } else {
     // The user has specified the pyramid level they want optimized.
     level_options.optimize_landmarks = options.optimize_landmarks;
     level_options.optimize_pose = options.optimize_pose;
     level_options.only_optimize_camera_id = options.only_optimize_camera_id;
     t_ba_old_ = t_ba_;
+    SDTRACK_TRACE_SCOPE_ARG("OptimizeTracks.level", level);
     OptimizePyramidLevel(level, image_pyramid_, current_tracks_,
                          level_options, stats);
     ///zzzzzz evaluate residuals at all levels so we can see
     for (uint32_t ii = 0 ; ii < tracker_options_.pyramid_levels ; ++ii)  {
       if (ii != level) {
-        LOG(INFO) << "post rmse: " << ii << " " <<
+        SDTRACK_LOG(DEBUG) << "post rmse: " << ii << " " <<
                                 EvaluateTrackResiduals(ii, image_pyramid_,
                                                        current_tracks_, false,
-                                                       true) <<
-                                std::endl;
+                                                       true);
       }
     }
     double post_error = EvaluateTrackResiduals(
         level, image_pyramid_, current_tracks_, false, true);
-    LOG(INFO) << "post rmse: " << post_error << " " << "pre : " <<
-        stats.pre_solve_error << std::endl;
+    SDTRACK_LOG(DEBUG) << "post rmse: " << post_error << " " << "pre : " <<
+        stats.pre_solve_error;
     if (post_error > stats.pre_solve_error) {
-      LOG(INFO) << "Exiting due to " << post_error << " > " <<
-          stats.pre_solve_error << " rolling back. " <<
-          std::endl;
+      SDTRACK_LOG(DEBUG) << "Exiting due to " << post_error << " > " <<
+          stats.pre_solve_error << " rolling back. ";
 
       roll_back = true;
     }
@@ -706,13 +711,14 @@ void SemiDenseTracker::OptimizeTracks(const OptimizationOptions &options,
   ReprojectTrackCenters();
 
   // Print pre-post errors
-  LOG(INFO) << "Level " << level << " solve took " << Toc(time) <<
+  SDTRACK_LOG(FRAME) << "Level " << level << " solve took " << Toc(time) <<
                           "s" << " with delta_p_norm: " <<
                           stats.delta_pose_norm << " and delta lm norm: " <<
-                          stats.delta_lm_norm << std::endl;
+                          stats.delta_lm_norm;
 }
 
 void SemiDenseTracker::PruneTracks(int only_prune_camera) {
+  SDTRACK_TRACE_SCOPE("PruneTracks");
   if (image_pyramid_.size() == 0) {
     return;
   }
@@ -775,6 +781,24 @@ void SemiDenseTracker::PruneOutliers() {
 }
 
 
+void SemiDenseTracker::BackProjectStaleTracks() {
+  std::vector<std::shared_ptr<DenseTrack>> track_vec;
+  for (const std::shared_ptr<DenseTrack>& track : current_tracks_) {
+    if (track->needs_backprojection ||
+        track->calibration_epoch != calibration_epoch_) {
+      track_vec.push_back(track);
+    }
+  }
+  if (track_vec.empty()) {
+    return;
+  }
+
+  SDTRACK_TRACE_SCOPE_ARG("BackProjectStaleTracks", track_vec.size());
+  ParallelBackProject backproject(*this, track_vec);
+  tbb::parallel_for(tbb::blocked_range<int>(0, track_vec.size()),
+                    backproject);
+}
+
 void SemiDenseTracker::TransferPatch(std::shared_ptr<DenseTrack> track,
                                      uint32_t level,
                                      uint32_t cam_id,
@@ -800,9 +824,11 @@ void SemiDenseTracker::TransferPatch(std::shared_ptr<DenseTrack> track,
 
   result.mean_value = 0;
 
-  if (track->needs_backprojection) {
+  // Stale tracks are normally backprojected in a batch when the image is
+  // added, this only catches calibration changes since then.
+  if (track->needs_backprojection ||
+      track->calibration_epoch != calibration_epoch_) {
     BackProjectTrack(track);
-    track->needs_backprojection = false;
   }
 
   // If we are doing simplified (4 corner) patch transfer, transfer the four
@@ -902,9 +928,7 @@ void SemiDenseTracker::TransferPatch(std::shared_ptr<DenseTrack> track,
       result.valid_projections.push_back(pix);
       result.valid_rays.push_back(ii);
       if (std::isnan(pix[0]) || std::isnan(pix[1])) {
-        LOG(INFO) << "Pixel at: " << pix.transpose() <<
-            " center ray: " << ref_kp.ray << " rho: " <<
-            ref_kp.rho << std::endl;
+        SDTRACK_COUNT("NaN patch reprojections");
       }
       const double val = GetSubPix(image_pyramid_[cam_id][level],
                                    pix[0], pix[1]);
@@ -923,6 +947,7 @@ void SemiDenseTracker::TransferPatch(std::shared_ptr<DenseTrack> track,
 }
 
 void SemiDenseTracker::StartNewLandmarks(int only_start_in_camera) {
+  SDTRACK_TRACE_SCOPE("StartNewLandmarks");
   // Afterwards, we must spawn a number of new tracks
   const int num_new_tracks =
       std::max(0, (int)tracker_options_.num_active_tracks -
@@ -945,10 +970,10 @@ void SemiDenseTracker::StartNewLandmarks(int only_start_in_camera) {
         StartNewTracks(image_pyramid_[cam_id], cv_keypoints, num_new_tracks,
                        cam_id);
 
-    LOG(INFO) << "Tracked: " << num_successful_tracks_ << " started " <<
+    SDTRACK_LOG(DEBUG) << "Tracked: " << num_successful_tracks_ << " started " <<
         started << " out of " << num_new_tracks <<
         " new tracks with " << cv_keypoints.size() <<
-        " keypoints in cam " << cam_id <<  std::endl;
+        " keypoints in cam " << cam_id;
   }
 }
 
@@ -978,6 +1003,7 @@ void SemiDenseTracker::Do2dAlignment(
     const std::vector<std::vector<cv::Mat>>& image_pyrmaid,
     std::list<std::shared_ptr<DenseTrack>>& tracks,
     uint32_t level) {
+  SDTRACK_TRACE_SCOPE_ARG("Do2dAlignment", level);
   for (uint32_t cam_id = 0; cam_id < num_cameras_; ++cam_id) {
     const Sophus::SE3d t_cv = camera_rig_->cameras_[cam_id]->Pose().inverse();
 
@@ -1050,11 +1076,12 @@ void SemiDenseTracker::OptimizePyramidLevel(
         stats.delta_lm_norm += fabs(delta_ray);
 
         if (std::isnan(delta_ray) || std::isinf(delta_ray)) {
-          LOG(INFO) << "delta_ray " << track->id << ": " << delta_ray <<
+          SDTRACK_COUNT("Non-finite landmark updates");
+          SDTRACK_LOG(DEBUG) << "delta_ray " << track->id << ": " << delta_ray <<
               "vinv:" << track->v_inv_vec/*v_inv_vec[track->opt_id]*/ << " r_l " <<
               track->r_l_vec /*r_l_vec(track->residual_offset)*/ << " w: " <<
               track->w_vec.transpose() /*w_vec[track->opt_id].transpose()*/ << "dp : " <<
-              delta_p.transpose() << std::endl;
+              delta_p.transpose();
         }
 
         if (track->ref_keypoint.rho < 0) {
@@ -1074,14 +1101,32 @@ void SemiDenseTracker::OptimizePyramidLevel(
 
 
 double SemiDenseTracker::GetSubPix(const cv::Mat& image, double x, double y) {
-  return Interpolate(x, y, image.data, image.cols, image.rows);
+  return Interpolate(x, y, image.data, image.cols, image.rows, image.step);
+}
+
+void SemiDenseTracker::AddImage(
+    const std::vector<std::shared_ptr<FrameBuffer>>& frames,
+    const Sophus::SE3d& t_ba_guess) {
+  CHECK_GE(frames.size(), num_cameras_);
+  std::vector<cv::Mat> images(frames.size());
+  for (uint32_t cam_id = 0; cam_id < frames.size(); ++cam_id) {
+    images[cam_id] = frames[cam_id]->mat();
+  }
+  AddImage(images, t_ba_guess);
+  // Only now that the pyramid no longer points at the previous frames is it
+  // safe to hand them back.
+  frame_buffers_ = frames;
 }
 
 void SemiDenseTracker::AddImage(const std::vector<cv::Mat>& images,
                                 const Sophus::SE3d& t_ba_guess) {
+  SDTRACK_TRACE_SCOPE("AddImage");
   // If there were any outliers (externally marked), now is the time to prune
   // them.
   PruneOutliers();
+  // Rays of tracks that predate a calibration change are redone here, before
+  // the tracks are transferred.
+  BackProjectStaleTracks();
 
   // Clear out all 2d offsets for new tracks
   for (uint32_t cam_id = 0; cam_id < num_cameras_ ; ++cam_id) {
@@ -1108,6 +1153,7 @@ void SemiDenseTracker::AddImage(const std::vector<cv::Mat>& images,
   // Create the image pyramid for the incoming image
   for (uint32_t cam_id = 0 ; cam_id < num_cameras_ ; ++cam_id) {
     image_pyramid_[cam_id].resize(tracker_options_.pyramid_levels);
+    // Level 0 shares the caller's pixels, it is never copied.
     image_pyramid_[cam_id][0] = images[cam_id];
     for (uint32_t ii = 1 ; ii < tracker_options_.pyramid_levels ; ++ii) {
       cv::resize(image_pyramid_[cam_id][ii - 1],
@@ -0,0 +1,310 @@
+#include <glog/logging.h>
+#include <sdtrack/shm_transport.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+using namespace sdtrack;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "Shared-memory sequence numbers must be lock-free.");
+
+namespace {
+const size_t kShmAlignment = 64;
+
+inline size_t AlignUp(size_t size) {
+  return (size + kShmAlignment - 1) / kShmAlignment * kShmAlignment;
+}
+
+inline size_t HeaderSize() {
+  return AlignUp(sizeof(ShmTransportHeader));
+}
+
+inline ShmFrameSlot* GetSlot(unsigned char* memory,
+                             const ShmTransportHeader& header, uint64_t seq) {
+  return reinterpret_cast<ShmFrameSlot*>(
+        memory + HeaderSize() + (seq % header.num_slots) * header.slot_size);
+}
+
+inline unsigned char* GetSlotImage(ShmFrameSlot* slot,
+                                   const ShmTransportHeader& header,
+                                   uint32_t cam_id) {
+  return reinterpret_cast<unsigned char*>(slot) +
+      AlignUp(sizeof(ShmFrameSlot)) +
+      (size_t)cam_id * header.width * header.height;
+}
+
+inline ShmImuSample* GetImuRing(unsigned char* memory,
+                                const ShmTransportHeader& header) {
+  return reinterpret_cast<ShmImuSample*>(memory + header.imu_offset);
+}
+
+// Whether the slots and the IMU ring the header describes lie within size
+// bytes. Every product is bounded by size first, so none of them overflow.
+bool LayoutFits(const ShmTransportHeader& header, size_t size) {
+  if (header.num_slots == 0 || header.imu_capacity == 0 ||
+      (header.width != 0 && header.height > size / header.width)) {
+    return false;
+  }
+  const uint64_t image_size = (uint64_t)header.width * header.height;
+  if (image_size != 0 && header.num_cameras > size / image_size) {
+    return false;
+  }
+  if (header.slot_size <
+      AlignUp(sizeof(ShmFrameSlot)) + header.num_cameras * image_size ||
+      header.slot_size > size / header.num_slots) {
+    return false;
+  }
+  if (header.imu_offset < HeaderSize() + header.num_slots * header.slot_size ||
+      header.imu_offset > size) {
+    return false;
+  }
+  return header.imu_capacity <=
+      (size - header.imu_offset) / sizeof(ShmImuSample);
+}
+}
+
+ShmFrameProducer::~ShmFrameProducer() {
+  if (memory_) {
+    munmap(memory_, size_);
+    shm_unlink(name_.c_str());
+  }
+}
+
+bool ShmFrameProducer::Create(const std::string& name, uint32_t num_cameras,
+                              uint32_t width, uint32_t height,
+                              uint32_t num_slots, uint32_t imu_capacity) {
+  CHECK(memory_ == nullptr) << "Producer already created.";
+  CHECK_GT(num_slots, 0u);
+  CHECK_GT(imu_capacity, 0u);
+  const size_t slot_size = AlignUp(
+        AlignUp(sizeof(ShmFrameSlot)) + (size_t)num_cameras * width * height);
+  const size_t imu_offset = HeaderSize() + num_slots * slot_size;
+  const size_t size = imu_offset + imu_capacity * sizeof(ShmImuSample);
+
+  // Start from a clean segment in case a previous producer crashed.
+  shm_unlink(name.c_str());
+  const int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0666);
+  if (fd < 0) {
+    LOG(ERROR) << "Could not create shared memory " << name << ": "
+               << strerror(errno);
+    return false;
+  }
+  if (ftruncate(fd, size) != 0) {
+    LOG(ERROR) << "Could not size shared memory " << name << ": "
+               << strerror(errno);
+    close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+  void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    LOG(ERROR) << "Could not map shared memory " << name << ": "
+               << strerror(errno);
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  name_ = name;
+  memory_ = static_cast<unsigned char*>(memory);
+  size_ = size;
+  header_ = new (memory_) ShmTransportHeader;
+  header_->version = ShmTransportHeader::kVersion;
+  header_->num_cameras = num_cameras;
+  header_->width = width;
+  header_->height = height;
+  header_->num_slots = num_slots;
+  header_->imu_capacity = imu_capacity;
+  header_->slot_size = slot_size;
+  header_->imu_offset = imu_offset;
+  header_->frame_write_seq.store(0);
+  header_->frame_release_seq.store(0);
+  header_->imu_write_seq.store(0);
+  // Publish the magic last so a consumer never sees a partial header.
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = ShmTransportHeader::kMagic;
+  return true;
+}
+
+bool ShmFrameProducer::WriteFrames(const std::vector<cv::Mat>& images,
+                                   double timestamp) {
+  CHECK(header_ != nullptr);
+  CHECK_EQ(images.size(), header_->num_cameras);
+  const uint64_t seq =
+      header_->frame_write_seq.load(std::memory_order_relaxed);
+  if (seq - header_->frame_release_seq.load(std::memory_order_acquire) >=
+      header_->num_slots) {
+    return false;
+  }
+
+  ShmFrameSlot* slot = GetSlot(memory_, *header_, seq);
+  for (uint32_t cam_id = 0; cam_id < images.size(); ++cam_id) {
+    const cv::Mat& image = images[cam_id];
+    CHECK_EQ(image.type(), CV_8UC1);
+    CHECK(image.cols == (int)header_->width &&
+          image.rows == (int)header_->height) << "Image size mismatch.";
+    unsigned char* dst = GetSlotImage(slot, *header_, cam_id);
+    for (int row = 0; row < image.rows; ++row) {
+      memcpy(dst + row * header_->width, image.ptr(row), header_->width);
+    }
+  }
+  slot->seq = seq;
+  slot->timestamp = timestamp;
+  header_->frame_write_seq.store(seq + 1, std::memory_order_release);
+  return true;
+}
+
+void ShmFrameProducer::WriteImu(const ShmImuSample& sample) {
+  CHECK(header_ != nullptr);
+  const uint64_t seq = header_->imu_write_seq.load(std::memory_order_relaxed);
+  GetImuRing(memory_, *header_)[seq % header_->imu_capacity] = sample;
+  header_->imu_write_seq.store(seq + 1, std::memory_order_release);
+}
+
+ShmFrameConsumer::Mapping::~Mapping() {
+  if (memory) {
+    munmap(memory, size);
+  }
+}
+
+void ShmFrameConsumer::Mapping::Release(uint64_t seq) {
+  ShmTransportHeader* header = reinterpret_cast<ShmTransportHeader*>(memory);
+  std::lock_guard<std::mutex> lock(release_mutex);
+  uint64_t released = header->frame_release_seq.load(std::memory_order_relaxed);
+  if (seq != released) {
+    // The slot can only be reused once all earlier slots are free as well.
+    out_of_order_releases.push_back(seq);
+    return;
+  }
+
+  ++released;
+  auto it = std::find(out_of_order_releases.begin(),
+                      out_of_order_releases.end(), released);
+  while (it != out_of_order_releases.end()) {
+    out_of_order_releases.erase(it);
+    ++released;
+    it = std::find(out_of_order_releases.begin(),
+                   out_of_order_releases.end(), released);
+  }
+  header->frame_release_seq.store(released, std::memory_order_release);
+}
+
+bool ShmFrameConsumer::Open(const std::string& name) {
+  const int fd = shm_open(name.c_str(), O_RDWR, 0666);
+  if (fd < 0) {
+    LOG(ERROR) << "Could not open shared memory " << name << ": "
+               << strerror(errno);
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      (size_t)info.st_size < sizeof(ShmTransportHeader)) {
+    LOG(ERROR) << "Shared memory " << name << " is not initialized.";
+    close(fd);
+    return false;
+  }
+  void* memory = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    LOG(ERROR) << "Could not map shared memory " << name << ": "
+               << strerror(errno);
+    return false;
+  }
+
+  std::shared_ptr<Mapping> mapping(new Mapping);
+  mapping->memory = static_cast<unsigned char*>(memory);
+  mapping->size = info.st_size;
+  const ShmTransportHeader* header =
+      reinterpret_cast<ShmTransportHeader*>(mapping->memory);
+  if (header->magic != ShmTransportHeader::kMagic ||
+      header->version != ShmTransportHeader::kVersion) {
+    LOG(ERROR) << "Shared memory " << name << " has an unknown layout.";
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!LayoutFits(*header, mapping->size)) {
+    LOG(ERROR) << "Shared memory " << name << " is smaller than its header "
+               << "describes.";
+    return false;
+  }
+
+  mapping_ = mapping;
+  // Pick up from the oldest frame nobody has consumed yet, and from the
+  // oldest IMU sample that is still in the ring. The slot of imu_seq itself
+  // may be in the middle of being written.
+  next_frame_seq_ = header->frame_release_seq.load(std::memory_order_acquire);
+  const uint64_t imu_seq =
+      header->imu_write_seq.load(std::memory_order_acquire);
+  next_imu_seq_ = imu_seq >= header->imu_capacity ?
+      imu_seq - header->imu_capacity + 1 : 0;
+  return true;
+}
+
+bool ShmFrameConsumer::ReadFrames(
+    std::vector<std::shared_ptr<FrameBuffer>>& frames, double& timestamp) {
+  CHECK(mapping_ != nullptr);
+  const ShmTransportHeader& header = *this->header();
+  if (next_frame_seq_ >=
+      header.frame_write_seq.load(std::memory_order_acquire)) {
+    return false;
+  }
+
+  const uint64_t seq = next_frame_seq_++;
+  ShmFrameSlot* slot = GetSlot(mapping_->memory, header, seq);
+  timestamp = slot->timestamp;
+
+  // All images of the set share one lease on the slot. When the last of
+  // them is released the slot is handed back to the producer.
+  std::shared_ptr<Mapping> mapping = mapping_;
+  std::shared_ptr<ShmFrameSlot> lease(slot, [mapping, seq](ShmFrameSlot*) {
+    mapping->Release(seq);
+  });
+
+  frames.resize(header.num_cameras);
+  for (uint32_t cam_id = 0; cam_id < header.num_cameras; ++cam_id) {
+    frames[cam_id] = FrameBuffer::Borrow(
+          GetSlotImage(slot, header, cam_id), header.width, header.height,
+          header.width, [lease](unsigned char*) {});
+  }
+  return true;
+}
+
+uint32_t ShmFrameConsumer::ReadImu(std::vector<ShmImuSample>& samples) {
+  CHECK(mapping_ != nullptr);
+  const ShmTransportHeader& header = *this->header();
+  const uint64_t write_seq =
+      header.imu_write_seq.load(std::memory_order_acquire);
+  // The producer writes the slot of write_seq before publishing it, so only
+  // the imu_capacity - 1 samples before it are intact.
+  if (write_seq - next_imu_seq_ >= header.imu_capacity) {
+    LOG(WARNING) << "Dropped " << write_seq - next_imu_seq_ -
+                    header.imu_capacity + 1 << " IMU samples.";
+    next_imu_seq_ = write_seq - header.imu_capacity + 1;
+  }
+
+  const ShmImuSample* ring = GetImuRing(mapping_->memory, header);
+  const size_t start = samples.size();
+  for (uint64_t seq = next_imu_seq_; seq < write_seq; ++seq) {
+    samples.push_back(ring[seq % header.imu_capacity]);
+  }
+
+  // If the producer lapped us while copying, the oldest samples may be torn,
+  // up to and including the one sharing a slot with lapped_seq.
+  const uint64_t lapped_seq =
+      header.imu_write_seq.load(std::memory_order_acquire);
+  if (lapped_seq - next_imu_seq_ >= header.imu_capacity) {
+    const size_t num_torn = std::min<uint64_t>(
+          lapped_seq - next_imu_seq_ - header.imu_capacity + 1, write_seq -
+          next_imu_seq_);
+    samples.erase(samples.begin() + start,
+                  samples.begin() + start + num_torn);
+  }
+  next_imu_seq_ = write_seq;
+  return samples.size() - start;
+}
@@ -0,0 +1,104 @@
+#include <glog/logging.h>
+#include <sdtrack/trace.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+using namespace sdtrack;
+
+constexpr int64_t TraceRecorder::kNoArg;
+
+TraceRecorder& TraceRecorder::Instance() {
+  static TraceRecorder recorder;
+  return recorder;
+}
+
+TraceRecorder::ThreadBuffer* TraceRecorder::GetThreadBuffer() {
+  // Registration happens once per thread, after that the buffer is cached.
+  static thread_local ThreadBuffer* buffer = nullptr;
+  if (buffer == nullptr) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    buffers_.emplace_back(new ThreadBuffer(buffers_.size()));
+    buffer = buffers_.back().get();
+  }
+  return buffer;
+}
+
+void TraceRecorder::Record(const char* name, uint64_t start_ns,
+                           uint64_t end_ns, int64_t arg) {
+  ThreadBuffer* buffer = GetThreadBuffer();
+  const uint64_t seq = buffer->write_seq.load(std::memory_order_relaxed);
+  TraceEvent& event = buffer->events[seq % kEventsPerThread];
+  event.name = name;
+  event.start_ns = start_ns;
+  event.duration_ns = end_ns - start_ns;
+  event.arg = arg;
+  buffer->write_seq.store(seq + 1, std::memory_order_release);
+}
+
+void TraceRecorder::Clear() {
+  std::lock_guard<std::mutex> lock(registry_mutex_);
+  for (std::shared_ptr<ThreadBuffer>& buffer : buffers_) {
+    // write_seq belongs to the owning thread, so rather than resetting it the
+    // export is told to start from where it is now.
+    buffer->clear_seq.store(buffer->write_seq.load(std::memory_order_acquire),
+                            std::memory_order_relaxed);
+  }
+}
+
+bool TraceRecorder::WriteChromeTrace(const std::string& filename) {
+  std::ofstream file(filename, std::ios_base::trunc);
+  if (!file.good()) {
+    LOG(ERROR) << "Could not open " << filename << " for writing.";
+    return false;
+  }
+
+  std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    buffers = buffers_;
+  }
+
+  file << "{\"traceEvents\":[";
+  bool first = true;
+  file << std::fixed << std::setprecision(3);
+  for (std::shared_ptr<ThreadBuffer>& buffer : buffers) {
+    // The event at end_seq may be in the middle of being written over the
+    // slot of end_seq - kEventsPerThread.
+    const uint64_t end_seq = buffer->write_seq.load(std::memory_order_acquire);
+    const uint64_t start_seq = std::max<uint64_t>(
+          end_seq >= kEventsPerThread ? end_seq - kEventsPerThread + 1 : 0,
+          buffer->clear_seq.load(std::memory_order_relaxed));
+    std::vector<TraceEvent> events;
+    events.reserve(end_seq - start_seq);
+    for (uint64_t seq = start_seq; seq < end_seq; ++seq) {
+      events.push_back(buffer->events[seq % kEventsPerThread]);
+    }
+
+    // The thread keeps recording while we copy, so drop any events that may
+    // have been overwritten in the meantime, including the one sharing a slot
+    // with the event being written.
+    const uint64_t written_seq =
+        buffer->write_seq.load(std::memory_order_acquire);
+    size_t num_stale = 0;
+    if (written_seq >= start_seq + kEventsPerThread) {
+      num_stale = std::min<uint64_t>(
+            written_seq - start_seq - kEventsPerThread + 1, events.size());
+    }
+
+    for (size_t ii = num_stale; ii < events.size(); ++ii) {
+      const TraceEvent& event = events[ii];
+      file << (first ? "" : ",") << "\n{\"name\":\"" << event.name
+           << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << buffer->tid
+           << ",\"ts\":" << event.start_ns * 1e-3
+           << ",\"dur\":" << event.duration_ns * 1e-3;
+      if (event.arg != kNoArg) {
+        file << ",\"args\":{\"arg\":" << event.arg << "}";
+      }
+      file << "}";
+      first = false;
+    }
+  }
+  file << "\n]}\n";
+  return file.good();
+}